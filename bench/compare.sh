@@ -0,0 +1,51 @@
+#!/bin/sh
+# Compares two results of suite.sh scenario by scenario. Fails when the
+# minimum wall time grew by more than $THRESHOLD percent, or when libtree made
+# more system calls than before. The minimum is less noisy than the median.
+
+THRESHOLD=${THRESHOLD:-10}
+
+if [ $# -ne 2 ]; then
+    echo "usage: compare.sh baseline.json results.json" >&2
+    exit 1
+fi
+
+awk -v threshold="$THRESHOLD" '
+# The value of "key" on a line of suite.sh output.
+function field(line, key,    m) {
+    if (match(line, "\"" key "\":(\"[^\"]*\"|[0-9]+)") == 0)
+        return ""
+    m = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+    gsub(/"/, "", m)
+    return m
+}
+FNR == 1 { file++ }
+!/"name"/ { next }
+{
+    key = field($0, "name") " " field($0, "cache")
+    if (file == 1) {
+        old_wall[key] = field($0, "wall_us_min")
+        old_sys[key] = field($0, "syscalls")
+        old_rss[key] = field($0, "max_rss_kb")
+        next
+    }
+    if (!(key in old_wall))
+        next
+    wall = field($0, "wall_us_min")
+    sys = field($0, "syscalls")
+    rss = field($0, "max_rss_kb")
+    if (!header++)
+        printf "%-24s %10s %10s %7s %9s %9s %9s %9s\n", "scenario", \
+            "old_us", "new_us", "change", "old_sys", "new_sys", "old_kb", \
+            "new_kb"
+    change = old_wall[key] > 0 ? 100 * (wall - old_wall[key]) / old_wall[key] : 0
+    flag = ""
+    if (change > threshold || sys > old_sys[key]) {
+        flag = "  REGRESSION"
+        failed = 1
+    }
+    printf "%-24s %10d %10d %+6.1f%% %9d %9d %9d %9d%s\n", key, \
+        old_wall[key], wall, change, old_sys[key], sys, old_rss[key], rss, flag
+}
+END { exit failed }
+' "$1" "$2"
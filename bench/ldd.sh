@@ -0,0 +1,217 @@
+#!/bin/sh
+# Compares the libraries libtree locates with those the dynamic loader loads
+# for every ELF file under the directories in $CORPUS, as ldd does: through
+# LD_TRACE_LOADED_OBJECTS=1, which lists the libraries without running the
+# file. Reports per kind of search path (how libtree found the library) how
+# often they agree, and how much faster libtree is per file and in total.
+#
+# The loader loads every soname once, the first one it finds, while libtree
+# locates the libraries of every parent on its own. A soname that libtree
+# locates at the loader's path for one parent, and elsewhere or not at all for
+# another, is counted as partial. It is a disagreement when libtree locates it
+# somewhere else only, or when only one of them locates it. Disagreements are
+# listed in $DIFF, one line per soname, and fail the script. Timings per file
+# go to $OUT.
+
+LIBTREE=${LIBTREE:-../libtree}
+RUN=${RUN:-./run}
+CORPUS=${CORPUS:-"/usr/bin /usr/lib"}
+# Stop after this many files, 0 for all.
+MAX_FILES=${MAX_FILES:-0}
+RUNS=${RUNS:-3}
+OUT=${OUT:-ldd.tsv}
+DIFF=${DIFF:-ldd_diff.txt}
+LOADER=${LOADER:-$(ls /lib64/ld-linux*.so* /lib/ld-linux*.so* \
+    /lib/ld-musl-*.so* 2> /dev/null | head -n 1)}
+
+# Locate libraries through ld.so.cache like the loader does.
+if [ -z "${LIBTREE_FLAGS+set}" ] && [ -f /etc/ld.so.cache ]; then
+    LIBTREE_FLAGS="--ldcache /etc/ld.so.cache"
+fi
+unset LD_PRELOAD
+
+# Like the loader, show the dependencies of libc and the like, and do not
+# stop at some depth.
+ALL="-vv --max-depth 65536"
+
+if [ -z "$LOADER" ]; then
+    echo "No dynamic loader found, set LOADER" >&2
+    exit 1
+fi
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# The value of "key" in a line of libtree --format ndjson.
+FIELD='
+function field(line, key,    m) {
+    if (match(line, "\"" key "\":\"[^\"]*\"") == 0)
+        return ""
+    return substr(line, RSTART + length(key) + 4, RLENGTH - length(key) - 5)
+}'
+
+# Prints `how category soname libtree_paths loader_path` for every soname of
+# a file, given the canonical paths, libtree's output and the loader's.
+CLASSIFY="$FIELD"'
+FNR == 1 { file++ }
+file == 1 {
+    i = index($0, "\t")
+    canon[substr($0, 1, i - 1)] = substr($0, i + 1)
+    next
+}
+file == 2 && /"type":"edge"/ {
+    so = field($0, "soname")
+    p = canon[field($0, "path")]
+    if (!(so in first_how))
+        first_how[so] = field($0, "how")
+    if (!((so, p) in how)) {
+        how[so, p] = field($0, "how")
+        paths[so] = paths[so] (so in paths ? " " : "") p
+        ++num_paths[so]
+    }
+    present[so] = 1
+    next
+}
+file == 2 && /"type":"missing"/ {
+    so = field($0, "soname")
+    missing[so] = 1
+    present[so] = 1
+    next
+}
+file == 3 && $2 == "=>" {
+    present[$1] = 1
+    if ($3 == "not")
+        loader_missing[$1] = 1
+    else
+        loader[$1] = canon[$3]
+    next
+}
+# The interpreter and libraries needed by path are listed without soname.
+file == 3 && $1 ~ /^\// {
+    name = $1
+    sub(/.*\//, "", name)
+    loader[$1] = loader[name] = canon[$1]
+}
+END {
+    for (so in present) {
+        lp = so in loader ? loader[so] : "-"
+        if ((so, lp) in how) {
+            h = how[so, lp]
+            c = num_paths[so] == 1 && !(so in missing) ? "agree" : "partial"
+        } else if (so in loader && !(so in loader_missing)) {
+            h = so in first_how ? first_how[so] : "not found"
+            c = num_paths[so] > 0 ? "differ" : "loader_only"
+        } else if (num_paths[so] > 0) {
+            h = first_how[so]
+            c = "libtree_only"
+        } else {
+            h = "not found"
+            c = "agree"
+        }
+        print h "\t" c "\t" so "\t" (so in paths ? paths[so] : "-") "\t" lp
+    }
+}'
+
+# The minimum wall time in microseconds of `run -s` output.
+wall_us() {
+    sed 's/.*"wall_us_min":\([0-9]*\).*/\1/'
+}
+
+: > "$TMP/all"
+: > "$TMP/files"
+: > "$DIFF"
+printf 'file\tloader_us\tlibtree_us\tdisagreements\n' > "$OUT"
+skipped=0
+compared=0
+
+find $CORPUS -type f > "$TMP/corpus"
+while IFS= read -r f; do
+    [ "$MAX_FILES" -gt 0 ] && [ $compared -ge "$MAX_FILES" ] && break
+    [ "$(head -c 4 "$f" 2> /dev/null | tail -c 3)" = ELF ] || continue
+
+    # Exit code 28 means that some library was not found.
+    "$LIBTREE" $LIBTREE_FLAGS $ALL --format ndjson "$f" > "$TMP/libtree" \
+        2> /dev/null
+    code=$?
+    LD_TRACE_LOADED_OBJECTS=1 "$LOADER" "$f" > "$TMP/loader" 2>&1
+    if { [ $code -ne 0 ] && [ $code -ne 28 ]; } ||
+        grep -q 'error while loading\|not a dynamic\|statically linked' \
+            "$TMP/loader"; then
+        skipped=$((skipped + 1))
+        continue
+    fi
+    compared=$((compared + 1))
+
+    # Compare files rather than paths, which may go through symlinks.
+    {
+        sed -n 's/.*"path":"\([^"]*\)".*/\1/p' "$TMP/libtree"
+        awk '$2 == "=>" && $3 ~ /^\// { print $3 } $1 ~ /^\// { print $1 }' \
+            "$TMP/loader"
+    } | sort -u > "$TMP/paths"
+    tr '\n' '\0' < "$TMP/paths" | xargs -0 -r readlink -m -- |
+        paste "$TMP/paths" - > "$TMP/canon"
+
+    awk "$CLASSIFY" "$TMP/canon" "$TMP/libtree" "$TMP/loader" > "$TMP/file"
+    cut -f 1,2 "$TMP/file" >> "$TMP/all"
+    awk -F '\t' -v f="$f" '$2 == "differ" || $2 ~ /_only$/ {
+        print f "\t" $0; ++n } END { exit n == 0 }' "$TMP/file" >> "$DIFF"
+    disagreements=$(awk -F '\t' -v f="$f" '$1 == f' "$DIFF" | wc -l)
+
+    loader_us=$("$RUN" -s -n $RUNS -e LD_TRACE_LOADED_OBJECTS=1 "$LOADER" \
+        "$f" | wall_us)
+    libtree_us=$("$RUN" -s -n $RUNS "$LIBTREE" $LIBTREE_FLAGS $ALL "$f" |
+        wall_us)
+    printf '%s\t%s\t%s\t%s\n' "$f" $loader_us $libtree_us $disagreements \
+        >> "$OUT"
+    printf '%s\n' "$f" >> "$TMP/files"
+done < "$TMP/corpus"
+
+echo "Compared $compared files with $LOADER, skipped $skipped static files,"
+echo "files for another loader and files that libtree can't read."
+echo
+awk -F '\t' '{
+    ++n[$1, $2]
+    hows[$1] = 1
+}
+END {
+    printf "%-16s %8s %8s %8s %13s %12s\n", "how", "agree", "partial", \
+        "differ", "libtree_only", "loader_only"
+    for (h in hows)
+        printf "%-16s %8d %8d %8d %13d %12d\n", h, n[h, "agree"], \
+            n[h, "partial"], n[h, "differ"], n[h, "libtree_only"], \
+            n[h, "loader_only"]
+}' "$TMP/all"
+
+echo
+awk -F '\t' 'NR > 1 && $3 > 0 {
+    loader += $2
+    libtree += $3
+    speedup[++n] = $2 / $3
+}
+END {
+    if (n == 0)
+        exit
+    # Median of the speedups per file.
+    for (i = 2; i <= n; ++i)
+        for (j = i; j > 1 && speedup[j - 1] > speedup[j]; --j) {
+            t = speedup[j]
+            speedup[j] = speedup[j - 1]
+            speedup[j - 1] = t
+        }
+    printf "loader %.1f ms, libtree %.1f ms in total, speedup %.1fx\n", \
+        loader / 1000, libtree / 1000, loader / libtree
+    printf "median speedup per file: %.1fx\n", speedup[int((n + 1) / 2)]
+}' "$OUT"
+
+# libtree parses every library once for all files together.
+if [ $compared -gt 0 ]; then
+    batch_us=$(tr '\n' '\0' < "$TMP/files" |
+        xargs -0 "$RUN" -s -n $RUNS "$LIBTREE" $LIBTREE_FLAGS $ALL | wall_us)
+    echo "libtree on all files at once: $((batch_us / 1000)) ms"
+fi
+
+if [ -s "$DIFF" ]; then
+    echo
+    echo "$(wc -l < "$DIFF") disagreements, see $DIFF"
+    exit 1
+fi
@@ -0,0 +1,75 @@
+#!/bin/sh
+# Compares libtree, which opens the candidates of a search in one batch through
+# io_uring, to a build that opens one path at a time ($LIBTREE_SYNC), and to
+# libtree --low-metadata, on an executable with $LIBS libraries spread over
+# $DIRS rpath directories. Runs once on tmpfs, and once with every metadata
+# round trip under the directory $SLOWFS_US microseconds slower through the
+# slowfs.so preload library.
+
+LIBTREE=${LIBTREE:-../libtree}
+LIBTREE_SYNC=${LIBTREE_SYNC:-./libtree_sync}
+LIBS=${LIBS:-32}
+DIRS=${DIRS:-8}
+RUNS=${RUNS:-20}
+SLOWFS_US=${SLOWFS_US:-1000}
+export SLOWFS_US
+
+if [ -d /dev/shm ]; then
+    DIR=$(mktemp -d /dev/shm/libtree-probe.XXXXXX) || exit 1
+else
+    DIR=$(mktemp -d) || exit 1
+fi
+trap 'rm -rf "$DIR"' EXIT
+
+now_ns() {
+    date +%s%N
+}
+
+rpath=
+d=0
+while [ $d -lt $DIRS ]; do
+    mkdir "$DIR/d$d"
+    rpath="$rpath:$DIR/d$d"
+    d=$((d + 1))
+done
+
+needed=
+i=0
+while [ $i -lt $LIBS ]; do
+    echo "int f$i(void){return $i;}" |
+        $CC -shared -fPIC -Wl,-soname,libf$i.so \
+            -o "$DIR/d$((i % DIRS))/libf$i.so" -x c - || exit 1
+    needed="$needed -lf$i"
+    i=$((i + 1))
+done
+echo 'int main(void){return 0;}' |
+    $CC -o "$DIR/exe" -x c - -Wl,--no-as-needed -Wl,--disable-new-dtags \
+        -Wl,-rpath,"${rpath#:}" $(for d in "$DIR"/d*; do echo "-L$d"; done) \
+        $needed || exit 1
+
+# Time $RUNS runs of a libtree binary, prints ms per run.
+run() {
+    start=$(now_ns)
+    n=0
+    while [ $n -lt $RUNS ]; do
+        "$@" "$DIR/exe" > /dev/null || exit 1
+        n=$((n + 1))
+    done
+    end=$(now_ns)
+    echo $(((end - start) / RUNS / 1000))
+}
+
+printf '%10s %12s %12s %16s\n' fs sync_us io_uring_us low_metadata_us
+printf '%10s %12s %12s %16s\n' tmpfs $(run "$LIBTREE_SYNC") $(run "$LIBTREE") \
+    $(run "$LIBTREE" --low-metadata)
+export LD_PRELOAD="$PWD/slowfs.so" SLOWFS_PREFIX="$DIR"
+printf '%10s %12s %12s %16s\n' slow $(run "$LIBTREE_SYNC") $(run "$LIBTREE") \
+    $(run "$LIBTREE" --low-metadata)
+
+# What each of them asks of the file system.
+unset LD_PRELOAD
+for flags in "" --low-metadata; do
+    echo
+    echo "libtree --stats${flags:+ $flags}"
+    "$LIBTREE" --stats $flags "$DIR/exe" 2>&1 > /dev/null
+done
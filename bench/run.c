@@ -0,0 +1,222 @@
+// Runs a command a number of times and prints, as JSON fields, its median and
+// minimum wall time, its peak resident set size, and the number of system
+// calls it makes. System calls are counted through ptrace in one extra run
+// that is not timed, and include those of all threads.
+//
+// Usage: run [-n runs] [-s] [-c dir] [-e name=value]... command [args...]
+//
+// With -s system calls are not counted. With -c the page cache of every file
+// under `dir` is dropped before each run: through /proc/sys/vm/drop_caches
+// when we may write it, which also drops directory entries and inodes, and
+// through posix_fadvise otherwise. With -e the variable is set for the
+// command only. Output of the command is discarded.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void evict_dir(char const *path) {
+    DIR *d = opendir(path);
+    if (d == NULL)
+        return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        struct stat st;
+        if (lstat(child, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            evict_dir(child);
+        } else if (S_ISREG(st.st_mode)) {
+            int fd = open(child, O_RDONLY);
+            if (fd != -1) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+            }
+        }
+    }
+    closedir(d);
+}
+
+// Returns how the cache was dropped.
+static char const *drop_caches(char const *dir) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd != -1) {
+        int ok = write(fd, "3", 1) == 1;
+        close(fd);
+        if (ok)
+            return "drop_caches";
+    }
+    evict_dir(dir);
+    return "fadvise";
+}
+
+static char **env;
+static int num_env;
+
+static pid_t spawn(char **argv, int traced) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        for (int i = 0; i < num_env; ++i)
+            putenv(env[i]);
+        int err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execvp(argv[0], argv);
+        dprintf(err, "%s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+// Time one run, and keep the peak RSS in KiB.
+static uint64_t timed_run(char **argv, long *max_rss) {
+    uint64_t start = now_us();
+    pid_t pid = spawn(argv, 0);
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1) {
+        perror("wait4");
+        exit(1);
+    }
+    uint64_t us = now_us() - start;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+        exit(1);
+    if (ru.ru_maxrss > *max_rss)
+        *max_rss = ru.ru_maxrss;
+    return us;
+}
+
+// Every system call stops a thread on entry and on exit, except the exit of
+// the thread itself, which only stops on entry.
+static unsigned long count_syscalls(char **argv) {
+    pid_t pid = spawn(argv, 1);
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        fputs("could not trace the command\n", stderr);
+        exit(1);
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           (void *)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                          PTRACE_O_EXITKILL));
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    unsigned long stops = 0;
+    unsigned long exits = 0;
+    pid_t tid;
+    while ((tid = waitpid(-1, &status, __WALL)) != -1) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            ++exits;
+            continue;
+        }
+        int sig = WSTOPSIG(status);
+        int inject = 0;
+        if (sig == (SIGTRAP | 0x80))
+            ++stops;
+        else if (sig != SIGTRAP && sig != SIGSTOP)
+            inject = sig;
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)inject);
+    }
+    return (stops + exits) / 2;
+}
+
+static int compare_u64(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    int runs = 10;
+    char const *cold = NULL;
+    int count = 1;
+    env = malloc(argc * sizeof(char *));
+    if (env == NULL)
+        return 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "+n:sc:e:")) != -1) {
+        if (opt == 'n') {
+            runs = atoi(optarg);
+        } else if (opt == 's') {
+            count = 0;
+        } else if (opt == 'c') {
+            cold = optarg;
+        } else if (opt == 'e') {
+            env[num_env++] = optarg;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind == argc || runs < 1) {
+        fputs("usage: run [-n runs] [-s] [-c dir] [-e name=value]... "
+              "command [args...]\n",
+              stderr);
+        return 1;
+    }
+    char **cmd = argv + optind;
+
+    uint64_t *times = malloc(runs * sizeof(uint64_t));
+    if (times == NULL)
+        return 1;
+
+    // Warm up the page cache, unless it is dropped anyway.
+    long max_rss = 0;
+    if (cold == NULL)
+        timed_run(cmd, &max_rss);
+
+    char const *how = NULL;
+    for (int i = 0; i < runs; ++i) {
+        if (cold != NULL)
+            how = drop_caches(cold);
+        times[i] = timed_run(cmd, &max_rss);
+    }
+    qsort(times, runs, sizeof(uint64_t), compare_u64);
+
+    printf("\"wall_us\":%llu,\"wall_us_min\":%llu,\"max_rss_kb\":%ld",
+           (unsigned long long)times[runs / 2], (unsigned long long)times[0],
+           max_rss);
+    if (count)
+        printf(",\"syscalls\":%lu", count_syscalls(cmd));
+    if (how != NULL)
+        printf(",\"cold\":\"%s\"", how);
+    putchar('\n');
+
+    free(times);
+    free(env);
+    return 0;
+}
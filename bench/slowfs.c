@@ -0,0 +1,102 @@
+// LD_PRELOAD library that makes the file system under $SLOWFS_PREFIX slow:
+// every open, stat and opendir of a path below it takes $SLOWFS_US (default
+// 1000) microseconds longer, like a metadata round trip to a network file
+// system. So does every openat relative to a directory descriptor, wherever
+// the directory is. A wait for io_uring completions costs one round trip too,
+// no matter how many operations are in flight. Operations on open files, like
+// fstat and reads, are not slowed down.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void delay(char const *path) {
+    char const *prefix = getenv("SLOWFS_PREFIX");
+    if (path != NULL && prefix != NULL &&
+        strncmp(path, prefix, strlen(prefix)) != 0)
+        return;
+    char const *us = getenv("SLOWFS_US");
+    usleep(us == NULL ? 1000 : atoi(us));
+}
+
+#define NEXT(name) dlsym(RTLD_NEXT, name)
+
+int open(char const *path, int flags, ...) {
+    int (*next)(char const *, int, ...) = NEXT("open");
+    va_list ap;
+    va_start(ap, flags);
+    int mode = va_arg(ap, int);
+    va_end(ap);
+    delay(path);
+    return next(path, flags, mode);
+}
+
+int open64(char const *path, int flags, ...) {
+    int (*next)(char const *, int, ...) = NEXT("open64");
+    va_list ap;
+    va_start(ap, flags);
+    int mode = va_arg(ap, int);
+    va_end(ap);
+    delay(path);
+    return next(path, flags, mode);
+}
+
+int openat(int dirfd, char const *path, int flags, ...) {
+    int (*next)(int, char const *, int, ...) = NEXT("openat");
+    va_list ap;
+    va_start(ap, flags);
+    int mode = va_arg(ap, int);
+    va_end(ap);
+    delay(dirfd == AT_FDCWD ? path : NULL);
+    return next(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, char const *path, int flags, ...) {
+    int (*next)(int, char const *, int, ...) = NEXT("openat64");
+    va_list ap;
+    va_start(ap, flags);
+    int mode = va_arg(ap, int);
+    va_end(ap);
+    delay(dirfd == AT_FDCWD ? path : NULL);
+    return next(dirfd, path, flags, mode);
+}
+
+int stat(char const *path, struct stat *buf) {
+    int (*next)(char const *, struct stat *) = NEXT("stat");
+    delay(path);
+    return next(path, buf);
+}
+
+int stat64(char const *path, struct stat64 *buf) {
+    int (*next)(char const *, struct stat64 *) = NEXT("stat64");
+    delay(path);
+    return next(path, buf);
+}
+
+DIR *opendir(char const *path) {
+    DIR *(*next)(char const *) = NEXT("opendir");
+    delay(path);
+    return next(path);
+}
+
+long syscall(long number, ...) {
+    long (*next)(long, ...) = NEXT("syscall");
+    va_list ap;
+    va_start(ap, number);
+    long a[6];
+    for (int i = 0; i < 6; ++i)
+        a[i] = va_arg(ap, long);
+    va_end(ap);
+#ifdef SYS_io_uring_enter
+    // Waiting for completions.
+    if (number == SYS_io_uring_enter && (a[3] & 1))
+        delay(NULL);
+#endif
+    return next(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
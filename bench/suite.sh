@@ -0,0 +1,228 @@
+#!/bin/sh
+# Generates synthetic dependency graphs of -nostdlib libraries in $WORK, and
+# times libtree on each of them with a warm and a cold page cache. Writes one
+# JSON object per scenario and cache state to $OUT, and compares it to
+# $BASELINE when that exists. Sizes can be set through the environment, the
+# graphs are only generated again when they change.
+
+LIBTREE=${LIBTREE:-../libtree}
+RUN=${RUN:-./run}
+WORK=${WORK:-suite.d}
+OUT=${OUT:-results.json}
+BASELINE=${BASELINE:-baseline.json}
+RUNS=${RUNS:-10}
+COLD_RUNS=${COLD_RUNS:-3}
+
+# Library dependencies of library dependencies of ...
+DEPTH=${DEPTH:-200}
+# Libraries needed by a single executable.
+WIDTH=${WIDTH:-500}
+# Layers of libraries, where each library needs all of the next layer.
+DIAMOND_LAYERS=${DIAMOND_LAYERS:-10}
+DIAMOND_WIDTH=${DIAMOND_WIDTH:-10}
+# Directories in the rpath, runpath and LD_LIBRARY_PATH, before the one with
+# the $SEARCH_LIBS libraries.
+SEARCH_DIRS=${SEARCH_DIRS:-1000}
+SEARCH_LIBS=${SEARCH_LIBS:-32}
+# Libraries that are needed but do not exist.
+MISSING=${MISSING:-500}
+# Input files, each needing the same $SEARCH_LIBS libraries.
+BATCH=${BATCH:-2000}
+
+CC=${CC:-cc}
+WORK=$(mkdir -p "$WORK" && cd "$WORK" && pwd) || exit 1
+LIBTREE=$(cd "$(dirname "$LIBTREE")" && pwd)/$(basename "$LIBTREE")
+
+# A library without soname, so that copies named libNAME.so are needed as
+# libNAME.so, and an object that defines _start for executables.
+leaf() {
+    [ -f "$WORK/leaf.so" ] && return
+    echo 'int leaf(void){return 1;}' |
+        $CC -shared -o "$WORK/leaf.so" -nostdlib -x c - || exit 1
+    echo 'int _start(void){return 0;}' |
+        $CC -c -o "$WORK/start.o" -x c - || exit 1
+}
+
+# `libs dir n` puts copies of the leaf library named libl0.so ... in dir.
+libs() {
+    mkdir -p "$1"
+    i=0
+    while [ $i -lt $2 ]; do
+        cp "$WORK/leaf.so" "$1/libl$i.so"
+        i=$((i + 1))
+    done
+}
+
+# The -l flags to link against libl0.so ... libl$(($1 - 1)).so
+needed() {
+    i=0
+    while [ $i -lt $1 ]; do
+        printf ' -ll%d' $i
+        i=$((i + 1))
+    done
+}
+
+# `exe path flags...` links an executable.
+exe() {
+    out=$1
+    shift
+    $CC -o "$out" -nostdlib -Wl,--no-as-needed "$WORK/start.o" "$@" ||
+        exit 1
+}
+
+# `generate name params` runs gen_name in $WORK/name, unless it was generated
+# with the same params before.
+generate() {
+    dir="$WORK/$1"
+    if [ "$(cat "$dir/params" 2> /dev/null)" = "$2" ]; then
+        return
+    fi
+    rm -rf "$dir"
+    mkdir -p "$dir"
+    (cd "$dir" && "gen_$1") || exit 1
+    echo "$2" > "$dir/params"
+}
+
+# exe -> lib$DEPTH.so -> ... -> lib1.so
+gen_chain() {
+    echo 'int f(void){return 0;}' |
+        $CC -shared -Wl,-soname,lib1.so -o lib1.so -nostdlib -x c - || exit 1
+    i=2
+    while [ $i -le $DEPTH ]; do
+        echo 'int f(void){return 0;}' |
+            $CC -shared -Wl,--no-as-needed -Wl,-soname,lib$i.so \
+                '-Wl,-rpath,$ORIGIN' -o lib$i.so -nostdlib \
+                lib$((i - 1)).so -x c - || exit 1
+        i=$((i + 1))
+    done
+    exe exe '-Wl,-rpath,$ORIGIN' lib$DEPTH.so
+}
+
+# exe -> libl0.so ... libl$WIDTH.so
+gen_fanout() {
+    libs lib $WIDTH
+    exe exe '-Wl,-rpath,$ORIGIN/lib' -Llib $(needed $WIDTH)
+}
+
+# exe -> layer 0 -> layer 1 -> ..., every library needs the whole next layer.
+gen_diamond() {
+    layer=$DIAMOND_LAYERS
+    prev=
+    while [ $layer -gt 0 ]; do
+        layer=$((layer - 1))
+        this=
+        i=0
+        while [ $i -lt $DIAMOND_WIDTH ]; do
+            name=libd${layer}_$i.so
+            echo 'int f(void){return 0;}' |
+                $CC -shared -Wl,--no-as-needed -Wl,-soname,$name \
+                    '-Wl,-rpath,$ORIGIN' -o $name -nostdlib $prev -x c - ||
+                exit 1
+            this="$this $name"
+            i=$((i + 1))
+        done
+        prev=$this
+    done
+    exe exe '-Wl,-rpath,$ORIGIN' $prev
+}
+
+# Directories empty0:empty1:...:lib, where only lib has libraries.
+search_path() {
+    i=0
+    path=
+    while [ $i -lt $SEARCH_DIRS ]; do
+        mkdir -p empty$i
+        path="$path$PWD/empty$i:"
+        i=$((i + 1))
+    done
+    libs lib $SEARCH_LIBS
+    echo "$path$PWD/lib" > search_path
+}
+
+gen_rpath() {
+    search_path
+    exe exe -Wl,--disable-new-dtags -Wl,-rpath,"$(cat search_path)" -Llib \
+        $(needed $SEARCH_LIBS)
+}
+
+gen_runpath() {
+    search_path
+    exe exe -Wl,--enable-new-dtags -Wl,-rpath,"$(cat search_path)" -Llib \
+        $(needed $SEARCH_LIBS)
+}
+
+gen_ld_library_path() {
+    search_path
+    exe exe -Llib $(needed $SEARCH_LIBS)
+}
+
+# The libraries only exist while linking.
+gen_missing() {
+    libs lib $MISSING
+    exe exe -Llib $(needed $MISSING)
+    rm -rf lib
+}
+
+gen_batch() {
+    libs lib $SEARCH_LIBS
+    exe exe '-Wl,-rpath,$ORIGIN/../lib' -Llib $(needed $SEARCH_LIBS)
+    mkdir inputs
+    i=0
+    while [ $i -lt $BATCH ]; do
+        cp exe inputs/exe$i
+        i=$((i + 1))
+    done
+    rm exe
+}
+
+# `measure name [-e name=value] command...` runs the command for the scenario
+# with a warm and with a cold page cache.
+measure() {
+    name=$1
+    shift
+    for cache in warm cold; do
+        if [ $cache = warm ]; then
+            fields=$("$RUN" -n $RUNS "$@") || exit 1
+        else
+            fields=$("$RUN" -n $COLD_RUNS -c "$WORK/$name" "$@") || exit 1
+        fi
+        echo "{\"name\":\"$name\",\"cache\":\"$cache\",$fields}" >> "$OUT.tmp"
+        echo "$name $cache $fields" >&2
+    done
+}
+
+leaf
+generate chain "$DEPTH"
+generate fanout "$WIDTH"
+generate diamond "$DIAMOND_LAYERS $DIAMOND_WIDTH"
+generate rpath "$SEARCH_DIRS $SEARCH_LIBS"
+generate runpath "$SEARCH_DIRS $SEARCH_LIBS"
+generate ld_library_path "$SEARCH_DIRS $SEARCH_LIBS"
+generate missing "$MISSING"
+generate batch "$BATCH $SEARCH_LIBS"
+
+rm -f "$OUT.tmp"
+measure chain "$LIBTREE" --max-depth $((DEPTH + 1)) "$WORK/chain/exe"
+measure fanout "$LIBTREE" "$WORK/fanout/exe"
+measure diamond "$LIBTREE" "$WORK/diamond/exe"
+measure rpath "$LIBTREE" "$WORK/rpath/exe"
+measure runpath "$LIBTREE" "$WORK/runpath/exe"
+# The dynamic loader searches the same directories for libc of libtree.
+measure ld_library_path \
+    -e LD_LIBRARY_PATH="$(cat "$WORK/ld_library_path/search_path")" \
+    "$LIBTREE" "$WORK/ld_library_path/exe"
+measure missing "$LIBTREE" "$WORK/missing/exe"
+measure batch "$LIBTREE" "$WORK"/batch/inputs/*
+
+# One scenario per line, so that results can be compared line by line.
+{
+    echo "{\"commit\":\"$(git rev-parse --short HEAD 2> /dev/null)\","
+    echo "\"scenarios\":["
+    sed '$!s/$/,/' "$OUT.tmp"
+    echo "]}"
+} > "$OUT"
+rm -f "$OUT.tmp"
+
+if [ -f "$BASELINE" ] && [ "$BASELINE" != "$OUT" ]; then
+    ./compare.sh "$BASELINE" "$OUT"
+fi
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Runs libtree once over N distinct files for every N in $SIZES and reports
+# the wall time per file. With a constant time lookup in the set of visited
+# files the time per file should be flat.
+
+LIBTREE=${LIBTREE:-../libtree}
+SIZES=${SIZES:-"1000 10000 100000"}
+
+now_ns() {
+    date +%s%N
+}
+
+printf '%10s %12s %12s\n' files total_ms ns_per_file
+
+for n in $SIZES; do
+    rm -rf visited.d
+    mkdir visited.d
+
+    # Concatenate the 64 byte file until we have n copies, then split it up:
+    # this creates n files with distinct inodes in a single process.
+    cp tiny.elf visited.d/all
+    copies=1
+    while [ $copies -lt $n ]; do
+        cat visited.d/all visited.d/all > visited.d/tmp
+        mv visited.d/tmp visited.d/all
+        copies=$((copies * 2))
+    done
+    head -c $((n * 64)) visited.d/all > visited.d/some
+    rm visited.d/all
+    (cd visited.d && split -b 64 -a 6 some f && rm some)
+
+    start=$(now_ns)
+    (cd visited.d && "$LIBTREE" f* > /dev/null) || exit 1
+    end=$(now_ns)
+
+    total=$((end - start))
+    printf '%10d %12d %12d\n' $n $((total / 1000000)) $((total / n))
+done
+
+rm -rf visited.d
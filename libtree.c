@@ -1,15 +1,47 @@
+// openat, fdopendir, pread and open_memstream are POSIX.1-2008, and
+// syscall() is not POSIX at all; -std=c99 hides them on glibc.
+#define _DEFAULT_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+// Probe files in batches through io_uring when the kernel headers have it,
+// unless built with -DLIBTREE_NO_IO_URING.
+#if defined(__linux__) && defined(__GNUC__) && defined(__has_include) &&       \
+    !defined(LIBTREE_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// IORING_OP_OPENAT came with Linux 5.6, as did this flag.
+#ifdef IORING_FEAT_CUR_PERSONALITY
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
 #include <sys/types.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
+// With LIBTREE_LIBRARY defined this is the library of libtree.h instead of the
+// command line tool, which needs nothing but this file.
+#ifdef LIBTREE_LIBRARY
+#include "libtree.h"
+#endif
+
 #define VERSION "3.2.0-dev"
 
 #define ET_EXEC 2
@@ -18,13 +50,55 @@
 #define PT_NULL 0
 #define PT_LOAD 1
 #define PT_DYNAMIC 2
+#define PT_INTERP 3
+#define PT_TLS 7
 
 #define DT_NULL 0
 #define DT_NEEDED 1
 #define DT_STRTAB 5
+#define DT_STRSZ 10
 #define DT_SONAME 14
 #define DT_RPATH 15
 #define DT_RUNPATH 29
+#define DT_HASH 4
+#define DT_SYMTAB 6
+#define DT_SYMENT 11
+#define DT_GNU_HASH 0x6ffffef5
+#define DT_VERSYM 0x6ffffff0
+#define DT_VERDEF 0x6ffffffc
+#define DT_VERDEFNUM 0x6ffffffd
+#define DT_VERNEED 0x6ffffffe
+#define DT_VERNEEDNUM 0x6fffffff
+#define DT_PLTRELSZ 2
+#define DT_RELA 7
+#define DT_RELASZ 8
+#define DT_RELAENT 9
+#define DT_REL 17
+#define DT_RELSZ 18
+#define DT_RELENT 19
+#define DT_PLTREL 20
+#define DT_BIND_NOW 24
+#define DT_FLAGS 30
+#define DT_RELRSZ 35
+#define DT_RELR 36
+#define DT_RELRENT 37
+#define DT_RELACOUNT 0x6ffffff9
+#define DT_RELCOUNT 0x6ffffffa
+
+#define DF_BIND_NOW 0x8
+
+#define SHN_UNDEF 0
+#define SHN_ABS 0xfff1
+
+#define STB_GLOBAL 1
+#define STB_WEAK 2
+#define STB_GNU_UNIQUE 10
+
+#define STT_TLS 6
+#define STT_GNU_IFUNC 10
+
+#define VER_FLG_WEAK 0x2
+#define VERSYM_HIDDEN 0x8000
 
 #define BITS32 1
 #define BITS64 2
@@ -51,12 +125,21 @@
 #define ERR_VADDRS_NOT_ORDERED 30
 #define ERR_COULD_NOT_OPEN_FILE 31
 #define ERR_INCOMPATIBLE_ISA 32
+#define ERR_SYMBOL_NOT_FOUND 33
+#define ERR_FILE_TOO_LARGE 34
 
 #define DT_FLAGS_1 0x6ffffffb
+#define DT_1_NOW 0x1
 #define DT_1_NODEFLIB 0x800
 
 #define MAX_OFFSET_T 0xFFFFFFFFFFFFFFFF
 
+// Files that can't be mapped, such as pipes, are read up to this size.
+#define MAX_READ_SIZE (256 * 1024 * 1024)
+
+#define LD_CACHE_MAGIC "ld.so-1.7.0"
+#define LD_CACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+
 #define REGULAR_RED "\033[0;31m"
 #define BOLD_RED "\033[1;31m"
 #define CLEAR "\033[0m"
@@ -79,25 +162,34 @@
 #define LIGHT_VERTICAL_WITH_INDENT LIGHT_VERTICAL "   "
 
 #define SMALL_VEC_SIZE 16
-#define MAX_RECURSION_DEPTH 32
+#define DEFAULT_MAX_DEPTH 32
 #define MAX_PATH_LENGTH 4096
 
+// The number of slowest inputs that --stats lists.
+#define NUM_SLOWEST 10
+#define ARENA_BLOCK_SIZE 65536
+#define PROBE_RING_ENTRIES 64
+// The most probes of a batch, which bounds the descriptors it holds.
+#define MAX_PROBES 64
+#define ELF_READ_SIZE 65536
+#define MAX_DIR_FDS 256
+
 // Libraries we do not show by default -- this reduces the verbosity quite a
 // bit.
-char const *exclude_list[] = {"ld-linux-aarch64.so",
-                              "ld-linux-armhf.so",
-                              "ld-linux-x86-64.so",
-                              "ld-linux.so",
-                              "ld64.so",
-                              "libc.musl-aarch64.so",
-                              "libc.musl-armhf.so",
-                              "libc.musl-i386.so",
-                              "libc.musl-x86_64.so",
-                              "libc.so",
-                              "libdl.so",
-                              "libgcc_s.so",
-                              "libm.so",
-                              "libstdc++.so"};
+static char const *exclude_list[] = {"ld-linux-aarch64.so",
+                                     "ld-linux-armhf.so",
+                                     "ld-linux-x86-64.so",
+                                     "ld-linux.so",
+                                     "ld64.so",
+                                     "libc.musl-aarch64.so",
+                                     "libc.musl-armhf.so",
+                                     "libc.musl-i386.so",
+                                     "libc.musl-x86_64.so",
+                                     "libc.so",
+                                     "libdl.so",
+                                     "libgcc_s.so",
+                                     "libm.so",
+                                     "libstdc++.so"};
 
 struct header_64_t {
     uint16_t e_type;
@@ -163,6 +255,55 @@ struct dyn_32_t {
     uint32_t d_val;
 };
 
+struct sym_64_t {
+    uint32_t st_name;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+};
+
+struct sym_32_t {
+    uint32_t st_name;
+    uint32_t st_value;
+    uint32_t st_size;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+};
+
+struct verdef_t {
+    uint16_t vd_version;
+    uint16_t vd_flags;
+    uint16_t vd_ndx;
+    uint16_t vd_cnt;
+    uint32_t vd_hash;
+    uint32_t vd_aux;
+    uint32_t vd_next;
+};
+
+struct verdaux_t {
+    uint32_t vda_name;
+    uint32_t vda_next;
+};
+
+struct verneed_t {
+    uint16_t vn_version;
+    uint16_t vn_cnt;
+    uint32_t vn_file;
+    uint32_t vn_aux;
+    uint32_t vn_next;
+};
+
+struct vernaux_t {
+    uint32_t vna_hash;
+    uint16_t vna_flags;
+    uint16_t vna_other;
+    uint32_t vna_name;
+    uint32_t vna_next;
+};
+
 struct compat_t {
     char any; // 1 iff we don't look for libs matching a certain architecture
     uint8_t class;    // 32 or 64 bits?
@@ -176,15 +317,33 @@ typedef enum {
     LD_LIBRARY_PATH,
     RUNPATH,
     LD_SO_CONF,
+    LD_SO_CACHE,
     DEFAULT
 } how_t;
 
+typedef enum { FORMAT_TREE, FORMAT_NDJSON, FORMAT_JSON, FORMAT_DOT } format_t;
+
+typedef enum { PROBE_UNKNOWN, PROBE_FOUND, PROBE_MISSING } probe_result_t;
+
+typedef enum { STATS_NONE, STATS_TEXT, STATS_JSON } stats_format_t;
+
+// Phases of a run whose wall time --stats reports.
+typedef enum {
+    PHASE_LD_SO_CONF,
+    PHASE_LD_SO_CACHE,
+    PHASE_LD_LIBRARY_PATH,
+    PHASE_CACHE_FILE,
+    PHASE_RESOLVE,
+    NUM_PHASES
+} phase_t;
+
 struct found_t {
     how_t how;
-    // only set when found by in the rpath NOT of the direct parent.  so, when
-    // it is found in a "special" way only rpaths allow, which is worth
-    // informing the user about.
-    size_t depth;
+    // For rpaths, how many levels above the library that needs it the file
+    // is whose rpath located it, 0 for its own. Rpaths of ancestors are a
+    // "special" way of locating libraries, which is worth informing the user
+    // about.
+    size_t up;
 };
 
 // large buffer in which to copy rpaths, needed libraries and sonames.
@@ -194,26 +353,663 @@ struct string_table_t {
     size_t capacity;
 };
 
+// An input file and how long it took, for --stats.
+struct slow_input_t {
+    uint64_t us;
+    char path[MAX_PATH_LENGTH];
+};
+
+// What it took to locate libraries, counted per thread and summed up for
+// --stats.
+struct stats_t {
+    // File system operations.
+    size_t opens;
+    size_t stat_calls;
+    size_t reads;
+    size_t bytes_read;
+    size_t maps;
+    // The size of the mapped files, which bounds what the page cache or the
+    // disk is asked for when they are parsed in place.
+    size_t bytes_mapped;
+    size_t listings;
+
+    // ELF files parsed, and those whose record came from the cache file.
+    size_t parsed;
+    size_t from_cache_file;
+
+    // Libraries shown before in the same tree.
+    size_t seen_before;
+
+    // Per how_t: candidates that a directory listing ruled out, candidates
+    // that were tried, and those that could be used.
+    size_t ruled_out[DEFAULT + 1];
+    size_t tried[DEFAULT + 1];
+    size_t found[DEFAULT + 1];
+
+    // The inputs that took longest, slowest first.
+    struct slow_input_t slowest[NUM_SLOWEST];
+    size_t num_slowest;
+};
+
+// A piece of a file that is read on demand.
+struct elf_piece_t {
+    struct elf_piece_t *next;
+    uint64_t offset;
+    size_t size;
+    unsigned char data[];
+};
+
+// an ELF file mapped into memory, or read into a buffer when it cannot be
+// mapped (pipes, character devices, ...).
+struct elf_file_t {
+    unsigned char *data;
+    size_t size;
+    int mapped;
+    // When `data` is NULL, only the pieces that are used are read from `fd`,
+    // and `size` is the size of the file.
+    int fd;
+    struct elf_piece_t *pieces;
+    // Where reads are counted, or NULL.
+    struct stats_t *stats;
+};
+
+// A file to get at, by path or relative to a directory. `fd` is the file
+// opened already, which the one who gets the file closes, or -1.
+struct file_ref_t {
+    char const *path;
+    int fd;
+    // AT_FDCWD and `path`, or a descriptor of the directory and the name.
+    int dirfd;
+    char const *name;
+};
+
+// Bump allocator: allocations stay put until the arena is freed as a whole.
+struct arena_block_t {
+    struct arena_block_t *prev;
+    char *data;
+    size_t n;
+    size_t capacity;
+};
+
+struct arena_t {
+    struct arena_block_t *head;
+};
+
+// The identity of a file, which tells whether what we remember about it in
+// the cache file is still valid.
+struct disk_stat_t {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+// A DT_NEEDED entry, interned so that it is measured, hashed and checked
+// against the exclude list once per run rather than once per search path.
+struct soname_t {
+    char const *name;
+    size_t len;
+    uint64_t hash;
+    int excluded;
+};
+
+// A directory of a search path with a trailing slash, and the hash under
+// which its listing is kept in the directory cache.
+struct search_dir_t {
+    char const *path;
+    size_t len;
+    uint64_t hash;
+};
+
+// A colon-separated search path, split into directories once. `str` is the
+// search path as it was given, for printing.
+struct search_path_t {
+    char const *str;
+    uint64_t hash;
+    struct search_dir_t *dirs;
+    size_t n;
+};
+
+// An rpath or runpath with variables substituted for an origin.
+struct search_memo_t {
+    char const *raw;
+    char const *origin;
+    uint64_t hash;
+    struct search_path_t const *path;
+};
+
+// Everything we need to know about an ELF file, parsed once per run and
+// cached by (st_dev, st_ino). Strings live in `strtab`, which is a compact
+// copy of the strings we use from the file's own string table.
+struct elf_record_t {
+    dev_t st_dev;
+    ino_t st_ino;
+    struct disk_stat_t st;
+    // Whether the record was read from the cache file.
+    int from_disk;
+    // Set while the file is being parsed by another thread.
+    int pending;
+
+    // Parse errors, split by the point at which print_node() reports them:
+    // before the file counts as visited, after that, and only when its
+    // dependencies are needed.
+    int header_error;
+    int dynamic_error;
+    int needed_error;
+
+    struct compat_t type;
+    int has_dynamic;
+    uint64_t dt_flags_1;
+
+    char const *strtab;
+    size_t strtab_size;
+    uint64_t soname;
+    uint64_t rpath;
+    uint64_t runpath;
+    uint64_t *needed;
+    size_t num_needed;
+
+    // rpath and runpath with variables substituted for the last origin we
+    // saw this file at, which is typically the only one.
+    char const *origin;
+    struct search_path_t const *rpath_dirs;
+    struct search_path_t const *runpath_dirs;
+
+    // The interned DT_NEEDED entries, set when they are first needed.
+    struct soname_t const **sonames;
+
+    // The dynamic symbol table, set when --symbols, --unused or --cost first
+    // needs it.
+    struct elf_symbols_t *symbols;
+};
+
+// A version that a file needs from the library of one of its DT_NEEDED
+// entries, and the index by which its symbols refer to it.
+struct version_need_t {
+    char const *file;
+    char const *name;
+    uint16_t index;
+    uint16_t flags;
+};
+
+// What it takes the dynamic loader to map and relocate a file, for --cost.
+struct load_cost_t {
+    // Bytes of the PT_LOAD segments in the file and in memory, and of the
+    // PT_TLS segment in memory.
+    uint64_t file_size;
+    uint64_t mem_size;
+    uint64_t tls_size;
+    // Relocations in DT_RELA, DT_REL and DT_RELR, of which `relative` need
+    // no symbol lookup, and in DT_JMPREL.
+    uint64_t relocs;
+    uint64_t relative;
+    uint64_t plt_relocs;
+    int has_gnu_hash;
+    int has_hash;
+    // Set by DT_BIND_NOW, DF_BIND_NOW or DF_1_NOW: the PLT is not bound
+    // lazily.
+    int bind_now;
+};
+
+// What the dynamic loader uses to bind symbols: the dynamic symbol table,
+// its hash tables and the symbol versions, for --symbols. The file stays
+// mapped, the pointers are into it and were checked to be inside it.
+struct elf_symbols_t {
+    struct elf_file_t file;
+    // Set when the tables can't be read.
+    int invalid;
+    uint8_t class;
+
+    unsigned char const *symtab;
+    size_t sym_size;
+    size_t num_syms;
+    char const *strtab;
+    size_t strtab_size;
+
+    // DT_GNU_HASH, where `bloom` has `bloom_size` words of the class's size,
+    // or NULL. The chains cover the symbols up to `gnu_num_syms`.
+    unsigned char const *gnu_buckets;
+    unsigned char const *gnu_chains;
+    unsigned char const *bloom;
+    uint32_t gnu_nbuckets;
+    uint32_t gnu_symoffset;
+    uint32_t bloom_size;
+    uint32_t bloom_shift;
+    size_t gnu_num_syms;
+
+    // DT_HASH, or NULL.
+    unsigned char const *buckets;
+    unsigned char const *chains;
+    uint32_t nbuckets;
+
+    // DT_VERSYM, or NULL.
+    unsigned char const *versym;
+    // The names of the versions defined in DT_VERDEF, by index.
+    char const **defined;
+    size_t num_defined;
+    // DT_VERNEED.
+    struct version_need_t *needed;
+    size_t num_needed;
+
+    // The path of PT_INTERP, or NULL.
+    char const *interp;
+
+    // Also set when the tables can't be used.
+    struct load_cost_t cost;
+};
+
+// The file we found at a path.
+struct path_memo_t {
+    char const *path;
+    uint64_t hash;
+    struct elf_record_t *record;
+};
+
+// Open addressing hash table of parsed ELF files.
+struct elf_cache_t {
+    struct elf_record_t **arr;
+    size_t n;
+    size_t capacity;
+    struct arena_t arena;
+    // Set while worker threads share the cache, `parsed` is signaled when a
+    // record is no longer pending.
+    pthread_mutex_t *lock;
+    pthread_cond_t *parsed;
+    // Records from previous runs, or NULL.
+    struct disk_cache_t const *disk;
+    // Open files before looking at them, instead of calling stat() by path,
+    // and read only the parts that are parsed. Every path is opened once,
+    // `paths` is an open addressing hash table of those we opened.
+    int low_metadata;
+    struct path_memo_t *paths;
+    size_t num_paths;
+    size_t paths_capacity;
+
+    // Open addressing hash tables of interned sonames, and of rpaths and
+    // runpaths by (raw value, origin).
+    struct soname_t **sonames;
+    size_t num_sonames;
+    size_t sonames_capacity;
+    struct search_memo_t **memo;
+    size_t num_memo;
+    size_t memo_capacity;
+};
+
+// The names in a search path directory, so that we can tell whether a library
+// exists there without trying to open it.
+struct dir_listing_t {
+    char const *path;
+    size_t path_len;
+    uint64_t hash;
+
+    // 0 when the directory exists but could not be read, in which case we
+    // have to fall back to opening files.
+    int listed;
+
+    // The directory as it was listed, only set when it could be opened.
+    int has_stat;
+    struct disk_stat_t st;
+    // Whether the listing was read from the cache file.
+    int from_disk;
+
+    // In low metadata mode, a descriptor of the directory to open files in
+    // it with openat(), and -1 otherwise.
+    int fd;
+
+    // Open addressing hash set of file names.
+    char const **names;
+    size_t capacity;
+};
+
+// An ld.so.cache file as written by glibc's ldconfig, in either the old
+// "ld.so-1.7.0" or the new "glibc-ld.so.cache1.1" format.
+struct ld_cache_entry_t {
+    char const *soname;
+    char const *path;
+    // index + 1 of the next entry with the same soname, 0 if none.
+    uint32_t next;
+};
+
+struct ld_cache_t {
+    struct elf_file_t file;
+    struct ld_cache_entry_t *entries;
+    size_t num_entries;
+    // Open addressing hash table from soname to index + 1 of its first
+    // entry, 0 for empty slots.
+    uint32_t *table;
+    size_t capacity;
+};
+
+// The most recently modified ld config file, to tell whether ld.so.cache is
+// out of date.
+struct ld_conf_newest_t {
+    time_t mtime;
+    char path[MAX_PATH_LENGTH];
+};
+
+// Open addressing hash table of directory listings, keyed by path.
+struct dir_cache_t {
+    struct dir_listing_t **arr;
+    size_t n;
+    size_t capacity;
+    struct arena_t arena;
+    // Set while worker threads share the cache.
+    pthread_mutex_t *lock;
+    // Listings from previous runs, or NULL.
+    struct disk_cache_t const *disk;
+    // Keep directories open, at most MAX_DIR_FDS of them.
+    int low_metadata;
+    size_t num_fds;
+};
+
+// A candidate path of a search, opened before the candidates are tried one
+// by one, so that many opens take a single round trip to the file system.
+struct probe_t {
+    size_t dir;
+    struct soname_t const *soname;
+    // Offset of the path in the batch's `paths`.
+    size_t path;
+    probe_result_t result;
+    // The open file when it was found, until it is taken, or -1.
+    int fd;
+};
+
+struct probe_batch_t {
+    struct probe_t *probes;
+    size_t n;
+    size_t capacity;
+    struct string_table_t paths;
+};
+
+// The cache file of --cache holds ELF records and directory listings of
+// previous runs. It is written to a temporary file that is renamed into
+// place, so it can be mapped and read without locking while another process
+// replaces it. All offsets are relative to the start of the file and 8-byte
+// aligned. Both tables use open addressing; strings are NUL-terminated and
+// the file ends with a NUL byte.
+#define DISK_CACHE_MAGIC "libtree\x01"
+#define DISK_CACHE_VERSION 1
+#define DISK_CACHE_BYTE_ORDER 0x01020304
+
+struct disk_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;
+    uint64_t records;
+    uint64_t records_capacity;
+    uint64_t dirs;
+    uint64_t dirs_capacity;
+};
+
+struct disk_record_t {
+    struct disk_stat_t st;
+    uint64_t used;
+    int32_t header_error;
+    int32_t dynamic_error;
+    int32_t needed_error;
+    uint16_t machine;
+    uint8_t class;
+    uint8_t has_dynamic;
+    uint64_t dt_flags_1;
+    uint64_t strtab;
+    uint64_t strtab_size;
+    // Offsets in the strtab.
+    uint64_t soname;
+    uint64_t rpath;
+    uint64_t runpath;
+    // `num_needed` strtab offsets.
+    uint64_t needed;
+    uint64_t num_needed;
+};
+
+struct disk_dir_t {
+    struct disk_stat_t st;
+    uint64_t used;
+    uint64_t hash;
+    uint64_t path;
+    uint64_t path_len;
+    // The hash set of names: `capacity` string offsets, 0 for empty slots.
+    uint64_t names;
+    uint64_t capacity;
+};
+
+struct disk_cache_t {
+    struct elf_file_t file;
+    struct disk_header_t const *header;
+    struct disk_record_t const *records;
+    struct disk_dir_t const *dirs;
+};
+
 struct visited_file_t {
     dev_t st_dev;
     ino_t st_ino;
 };
 
-struct visited_file_array_t {
+// Open addressing hash set of visited files with linear probing. The capacity
+// is a power of two, and `used` marks the occupied slots.
+struct visited_file_set_t {
     struct visited_file_t *arr;
+    char *used;
     size_t n;
     size_t capacity;
 };
 
+// Sonames that could not be located, with the number of input files that
+// need them.
+struct missing_entry_t {
+    char const *soname;
+    size_t files;
+    size_t last_input;
+};
+
+struct missing_set_t {
+    struct missing_entry_t *arr;
+    size_t n;
+    size_t capacity;
+    pthread_mutex_t *lock;
+};
+
+// The rpaths of the ancestors of a node that have one, starting at the
+// deepest. Chains are interned, so that they can be compared by pointer. They
+// don't depend on depth: an entry only knows how many levels its file is below
+// the file of `parent`.
+struct rpath_chain_t {
+    struct rpath_chain_t const *parent;
+    struct search_path_t const *rpath;
+    size_t up;
+    uint64_t hash;
+};
+
+struct dag_node_t;
+
+// A dependency of a node: a located library, or a DT_NEEDED path that could
+// not be used.
+struct dag_edge_t {
+    struct dag_node_t *node;
+    // The DT_NEEDED entry.
+    char const *soname;
+    struct found_t reason;
+    // Whether this was the last dependency left to locate, which decides how
+    // the branches of the tree are drawn.
+    int last;
+    int error;
+};
+
+struct dag_edges_t {
+    struct dag_edge_t *p;
+    size_t n;
+    size_t capacity;
+};
+
+// A file in the dependency graph. Where its dependencies are found depends on
+// its path through $ORIGIN, and on the rpaths of its ancestors, so a node is a
+// (path, parent rpaths) pair rather than a file. Ancestors without rpaths
+// don't matter, so a library is one node at every depth unless the graph is
+// kept per depth.
+struct dag_node_t {
+    char const *path;
+    struct elf_record_t *record;
+    struct rpath_chain_t const *parent_rpaths;
+    // How many levels up the file of the first entry of `parent_rpaths` is.
+    size_t parent_rpaths_up;
+    // The depth when the graph is kept per depth, and 0 otherwise.
+    size_t depth;
+    uint64_t hash;
+
+    // The rest is set when the dependencies are resolved, which happens the
+    // first time they are needed.
+    int resolved;
+    // The parent rpaths, after the rpath of the file itself if it has one,
+    // and how many levels up the file of the first entry is.
+    struct rpath_chain_t const *rpaths;
+    size_t rpaths_up;
+    struct search_path_t const *runpath;
+    int no_def_lib;
+    struct dag_edge_t *edges;
+    size_t num_edges;
+    // Sonames that could not be located.
+    struct soname_t const **missing;
+    size_t num_missing;
+
+    // Whether the dependencies were queued to be located by a worker thread.
+    int queued;
+
+    // With --compress, the number `ref` of the line where the dependencies
+    // were printed in tree `ref_tree` at `ref_depth`, the exit code of that
+    // subtree and whether --max-depth cut it short.
+    size_t ref_tree;
+    size_t ref;
+    size_t ref_depth;
+    int ref_code;
+    int ref_cut;
+};
+
+// Open addressing hash tables of nodes and rpath chains.
+struct dag_t {
+    struct dag_node_t **nodes;
+    size_t num_nodes;
+    size_t nodes_capacity;
+    struct rpath_chain_t **chains;
+    size_t num_chains;
+    size_t chains_capacity;
+    // Whether nodes are told apart by depth, for the library, where every
+    // node has the dependencies of its depth.
+    int by_depth;
+    // Set while worker threads share the graph.
+    pthread_mutex_t *lock;
+};
+
+// A line of the tree: a node reached from `parent` through its DT_NEEDED entry
+// `soname`, where both are NULL for input files.
+struct tree_line_t {
+    struct dag_node_t const *node;
+    struct dag_node_t const *parent;
+    char const *soname;
+    // The soname or path to show.
+    char const *name;
+    struct found_t reason;
+    size_t depth;
+    int seen_before;
+    int in_exclude_list;
+    // Whether the dependencies follow.
+    int expanded;
+    // The number of the line, or the line referred to when `is_ref` is set,
+    // or 0.
+    size_t ref;
+    int is_ref;
+};
+
+// A line whose dependencies are being printed, which is suspended while the
+// dependency `next_edge - 1` is.
+struct print_frame_t {
+    struct dag_node_t *node;
+    struct tree_line_t line;
+    size_t next_edge;
+    int exit_code;
+    // Whether --max-depth left out dependencies below this line.
+    int cut;
+
+    // This is so we know we have to print a | or white space
+    // in the tree
+    int found_all_needed;
+};
+
+// Draws the tree of a node.
+struct tree_printer_t {
+    // NULL to walk the graph without printing anything.
+    FILE *out;
+
+    // The input file, which structured output refers to.
+    char const *input;
+
+    // Whether a JSON value was written before in the current array.
+    int need_comma;
+
+    // The lines whose dependencies are being printed, one per depth, from
+    // the input file down. Grows as needed.
+    struct print_frame_t *stack;
+    size_t depth;
+    size_t capacity;
+
+    // The exit code of the input file once the stack is empty.
+    int exit_code;
+};
+
 struct libtree_state_t {
     int verbosity;
     int path;
     int color;
     char *ld_conf_file;
+    char *ld_cache_file;
+    char *cache_file;
+    // The value of LD_LIBRARY_PATH, NULL when unset.
+    char *ld_library_path_env;
     unsigned long max_depth;
+    long jobs;
 
     struct string_table_t string_table;
-    struct visited_file_array_t visited;
+    struct string_table_t scratch;
+    struct visited_file_set_t visited;
+    struct ld_cache_t ld_cache;
+
+    // Shared by all threads. New records, listings and strings are allocated
+    // in `arena`, which is the cache's own arena, or a worker's arena that is
+    // merged into it when the worker is done.
+    struct elf_cache_t *cache;
+    struct dir_cache_t *dirs;
+    struct arena_t *arena;
+
+    // The cache file of previous runs, read-only.
+    struct disk_cache_t disk;
+
+    // Resolved dependencies. Shared by the threads that warm up the caches,
+    // and private to a thread that scans directories.
+    struct dag_t *dag;
+
+    // How to print the tree.
+    format_t format;
+
+    // Print dependencies only once per tree, and refer back to them later.
+    // The tree changes whenever the visited set is cleared.
+    int compress;
+    size_t tree;
+    size_t num_refs;
+
+    // Analyze all ELF files in directories instead of the given files.
+    int scan;
+
+    // Also read file names from stdin, separated by `delimiter`.
+    int read_stdin;
+    char delimiter;
+
+    // When set, the sonames that could not be located are collected here,
+    // counted once per input with number `input`.
+    struct missing_set_t *missing;
+    size_t input;
 
     // rpath substitutions values (note: OSNAME/OSREL are FreeBSD specific, LIB
     // is glibc/Linux specific -- we substitute all so we can support
@@ -223,19 +1019,43 @@ struct libtree_state_t {
     char *OSNAME;
     char *OSREL;
 
-    // rpath stack: if lib_a needs lib_b needs lib_c and all have rpaths
-    // then first lib_c's rpaths are considered, then lib_b's, then lib_a's.
-    // so this data structure keeps a list of offsets into the string buffer
-    // where rpaths start, like [lib_a_rpath_offset, lib_b_rpath_offset,
-    // lib_c_rpath_offset]...
-    size_t rpath_offsets[MAX_RECURSION_DEPTH];
     size_t ld_library_path_offset;
     size_t default_paths_offset;
     size_t ld_so_conf_offset;
 
-    // This is so we know we have to print a | or white space
-    // in the tree
-    char found_all_needed[MAX_RECURSION_DEPTH];
+    // The above split into directories, LD_LIBRARY_PATH is NULL when unset.
+    struct search_path_t const *ld_library_path;
+    struct search_path_t const *ld_so_conf;
+    struct search_path_t const *default_paths;
+
+    // Checks candidate paths in batches, one per thread. Set up when first
+    // needed, and NULL when the kernel can't do it.
+    struct probe_ring_t *ring;
+    int ring_tried;
+
+    // Make as few metadata requests to the file system as we can.
+    int low_metadata;
+
+    // Check that the symbols of the input files and their libraries are
+    // defined, like the dynamic loader does before running them.
+    int symbols;
+
+    // Report libraries that are needed but whose symbols are not used.
+    int unused;
+
+    // Estimate what it takes the dynamic loader to load the libraries.
+    int cost;
+
+    // Count the probes of the dynamic loader that find no library, and
+    // report search path entries that locate none.
+    int probes;
+
+    // Print what it took to locate the libraries to stderr at exit. The
+    // counts are per thread, and added to those of the main thread at the
+    // end. Wall times of the phases are in microseconds.
+    stats_format_t print_stats;
+    struct stats_t stats;
+    uint64_t phase_us[NUM_PHASES];
 };
 
 // Keep track of the files we've see
@@ -341,1322 +1161,6886 @@ static void string_table_store(struct string_table_t *t, char const *str) {
     t->n += n;
 }
 
-static void string_table_copy_from_file(struct string_table_t *t, FILE *fptr) {
-    int c;
-    // TODO: this could be a bit more efficient...
-    while ((c = getc(fptr)) != '\0' && c != EOF) {
-        string_table_maybe_grow(t, 1);
-        t->arr[t->n++] = c;
+static void *arena_alloc(struct arena_t *a, size_t n) {
+    // Keep allocations 8-byte aligned.
+    n = (n + 7) & ~(size_t)7;
+
+    struct arena_block_t *b = a->head;
+    if (b == NULL || b->n + n > b->capacity) {
+        b = malloc(sizeof(struct arena_block_t));
+        if (b == NULL)
+            exit(1);
+        b->capacity = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+        b->data = malloc(b->capacity);
+        if (b->data == NULL)
+            exit(1);
+        b->n = 0;
+        b->prev = a->head;
+        a->head = b;
     }
-    string_table_maybe_grow(t, 1);
-    t->arr[t->n++] = '\0';
+
+    void *p = b->data + b->n;
+    b->n += n;
+    return p;
 }
 
-static int is_in_exclude_list(char *soname) {
-    // Get to the end.
-    char *start = soname;
-    char *end = strrchr(start, '\0');
+static char *arena_copy(struct arena_t *a, char const *str, size_t n) {
+    char *p = arena_alloc(a, n);
+    memcpy(p, str, n);
+    return p;
+}
 
-    // Empty needed string, is that even possible?
-    if (start == end)
-        return 0;
+static void arena_free(struct arena_t *a) {
+    struct arena_block_t *b = a->head;
+    while (b != NULL) {
+        struct arena_block_t *prev = b->prev;
+        free(b->data);
+        free(b);
+        b = prev;
+    }
+    a->head = NULL;
+}
 
-    --end;
+#ifndef LIBTREE_LIBRARY
+// Move all blocks of `from` into `to`.
+static void arena_merge(struct arena_t *to, struct arena_t *from) {
+    struct arena_block_t *b = from->head;
+    if (b == NULL)
+        return;
+    while (b->prev != NULL)
+        b = b->prev;
+    b->prev = to->head;
+    to->head = from->head;
+    from->head = NULL;
+}
+#endif
 
-    // Strip "1234567890." from the right.
-    while (end != start && ((*end >= '0' && *end <= '9') || *end == '.')) {
-        --end;
-    }
+static inline void cache_lock(pthread_mutex_t *lock) {
+    if (lock != NULL)
+        pthread_mutex_lock(lock);
+}
 
-    // Check if we should skip this one.
-    for (size_t j = 0; j < sizeof(exclude_list) / sizeof(char *); ++j) {
-        size_t len = strlen(exclude_list[j]);
-        if (strncmp(start, exclude_list[j], len) != 0)
-            continue;
-        return 1;
-    }
+static inline void cache_unlock(pthread_mutex_t *lock) {
+    if (lock != NULL)
+        pthread_mutex_unlock(lock);
+}
 
-    return 0;
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
 }
 
-static void tree_preamble(struct libtree_state_t *s, size_t depth) {
-    if (depth == 0)
+#ifndef LIBTREE_LIBRARY
+// Remember `path` if it is among the slowest inputs.
+static void stats_add_input(struct stats_t *stats, char const *path,
+                            uint64_t us) {
+    size_t i = stats->num_slowest;
+    if (i == NUM_SLOWEST && stats->slowest[i - 1].us >= us)
         return;
+    if (i == NUM_SLOWEST)
+        --i;
+    else
+        ++stats->num_slowest;
+    for (; i > 0 && stats->slowest[i - 1].us < us; --i)
+        stats->slowest[i] = stats->slowest[i - 1];
+    stats->slowest[i].us = us;
+    size_t len = strlen(path);
+    if (len >= MAX_PATH_LENGTH)
+        len = MAX_PATH_LENGTH - 1;
+    memcpy(stats->slowest[i].path, path, len);
+    stats->slowest[i].path[len] = '\0';
+}
 
-    for (size_t i = 0; i < depth - 1; ++i)
-        fputs(s->found_all_needed[i] ? JUST_INDENT : LIGHT_VERTICAL_WITH_INDENT,
-              stdout);
+static void stats_add(struct stats_t *to, struct stats_t const *from) {
+    to->opens += from->opens;
+    to->stat_calls += from->stat_calls;
+    to->reads += from->reads;
+    to->bytes_read += from->bytes_read;
+    to->maps += from->maps;
+    to->bytes_mapped += from->bytes_mapped;
+    to->listings += from->listings;
+    to->parsed += from->parsed;
+    to->from_cache_file += from->from_cache_file;
+    to->seen_before += from->seen_before;
+    for (size_t i = 0; i <= DEFAULT; ++i) {
+        to->ruled_out[i] += from->ruled_out[i];
+        to->tried[i] += from->tried[i];
+        to->found[i] += from->found[i];
+    }
+    for (size_t i = 0; i < from->num_slowest; ++i)
+        stats_add_input(to, from->slowest[i].path, from->slowest[i].us);
+}
+#endif
+
+static inline uint64_t hash_str(char const *str, size_t n) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)str[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
 
-    fputs(s->found_all_needed[depth - 1]
-              ? LIGHT_UP_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " "
-              : LIGHT_VERTICAL_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " ",
-          stdout);
+static inline uint64_t hash_u64(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
 }
 
-static int recurse(char *current_file, size_t depth,
-                   struct libtree_state_t *state, struct compat_t compat,
-                   struct found_t reason);
+static void disk_stat_set(struct disk_stat_t *st, struct stat const *finfo) {
+    st->dev = finfo->st_dev;
+    st->ino = finfo->st_ino;
+    st->size = finfo->st_size;
+    st->mtime_sec = finfo->st_mtim.tv_sec;
+    st->mtime_nsec = finfo->st_mtim.tv_nsec;
+    st->ctime_sec = finfo->st_ctim.tv_sec;
+    st->ctime_nsec = finfo->st_ctim.tv_nsec;
+}
 
-static void apply_exclude_list(size_t *needed_not_found,
-                               struct small_vec_u64_t *needed_buf_offsets,
-                               struct libtree_state_t *s) {
-    for (size_t i = 0; i < *needed_not_found;) {
-        // If in exclude list, swap to the back.
-        if (is_in_exclude_list(s->string_table.arr +
-                               needed_buf_offsets->p[i])) {
-            size_t tmp = needed_buf_offsets->p[i];
-            needed_buf_offsets->p[i] =
-                needed_buf_offsets->p[*needed_not_found - 1];
-            needed_buf_offsets->p[--*needed_not_found] = tmp;
-            continue;
-        } else {
-            ++i;
-        }
-    }
+static int disk_stat_equal(struct disk_stat_t const *a,
+                           struct disk_stat_t const *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
 }
 
-static int check_absolute_paths(size_t *needed_not_found,
-                                struct small_vec_u64_t *needed_buf_offsets,
-                                size_t depth, struct libtree_state_t *s,
-                                struct compat_t compat) {
-    int exit_code = 0;
-    // First go over absolute paths in needed libs.
-    for (size_t i = 0; i < *needed_not_found;) {
-        struct string_table_t const *st = &s->string_table;
+static struct dir_listing_t *disk_cache_find_dir(struct disk_cache_t const *dc,
+                                                 struct arena_t *a,
+                                                 char const *path,
+                                                 size_t path_len, uint64_t hash,
+                                                 struct stats_t *stats);
+
+static struct elf_record_t *disk_cache_find_record(struct disk_cache_t const *dc,
+                                                   struct stat const *finfo,
+                                                   struct arena_t *a);
+
+static void dir_cache_init(struct dir_cache_t *c) {
+    c->n = 0;
+    c->capacity = 64;
+    c->arr = calloc(c->capacity, sizeof(struct dir_listing_t *));
+    c->arena.head = NULL;
+    c->lock = NULL;
+    c->disk = NULL;
+    c->low_metadata = 0;
+    c->num_fds = 0;
+    if (c->arr == NULL)
+        exit(1);
+}
 
-        // Skip dt_needed that have do not contain /
-        if (strchr(st->arr + needed_buf_offsets->p[i], '/') == NULL) {
-            ++i;
-            continue;
-        }
+static void dir_cache_free(struct dir_cache_t *c) {
+    for (size_t i = 0; i < c->capacity; ++i)
+        if (c->arr[i] != NULL && c->arr[i]->fd != -1)
+            close(c->arr[i]->fd);
+    free(c->arr);
+    arena_free(&c->arena);
+}
 
-        // Copy the path over.
-        char path[MAX_PATH_LENGTH];
-        size_t len = strlen(st->arr + needed_buf_offsets->p[i]);
+static size_t dir_cache_slot(struct dir_cache_t const *c, char const *path,
+                             size_t path_len, uint64_t hash) {
+    size_t mask = c->capacity - 1;
+    size_t i = hash & mask;
+    while (c->arr[i] != NULL) {
+        struct dir_listing_t const *d = c->arr[i];
+        if (d->hash == hash && d->path_len == path_len &&
+            memcmp(d->path, path, path_len) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
 
-        // Unlikely to happen but good to guard against
-        if (len >= MAX_PATH_LENGTH)
+static void dir_cache_grow(struct dir_cache_t *c) {
+    struct dir_listing_t **old = c->arr;
+    size_t old_capacity = c->capacity;
+    c->capacity *= 2;
+    c->arr = calloc(c->capacity, sizeof(struct dir_listing_t *));
+    if (c->arr == NULL)
+        exit(1);
+    for (size_t j = 0; j < old_capacity; ++j) {
+        if (old[j] == NULL)
             continue;
+        struct dir_listing_t *d = old[j];
+        c->arr[dir_cache_slot(c, d->path, d->path_len, d->hash)] = d;
+    }
+    free(old);
+}
 
-        // Include \0
-        memcpy(path, st->arr + needed_buf_offsets->p[i], len + 1);
-
-        s->found_all_needed[depth] = *needed_not_found <= 1;
-        char *err = NULL;
+static void dir_listing_insert(struct dir_listing_t *d, char const *name) {
+    size_t mask = d->capacity - 1;
+    size_t i = hash_str(name, strlen(name)) & mask;
+    while (d->names[i] != NULL)
+        i = (i + 1) & mask;
+    d->names[i] = name;
+}
 
-        // If it is not an absolute path, we bail, cause it then starts to
-        // depend on the current working directory, which is rather
-        // nonsensical. This is allowed by glibc though.
-        if (path[0] != '/') {
-            err = " is not absolute";
-            exit_code = ERR_DEPENDENCY_NOT_FOUND;
-        } else {
-            int code = recurse(path, depth + 1, s, compat,
-                               (struct found_t){.how = DIRECT});
-            if (code == ERR_DEPENDENCY_NOT_FOUND)
-                exit_code = ERR_DEPENDENCY_NOT_FOUND;
-
-            // Check if there was an issue with the direct dep and ignore errors
-            // of transient deps.
-            if (code != 0 && code != ERR_DEPENDENCY_NOT_FOUND) {
-                err = " not found";
-            }
-        }
+// A descriptor to open files in the directory with, but not to read it.
+static int dir_open_path(char const *path, struct stats_t *stats) {
+    ++stats->opens;
+#ifdef O_PATH
+    return open(path, O_PATH | O_DIRECTORY);
+#else
+    return open(path, O_RDONLY | O_DIRECTORY);
+#endif
+}
 
-        if (err) {
-            tree_preamble(s, depth + 1);
-            if (s->color)
-                fputs(BOLD_RED, stdout);
-            fputs(path, stdout);
-            fputs(" is not absolute", stdout);
-            fputs(s->color ? CLEAR "\n" : "\n", stdout);
-        }
+// Read all names in the directory, a directory that does not exist is
+// listed as empty. With `keep_fd`, the directory stays open in `d->fd`.
+static void dir_listing_read(struct dir_listing_t *d, struct arena_t *a,
+                             int keep_fd, struct stats_t *stats) {
+    d->listed = 1;
+    d->capacity = 0;
+    d->names = NULL;
+    d->has_stat = 0;
+    d->from_disk = 0;
+    d->fd = -1;
+
+    ++stats->opens;
+    int fd = open(d->path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        int err = errno;
+        d->listed = err == ENOENT || err == ENOTDIR;
+
+        // We may still be allowed to open the files in it.
+        if (keep_fd && err == EACCES)
+            d->fd = dir_open_path(d->path, stats);
+        return;
+    }
 
-        // Handled this library, so swap to the back.
-        size_t tmp = needed_buf_offsets->p[i];
-        needed_buf_offsets->p[i] = needed_buf_offsets->p[*needed_not_found - 1];
-        needed_buf_offsets->p[--*needed_not_found] = tmp;
+    // Taken before reading, so a change while we read invalidates it.
+    struct stat finfo;
+    ++stats->stat_calls;
+    if (fstat(fd, &finfo) == 0) {
+        d->has_stat = 1;
+        disk_stat_set(&d->st, &finfo);
     }
 
-    return exit_code;
-}
+    if (keep_fd) {
+        d->fd = fd;
+        fd = dup(fd);
+    }
 
-static int check_search_paths(struct found_t reason, size_t offset,
-                              size_t *needed_not_found,
-                              struct small_vec_u64_t *needed_buf_offsets,
-                              size_t depth, struct libtree_state_t *s,
-                              struct compat_t compat) {
-    int exit_code = 0;
-    char path[MAX_PATH_LENGTH];
-    char *path_end = path + MAX_PATH_LENGTH;
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        if (fd != -1)
+            close(fd);
+        d->listed = 0;
+        return;
+    }
+    ++stats->listings;
 
-    struct string_table_t const *st = &s->string_table;
+    // Collect the names first, so we know how large the set should be.
+    size_t n = 0;
+    size_t capacity = 64;
+    char const **names = malloc(capacity * sizeof(char const *));
+    if (names == NULL)
+        exit(1);
 
-    while (st->arr[offset] != '\0') {
-        // First remove trailing colons
-        while (st->arr[offset] == ':' && st->arr[offset] != '\0')
-            ++offset;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (n == capacity) {
+            capacity *= 2;
+            names = realloc(names, capacity * sizeof(char const *));
+            if (names == NULL)
+                exit(1);
+        }
+        names[n++] = arena_copy(a, entry->d_name, strlen(entry->d_name) + 1);
+    }
+    closedir(dir);
+
+    // Keep the load factor below 1/2.
+    d->capacity = 16;
+    while (d->capacity < 2 * n)
+        d->capacity *= 2;
+    d->names = arena_alloc(a, d->capacity * sizeof(char const *));
+    memset(d->names, 0, d->capacity * sizeof(char const *));
+    for (size_t i = 0; i < n; ++i)
+        dir_listing_insert(d, names[i]);
+
+    free(names);
+}
 
-        // Check if it was only colons
-        if (st->arr[offset] == '\0')
-            return exit_code;
+// The listing of the directory `dir`, which is listed the first time it is
+// queried. New listings are allocated in `a`.
+static struct dir_listing_t *dir_cache_get(struct dir_cache_t *c,
+                                           struct arena_t *a,
+                                           struct search_dir_t const *dir,
+                                           struct stats_t *stats) {
+    char const *path = dir->path;
+    size_t path_len = dir->len;
+    uint64_t hash = dir->hash;
+
+    cache_lock(c->lock);
+    struct dir_listing_t *d = c->arr[dir_cache_slot(c, path, path_len, hash)];
+    cache_unlock(c->lock);
+
+    if (d == NULL) {
+        // Take the listing of a previous run, or list the directory, without
+        // holding the lock.
+        if (c->disk != NULL) {
+            d = disk_cache_find_dir(c->disk, a, path, path_len, hash, stats);
+            if (d != NULL && c->low_metadata)
+                d->fd = dir_open_path(d->path, stats);
+        }
 
-        // Copy the search path until the first \0 or :
-        char *dest = path;
-        while (st->arr[offset] != '\0' && st->arr[offset] != ':' &&
-               dest != path_end)
-            *dest++ = st->arr[offset++];
+        if (d == NULL) {
+            d = arena_alloc(a, sizeof(*d));
+            char *d_path = arena_alloc(a, path_len + 1);
+            memcpy(d_path, path, path_len);
+            d_path[path_len] = '\0';
+            d->path = d_path;
+            d->path_len = path_len;
+            d->hash = hash;
+            dir_listing_read(d, a, c->low_metadata, stats);
+        }
 
-        // Path too long... Can't handle.
-        if (dest + 1 >= path_end)
-            continue;
+        cache_lock(c->lock);
+        size_t i = dir_cache_slot(c, path, path_len, hash);
 
-        // Add a separator if necessary
-        if (*(dest - 1) != '/')
-            *dest++ = '/';
+        // Another thread may have been first.
+        if (c->arr[i] != NULL) {
+            if (d->fd != -1)
+                close(d->fd);
+            d = c->arr[i];
+        } else {
+            // Keep the load factor below 1/2.
+            if (2 * (c->n + 1) > c->capacity) {
+                dir_cache_grow(c);
+                i = dir_cache_slot(c, path, path_len, hash);
+            }
+            c->arr[i] = d;
+            ++c->n;
+
+            // Don't run out of file descriptors on long search paths.
+            if (d->fd != -1 && c->num_fds == MAX_DIR_FDS) {
+                close(d->fd);
+                d->fd = -1;
+            } else if (d->fd != -1) {
+                ++c->num_fds;
+            }
+        }
+        cache_unlock(c->lock);
+    }
+    return d;
+}
 
-        // Keep track of the end of the current search path.
-        char *search_path_end = dest;
+// Returns 0 only if we know for sure that `name` does not exist in the
+// directory `dir`, 2 if the listing shows it, and 1 if the directory could not
+// be listed. `dirfd`, if not NULL, is set to the descriptor of the directory,
+// or -1 when it is not open.
+static int dir_cache_may_contain(struct dir_cache_t *c, struct arena_t *a,
+                                 struct search_dir_t const *dir,
+                                 struct soname_t const *name, int *dirfd,
+                                 struct stats_t *stats) {
+    struct dir_listing_t const *d = dir_cache_get(c, a, dir, stats);
+    if (dirfd != NULL)
+        *dirfd = d->fd;
+
+    if (!d->listed)
+        return 1;
 
-        // Try to open it -- if we've found anything, swap it with the back.
-        for (size_t i = 0; i < *needed_not_found;) {
-            size_t soname_len = strlen(st->arr + needed_buf_offsets->p[i]);
+    if (d->capacity == 0)
+        return 0;
 
-            // Path too long, can't handle.
-            if (search_path_end + soname_len + 1 >= path_end)
-                continue;
-
-            // Otherwise append.
-            memcpy(search_path_end, st->arr + needed_buf_offsets->p[i],
-                   soname_len + 1);
-            s->found_all_needed[depth] = *needed_not_found <= 1;
-
-            // And try to locate the lib.
-            int code = recurse(path, depth + 1, s, compat, reason);
-            if (code == ERR_DEPENDENCY_NOT_FOUND)
-                exit_code = ERR_DEPENDENCY_NOT_FOUND;
-            if (code == 0 || code == ERR_DEPENDENCY_NOT_FOUND) {
-                // Found at least the direct dependency, so swap out the current
-                // soname to the back and reduce the number of to be found by
-                // one.
-                size_t tmp = needed_buf_offsets->p[i];
-                needed_buf_offsets->p[i] =
-                    needed_buf_offsets->p[*needed_not_found - 1];
-                needed_buf_offsets->p[--(*needed_not_found)] = tmp;
-            } else {
-                ++i;
-            }
-        }
+    size_t mask = d->capacity - 1;
+    size_t j = name->hash & mask;
+    while (d->names[j] != NULL) {
+        if (strcmp(d->names[j], name->name) == 0)
+            return 2;
+        j = (j + 1) & mask;
     }
-
-    return exit_code;
+    return 0;
 }
 
-static int interpolate_variables(struct libtree_state_t *s, size_t src,
-                                 char const *ORIGIN) {
-    // We do not write to dst if there is no variables to interpolate.
-    size_t prev_src = src;
-    size_t curr_src = src;
-
-    struct string_table_t *st = &s->string_table;
-
-    while (1) {
-        // Find the next potential variable.
-        char *dollar = strchr(st->arr + curr_src, '$');
-        if (dollar == NULL)
+// Read from `fd` until `f` holds `n` bytes or the file ends. Returns 1 on
+// read errors.
+static int elf_file_read_up_to(struct elf_file_t *f, int fd, size_t n,
+                               size_t *capacity) {
+    while (f->size < n) {
+        if (f->size == *capacity) {
+            *capacity *= 2;
+            unsigned char *data = realloc(f->data, *capacity);
+            if (data == NULL)
+                exit(1);
+            f->data = data;
+        }
+        size_t want = (n < *capacity ? n : *capacity) - f->size;
+        ssize_t got = read(fd, f->data + f->size, want);
+        if (f->stats != NULL) {
+            ++f->stats->reads;
+            f->stats->bytes_read += got > 0 ? got : 0;
+        }
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1)
+            return 1;
+        if (got == 0)
             break;
-        curr_src = dollar - st->arr;
-
-        size_t bytes_to_dollar = curr_src - prev_src;
+        f->size += got;
+    }
+    return 0;
+}
 
-        // Go past the dollar.
-        ++curr_src;
+// Read the file at `fd` into memory, at most MAX_READ_SIZE bytes. For an ELF
+// file the header is read and checked first, so that devices like /dev/zero
+// are not read any further.
+static int elf_file_read_all(struct elf_file_t *f, int fd, int is_elf) {
+    size_t capacity = 4096;
+    f->data = malloc(capacity);
+    f->size = 0;
+    f->mapped = 0;
+    f->fd = -1;
+    f->pieces = NULL;
+    if (f->data == NULL)
+        exit(1);
 
-        // Remember if we have to look for matching curly braces.
-        int curly = 0;
-        if (st->arr[curr_src] == '{') {
-            curly = 1;
-            ++curr_src;
-        }
+    int code = 0;
+    if (is_elf) {
+        if (elf_file_read_up_to(f, fd, 16, &capacity) != 0)
+            code = ERR_COULD_NOT_OPEN_FILE;
+        else if (f->size < 16 || memcmp(f->data, "\177ELF", 4) != 0)
+            code = ERR_INVALID_MAGIC;
+        else if (f->data[4] != BITS32 && f->data[4] != BITS64)
+            code = ERR_INVALID_CLASS;
+    }
+    if (code == 0 && is_elf) {
+        size_t header_size = 16 + (f->data[4] == BITS64
+                                       ? sizeof(struct header_64_t)
+                                       : sizeof(struct header_32_t));
+        if (elf_file_read_up_to(f, fd, header_size, &capacity) != 0)
+            code = ERR_COULD_NOT_OPEN_FILE;
+        else if (f->size < header_size)
+            code = ERR_INVALID_HEADER;
+    }
 
-        // String to interpolate.
-        char const *var_val = NULL;
-        if (strncmp(&st->arr[curr_src], "ORIGIN", 6) == 0) {
-            var_val = ORIGIN;
-            curr_src += 6;
-        } else if (strncmp(&st->arr[curr_src], "LIB", 3) == 0) {
-            var_val = s->LIB;
-            curr_src += 3;
-        } else if (strncmp(&st->arr[curr_src], "PLATFORM", 8) == 0) {
-            var_val = s->PLATFORM;
-            curr_src += 8;
-        } else if (strncmp(&st->arr[curr_src], "OSNAME", 6) == 0) {
-            var_val = s->OSNAME;
-            curr_src += 6;
-        } else if (strncmp(&st->arr[curr_src], "OSREL", 5) == 0) {
-            var_val = s->OSREL;
-            curr_src += 5;
-        } else {
-            continue;
-        }
+    // One byte more tells whether the file is larger than allowed.
+    if (code == 0 &&
+        elf_file_read_up_to(f, fd, (size_t)MAX_READ_SIZE + 1, &capacity) != 0)
+        code = ERR_COULD_NOT_OPEN_FILE;
+    else if (code == 0 && f->size > MAX_READ_SIZE)
+        code = ERR_FILE_TOO_LARGE;
+
+    if (code != 0) {
+        free(f->data);
+        f->data = NULL;
+        f->size = 0;
+    }
+    return code;
+}
 
-        // Require matching {...}.
-        if (curly) {
-            if (st->arr[curr_src] != '}') {
-                continue;
+// Map or read the file at `fd`, which is closed afterwards. Files that are
+// read are checked to be ELF files when `is_elf` is set.
+static int elf_file_load(struct elf_file_t *f, int fd,
+                         struct stat const *finfo, int is_elf) {
+    // Map regular files, the mapping outlives the file descriptor.
+    if (S_ISREG(finfo->st_mode) && finfo->st_size > 0) {
+        void *data = mmap(NULL, finfo->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            f->data = data;
+            f->size = finfo->st_size;
+            f->mapped = 1;
+            f->fd = -1;
+            f->pieces = NULL;
+            if (f->stats != NULL) {
+                ++f->stats->maps;
+                f->stats->bytes_mapped += f->size;
             }
-            ++curr_src;
+            close(fd);
+            return 0;
         }
+    }
 
-        size_t var_len = strlen(var_val);
+    // Otherwise fall back to reading the whole thing.
+    int code = elf_file_read_all(f, fd, is_elf);
+    close(fd);
+    return code;
+}
 
-        // Make sure we have enough space to write to.
-        string_table_maybe_grow(st, bytes_to_dollar + var_len);
+static int elf_file_open(struct elf_file_t *f, char const *path,
+                         struct stat const *finfo, int is_elf,
+                         struct stats_t *stats) {
+    f->data = NULL;
+    f->fd = -1;
+    f->pieces = NULL;
+    f->stats = stats;
+    if (stats != NULL)
+        ++stats->opens;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return ERR_COULD_NOT_OPEN_FILE;
+    return elf_file_load(f, fd, finfo, is_elf);
+}
 
-        // First copy over the string until the variable.
-        memcpy(&st->arr[s->string_table.n], &st->arr[prev_src],
-               bytes_to_dollar);
-        s->string_table.n += bytes_to_dollar;
+// Read the regular file at `fd` in pieces when they are used, which takes
+// ownership of `fd`. The header, program headers and strings are usually in
+// the first piece.
+static int elf_file_open_fd(struct elf_file_t *f, int fd,
+                            struct stat const *finfo,
+                            struct stats_t *stats) {
+    f->stats = stats;
+    if (!S_ISREG(finfo->st_mode) || finfo->st_size <= 0)
+        return elf_file_load(f, fd, finfo, 1);
+    f->data = NULL;
+    f->size = finfo->st_size;
+    f->mapped = 0;
+    f->fd = fd;
+    f->pieces = NULL;
+    return 0;
+}
 
-        // Then move prev_src until after the variable.
-        prev_src = curr_src;
+static void elf_file_close(struct elf_file_t *f) {
+    if (f->mapped)
+        munmap(f->data, f->size);
+    else
+        free(f->data);
+    f->data = NULL;
 
-        // Then copy the variable value (without null).
-        memcpy(&st->arr[s->string_table.n], var_val, var_len);
-        s->string_table.n += var_len;
+    while (f->pieces != NULL) {
+        struct elf_piece_t *next = f->pieces->next;
+        free(f->pieces);
+        f->pieces = next;
     }
+    if (f->fd != -1)
+        close(f->fd);
+    f->fd = -1;
+}
 
-    // Did we copy anything? That implies a variable was interpolated.
-    // Copy the remainder, including the \0.
-    if (prev_src != src) {
-        size_t n = strlen(st->arr + prev_src) + 1;
-        string_table_maybe_grow(st, n);
-        // note: we're copying from within the string table, so we
-        // should not store st->arr + prev_src.
-        memcpy(st->arr + st->n, st->arr + prev_src, n);
-        st->n += n;
-        return 1;
+// The `n` bytes at `offset`, which must be inside the file, or NULL when
+// they can't be read.
+static unsigned char const *elf_file_at(struct elf_file_t *f, uint64_t offset,
+                                        size_t n) {
+    if (f->data != NULL)
+        return f->data + offset;
+
+    for (struct elf_piece_t *p = f->pieces; p != NULL; p = p->next)
+        if (offset >= p->offset && offset - p->offset <= p->size &&
+            n <= p->size - (offset - p->offset))
+            return p->data + (offset - p->offset);
+
+    // Read ahead, what is parsed next is usually close by.
+    size_t size = n > ELF_READ_SIZE ? n : ELF_READ_SIZE;
+    if (size > f->size - offset)
+        size = f->size - offset;
+    struct elf_piece_t *p = malloc(sizeof(struct elf_piece_t) + size);
+    if (p == NULL)
+        exit(1);
+
+    ssize_t got = pread(f->fd, p->data, size, offset);
+    if (f->stats != NULL) {
+        ++f->stats->reads;
+        f->stats->bytes_read += got > 0 ? got : 0;
+    }
+    if (got < 0 || (size_t)got < n) {
+        free(p);
+        return NULL;
     }
 
-    return 0;
+    p->offset = offset;
+    p->size = got;
+    p->next = f->pieces;
+    f->pieces = p;
+    return p->data;
 }
 
-static void print_colon_delimited_paths(char const *start, char const *indent) {
-    while (1) {
-        // Don't print empty string
-        if (*start == '\0')
-            break;
-
-        // Find the next delimiter after start
-        char *next = strchr(start, ':');
+// Copy n bytes at offset into dst, returns 0 when out of bounds or when they
+// can't be read.
+static int elf_file_copy(struct elf_file_t *f, uint64_t offset, void *dst,
+                         size_t n) {
+    if (offset > f->size || n > f->size - offset)
+        return 0;
+    unsigned char const *src = elf_file_at(f, offset, n);
+    if (src == NULL)
+        return 0;
+    memcpy(dst, src, n);
+    return 1;
+}
 
-        // Don't print empty strings
-        if (start == next) {
-            ++start;
-            continue;
-        }
+// Returns a \0-terminated string at the given index of the string table
+// that lives in the file at [offset, offset + size), or NULL when it is not.
+static char const *elf_file_string(struct elf_file_t *f,
+                                   uint64_t strtab_offset, uint64_t strtab_size,
+                                   uint64_t index) {
+    if (strtab_offset >= f->size || index >= strtab_size)
+        return NULL;
+    uint64_t available = f->size - strtab_offset;
+    if (strtab_size < available)
+        available = strtab_size;
+    if (index >= available)
+        return NULL;
+
+    // Don't read the whole string table for a short string.
+    uint64_t offset = strtab_offset + index;
+    uint64_t n = available - index;
+    if (f->data == NULL && n > ELF_READ_SIZE) {
+        char const *str = (char const *)elf_file_at(f, offset, ELF_READ_SIZE);
+        if (str != NULL && memchr(str, '\0', ELF_READ_SIZE) != NULL)
+            return str;
+    }
 
-        fputs(indent, stdout);
-        fputs(JUST_INDENT, stdout);
+    char const *str = (char const *)elf_file_at(f, offset, n);
+    if (str == NULL || memchr(str, '\0', n) == NULL)
+        return NULL;
+    return str;
+}
 
-        // Print up to but not including : or \0, followed by a newline.
-        if (next == NULL) {
-            puts(start);
-        } else {
-            fwrite(start, 1, next - start, stdout);
-            putchar('\n');
-        }
+static void ld_cache_free(struct ld_cache_t *c) {
+    if (c->file.data != NULL)
+        elf_file_close(&c->file);
+    free(c->entries);
+    free(c->table);
+    memset(c, 0, sizeof(*c));
+}
 
-        // We done yet?
-        if (next == NULL)
-            break;
+static size_t ld_cache_slot(struct ld_cache_t const *c, char const *soname) {
+    size_t mask = c->capacity - 1;
+    size_t i = hash_str(soname, strlen(soname)) & mask;
+    while (c->table[i] != 0 &&
+           strcmp(c->entries[c->table[i] - 1].soname, soname) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
 
-        // Otherwise put the : back in place and continue.
-        start = next + 1;
-    }
+// Returns index + 1 of the first entry for soname, or 0 if there is none.
+static uint32_t ld_cache_find(struct ld_cache_t const *c, char const *soname) {
+    if (c->capacity == 0)
+        return 0;
+    return c->table[ld_cache_slot(c, soname)];
 }
 
-static void print_line(size_t depth, char *name, char *color_bold,
-                       char *color_regular, int highlight,
-                       struct found_t reason, struct libtree_state_t *s) {
-    tree_preamble(s, depth);
-    // Color the filename different than the path name, if we have a path.
-    char *slash = NULL;
-    if (s->color && highlight && (slash = strrchr(name, '/')) != NULL) {
-        fputs(color_regular, stdout);
-        fwrite(name, 1, slash + 1 - name, stdout);
-        fputs(color_bold, stdout);
-        fputs(slash + 1, stdout);
-    } else {
-        if (s->color)
-            fputs(color_bold, stdout);
+// Load an ld.so.cache file, see glibc's sysdeps/generic/dl-cache.h. Entries
+// are kept in file order, which is the order in which the loader prefers
+// them. Entries for glibc-hwcaps subdirectories and legacy hwcaps are skipped,
+// since we cannot tell which ones the loader would select on this machine.
+static int ld_cache_load(struct ld_cache_t *c, char const *path,
+                         time_t *mtime) {
+    memset(c, 0, sizeof(*c));
 
-        fputs(name, stdout);
-    }
-    if (s->color && highlight)
-        fputs(CLEAR " " BOLD_YELLOW, stdout);
-    else
-        putchar(' ');
-    switch (reason.how) {
-    case RPATH:
-        if (reason.depth + 1 >= depth) {
-            fputs("[rpath]", stdout);
+    struct stat finfo;
+    if (stat(path, &finfo) != 0 ||
+        elf_file_open(&c->file, path, &finfo, 0, NULL) != 0)
+        return 1;
+
+    *mtime = finfo.st_mtime;
+
+    struct elf_file_t *f = &c->file;
+    size_t magic_len = sizeof(LD_CACHE_MAGIC) - 1;
+    size_t magic_new_len = sizeof(LD_CACHE_MAGIC_NEW) - 1;
+
+    int is_new;
+    uint64_t strings;
+    uint64_t entries;
+    uint64_t entry_size;
+    uint32_t nlibs;
+
+    if (f->size >= 16 && memcmp(f->data, LD_CACHE_MAGIC, magic_len) == 0) {
+        // The old format, which may be followed by the new format.
+        memcpy(&nlibs, f->data + 12, sizeof(uint32_t));
+        uint64_t end = 16 + (uint64_t)nlibs * 12;
+        uint64_t new_offset = (end + 7) & ~(uint64_t)7;
+        is_new = new_offset + 48 <= f->size &&
+                 memcmp(f->data + new_offset, LD_CACHE_MAGIC_NEW,
+                        magic_new_len) == 0;
+        if (is_new) {
+            strings = new_offset;
         } else {
-            char num[8];
-            utoa(num, reason.depth + 1);
-            fputs("[rpath of ", stdout);
-            fputs(num, stdout);
-            putchar(']');
+            strings = end;
+            entries = 16;
+            entry_size = 12;
         }
-        break;
-    case LD_LIBRARY_PATH:
-        fputs("[LD_LIBRARY_PATH]", stdout);
-        break;
-    case RUNPATH:
-        fputs("[runpath]", stdout);
-        break;
-    case LD_SO_CONF:
-        putchar('[');
-        char *conf_name = strrchr(s->ld_conf_file, '/');
-        conf_name = conf_name == NULL ? s->ld_conf_file : conf_name + 1;
-        fputs(conf_name, stdout);
-        putchar(']');
-        break;
-    case DIRECT:
-        fputs("[direct]", stdout);
-        break;
-    case DEFAULT:
-        fputs("[default path]", stdout);
-        break;
-    default:
-        break;
+    } else if (f->size >= 48 && memcmp(f->data, LD_CACHE_MAGIC_NEW,
+                                       magic_new_len) == 0) {
+        is_new = 1;
+        strings = 0;
+    } else {
+        ld_cache_free(c);
+        return 1;
     }
-    if (s->color)
-        fputs(CLEAR "\n", stdout);
-    else
-        putchar('\n');
-}
 
-static void print_error(size_t depth, size_t needed_not_found,
-                        struct small_vec_u64_t *needed_buf_offsets,
-                        char *runpath, struct libtree_state_t *s,
-                        int no_def_lib) {
-    for (size_t i = 0; i < needed_not_found; ++i) {
-        s->found_all_needed[depth] = i + 1 >= needed_not_found;
-        tree_preamble(s, depth + 1);
-        if (s->color)
-            fputs(BOLD_RED, stdout);
-        fputs(s->string_table.arr + needed_buf_offsets->p[i], stdout);
-        fputs(" not found\n", stdout);
-        if (s->color)
-            fputs(CLEAR, stdout);
+    // In the new format string offsets are relative to its header.
+    if (is_new) {
+        memcpy(&nlibs, f->data + strings + 20, sizeof(uint32_t));
+        entries = strings + 48;
+        entry_size = 24;
     }
 
-    // If anything was not found, we print the search paths in order they
-    // are considered.
-    char *box_vertical =
-        s->color ? JUST_INDENT REGULAR_RED LIGHT_QUADRUPLE_DASH_VERTICAL CLEAR
-                 : JUST_INDENT LIGHT_QUADRUPLE_DASH_VERTICAL;
-    char *indent = malloc(sizeof(LIGHT_VERTICAL_WITH_INDENT) * depth +
-                          strlen(box_vertical) + 1);
-    char *p = indent;
-    for (size_t i = 0; i < depth; ++i) {
-        if (s->found_all_needed[i]) {
-            int len = sizeof(JUST_INDENT) - 1;
-            memcpy(p, JUST_INDENT, len);
-            p += len;
-        } else {
-            int len = sizeof(LIGHT_VERTICAL_WITH_INDENT) - 1;
-            memcpy(p, LIGHT_VERTICAL_WITH_INDENT, len);
-            p += len;
-        }
+    if (entries + (uint64_t)nlibs * entry_size > f->size) {
+        ld_cache_free(c);
+        return 1;
     }
-    // dotted | in red
-    strcpy(p, box_vertical);
 
-    fputs(indent, stdout);
-    if (s->color)
-        fputs(BRIGHT_BLACK, stdout);
-    fputs(" Paths considered in this order:\n", stdout);
-    if (s->color)
-        fputs(CLEAR, stdout);
+    c->entries = malloc((nlibs + 1) * sizeof(struct ld_cache_entry_t));
+    if (c->entries == NULL)
+        exit(1);
 
-    // Consider rpaths only when runpath is empty
-    fputs(indent, stdout);
-    if (runpath != NULL) {
-        if (s->color)
-            fputs(BRIGHT_BLACK, stdout);
-        fputs(" 1. rpath is skipped because runpath was set\n", stdout);
-        if (s->color)
-            fputs(CLEAR, stdout);
-    } else {
-        if (s->color)
-            fputs(BRIGHT_BLACK, stdout);
-        fputs(" 1. rpath:\n", stdout);
-        if (s->color)
-            fputs(CLEAR, stdout);
-        for (int j = depth; j >= 0; --j) {
-            if (s->rpath_offsets[j] != SIZE_MAX) {
-                char num[8];
-                utoa(num, j + 1);
-                fputs(indent, stdout);
-                if (s->color)
-                    fputs(BRIGHT_BLACK, stdout);
-                fputs("    depth ", stdout);
-                fputs(num, stdout);
-                if (s->color)
-                    fputs(CLEAR, stdout);
-                putchar('\n');
-                print_colon_delimited_paths(
-                    s->string_table.arr + s->rpath_offsets[j], indent);
-            }
+    for (uint32_t i = 0; i < nlibs; ++i) {
+        unsigned char const *entry = f->data + entries + i * entry_size;
+        uint32_t key;
+        uint32_t value;
+        memcpy(&key, entry + 4, sizeof(uint32_t));
+        memcpy(&value, entry + 8, sizeof(uint32_t));
+
+        if (is_new) {
+            uint64_t hwcap;
+            memcpy(&hwcap, entry + 16, sizeof(uint64_t));
+            if (hwcap != 0)
+                continue;
         }
-    }
 
-    // Environment variables
-    fputs(indent, stdout);
-    if (s->color)
-        fputs(BRIGHT_BLACK, stdout);
-    fputs(s->ld_library_path_offset == SIZE_MAX
-              ? " 2. LD_LIBRARY_PATH was not set\n"
-              : " 2. LD_LIBRARY_PATH:\n",
-          stdout);
-    if (s->color)
-        fputs(CLEAR, stdout);
-    if (s->ld_library_path_offset != SIZE_MAX)
-        print_colon_delimited_paths(
-            s->string_table.arr + s->ld_library_path_offset, indent);
+        char const *soname = elf_file_string(f, strings, MAX_OFFSET_T, key);
+        char const *lib = elf_file_string(f, strings, MAX_OFFSET_T, value);
+        if (soname == NULL || lib == NULL)
+            continue;
 
-    // runpath
-    fputs(indent, stdout);
-    if (s->color)
-        fputs(BRIGHT_BLACK, stdout);
-    fputs(runpath == NULL ? " 3. runpath was not set\n" : " 3. runpath:\n",
-          stdout);
-    if (s->color)
-        fputs(CLEAR, stdout);
-    if (runpath != NULL)
-        print_colon_delimited_paths(runpath, indent);
+        struct ld_cache_entry_t *e = &c->entries[c->num_entries++];
+        e->soname = soname;
+        e->path = lib;
+        e->next = 0;
+    }
 
-    fputs(indent, stdout);
-    if (s->color)
-        fputs(BRIGHT_BLACK, stdout);
-    fputs(no_def_lib
-              ? " 4. ld config files not considered due to NODEFLIB flag\n"
-              : " 4. ld config files:\n",
-          stdout);
-    if (s->color)
-        fputs(CLEAR, stdout);
-    print_colon_delimited_paths(s->string_table.arr + s->ld_so_conf_offset,
-                                indent);
+    // Keep the load factor below 1/2.
+    c->capacity = 16;
+    while (c->capacity < 2 * c->num_entries)
+        c->capacity *= 2;
+    c->table = calloc(c->capacity, sizeof(uint32_t));
+    if (c->table == NULL)
+        exit(1);
 
-    fputs(indent, stdout);
-    if (s->color)
-        fputs(BRIGHT_BLACK, stdout);
-    fputs(no_def_lib
-              ? " 5. Standard paths not considered due to NODEFLIB flag\n"
-              : " 5. Standard paths:\n",
-          stdout);
-    if (s->color)
-        fputs(CLEAR, stdout);
-    print_colon_delimited_paths(s->string_table.arr + s->default_paths_offset,
-                                indent);
+    // Insert back to front, so that entries for the same soname are chained
+    // in file order.
+    for (size_t i = c->num_entries; i-- > 0;) {
+        size_t slot = ld_cache_slot(c, c->entries[i].soname);
+        c->entries[i].next = c->table[slot];
+        c->table[slot] = i + 1;
+    }
 
-    free(indent);
+    return 0;
 }
 
-static int visited_files_contains(struct visited_file_array_t *files,
-                                  struct stat *needle) {
-    for (size_t i = 0; i < files->n; ++i) {
-        struct visited_file_t *f = &files->arr[i];
-        if (f->st_dev == needle->st_dev && f->st_ino == needle->st_ino)
-            return 1;
+static int is_in_exclude_list(char const *soname) {
+    // Get to the end.
+    char const *start = soname;
+    char const *end = strrchr(start, '\0');
+
+    // Empty needed string, is that even possible?
+    if (start == end)
+        return 0;
+
+    --end;
+
+    // Strip "1234567890." from the right.
+    while (end != start && ((*end >= '0' && *end <= '9') || *end == '.')) {
+        --end;
     }
-    return 0;
-}
 
-static void visited_files_append(struct visited_file_array_t *files,
-                                 struct stat *new) {
-    if (files->n == files->capacity) {
-        files->capacity *= 2;
-        files->arr = realloc(files->arr,
-                             files->capacity * sizeof(struct visited_file_t));
-        if (files->arr == NULL)
-            exit(1);
+    // Check if we should skip this one.
+    for (size_t j = 0; j < sizeof(exclude_list) / sizeof(char *); ++j) {
+        size_t len = strlen(exclude_list[j]);
+        if (strncmp(start, exclude_list[j], len) != 0)
+            continue;
+        return 1;
     }
-    files->arr[files->n].st_dev = new->st_dev;
-    files->arr[files->n].st_ino = new->st_ino;
-    ++files->n;
-}
 
-static int recurse(char *current_file, size_t depth, struct libtree_state_t *s,
-                   struct compat_t compat, struct found_t reason) {
-    FILE *fptr = fopen(current_file, "rb");
+    return 0;
+}
 
-    if (fptr == NULL)
-        return ERR_COULD_NOT_OPEN_FILE;
+#ifndef LIBTREE_LIBRARY
+static void tree_preamble(struct tree_printer_t *p, size_t depth) {
+    if (depth == 0)
+        return;
 
-    // When we're done recursing, we should give back the memory we've claimed.
-    size_t old_buf_size = s->string_table.n;
+    for (size_t i = 0; i < depth - 1; ++i)
+        fputs(p->stack[i].found_all_needed ? JUST_INDENT
+                                           : LIGHT_VERTICAL_WITH_INDENT,
+              p->out);
 
-    // Parse the header
-    char e_ident[16];
-    if (fread(&e_ident, 16, 1, fptr) != 1) {
-        fclose(fptr);
-        return ERR_INVALID_MAGIC;
+    fputs(p->stack[depth - 1].found_all_needed
+              ? LIGHT_UP_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " "
+              : LIGHT_VERTICAL_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " ",
+          p->out);
+}
+#endif
+
+static struct dag_node_t *dag_candidate(struct file_ref_t const *ref,
+                                        struct dag_node_t *parent,
+                                        struct libtree_state_t *s);
+
+static void dag_edges_append(struct dag_edges_t *edges,
+                             struct dag_edge_t const *edge) {
+    if (edges->n == edges->capacity) {
+        edges->capacity = edges->capacity == 0 ? 8 : 2 * edges->capacity;
+        edges->p = realloc(edges->p, edges->capacity * sizeof(*edges->p));
+        if (edges->p == NULL)
+            exit(1);
     }
+    edges->p[edges->n++] = *edge;
+}
 
-    // Find magic elfs
-    if (e_ident[0] != 0x7f || e_ident[1] != 'E' || e_ident[2] != 'L' ||
-        e_ident[3] != 'F') {
-        fclose(fptr);
-        return ERR_INVALID_MAGIC;
+// Swap the i-th soname to the back, where the ones that were handled go.
+static inline void needed_found(struct soname_t const **needed, size_t i,
+                                size_t *needed_not_found) {
+    struct soname_t const *tmp = needed[i];
+    needed[i] = needed[*needed_not_found - 1];
+    needed[--*needed_not_found] = tmp;
+}
+
+static void apply_exclude_list(size_t *needed_not_found,
+                               struct soname_t const **needed) {
+    for (size_t i = 0; i < *needed_not_found;) {
+        // If in exclude list, swap to the back.
+        if (needed[i]->excluded)
+            needed_found(needed, i, needed_not_found);
+        else
+            ++i;
+    }
+}
+
+static void check_absolute_paths(size_t *needed_not_found,
+                                 struct soname_t const **needed,
+                                 struct dag_node_t *parent,
+                                 struct dag_edges_t *edges,
+                                 struct libtree_state_t *s) {
+    // First go over absolute paths in needed libs.
+    for (size_t i = 0; i < *needed_not_found;) {
+        char const *path = needed[i]->name;
+
+        // Skip dt_needed that have do not contain /
+        if (strchr(path, '/') == NULL) {
+            ++i;
+            continue;
+        }
+
+        // Unlikely to happen but good to guard against
+        if (needed[i]->len >= MAX_PATH_LENGTH) {
+            ++i;
+            continue;
+        }
+
+        struct dag_edge_t edge = {.soname = path,
+                                  .last = *needed_not_found <= 1};
+
+        // If it is not an absolute path, we bail, cause it then starts to
+        // depend on the current working directory, which is rather
+        // nonsensical. This is allowed by glibc though.
+        if (path[0] != '/') {
+            edge.error = ERR_DEPENDENCY_NOT_FOUND;
+        } else {
+            struct file_ref_t ref = {path, -1, AT_FDCWD, path};
+            edge.reason = (struct found_t){.how = DIRECT};
+            edge.node = dag_candidate(&ref, parent, s);
+            ++s->stats.tried[DIRECT];
+            if (edge.node != NULL)
+                ++s->stats.found[DIRECT];
+        }
+        dag_edges_append(edges, &edge);
+
+        // Handled this library, so swap to the back.
+        needed_found(needed, i, needed_not_found);
+    }
+}
+
+#ifdef HAVE_IO_URING
+// An io_uring with its queues mapped into our address space.
+struct probe_ring_t {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+static void probe_ring_free(struct probe_ring_t *r) {
+    if (r == NULL)
+        return;
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map != MAP_FAILED)
+        munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+    free(r);
+}
+
+// Returns NULL when the kernel does not support io_uring, or when it is
+// disabled, as it often is in containers, or too old to open files with it.
+static struct probe_ring_t *probe_ring_new(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return NULL;
+    if ((params.features & IORING_FEAT_CUR_PERSONALITY) == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct probe_ring_t *r = malloc(sizeof(struct probe_ring_t));
+    if (r == NULL)
+        exit(1);
+    r->fd = fd;
+    r->entries = params.sq_entries;
+    r->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_map_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Since Linux 5.4 both queues are in one mapping.
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && r->cq_map_size > r->sq_map_size)
+        r->sq_map_size = r->cq_map_size;
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map
+                       : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED ||
+        r->sqes == MAP_FAILED) {
+        probe_ring_free(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_map;
+    char *cq = r->cq_map;
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return r;
+}
+
+// Like openat(), errors other than a missing file leave it to openat() itself.
+static void probe_done(struct probe_t *p, int res) {
+    if (res >= 0) {
+        p->fd = res;
+        p->result = PROBE_FOUND;
+    } else if (res == -ENOENT || res == -ENOTDIR) {
+        p->result = PROBE_MISSING;
+    }
+}
+
+// Take `n` completions of submitted probes. The kernel writes the results of
+// submitted probes no matter what, so this does not return before all of them
+// are in; when waiting fails it polls instead, and returns -1.
+static int probe_ring_reap(struct probe_ring_t *r, struct probe_batch_t *b,
+                           unsigned n) {
+    int code = 0;
+    unsigned reaped = 0;
+    while (reaped < n) {
+        unsigned head = *r->cq_head;
+        unsigned cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == cq_tail) {
+            if (code != 0)
+                sched_yield();
+            else if (syscall(__NR_io_uring_enter, r->fd, 0, n - reaped,
+                             IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                     errno != EINTR)
+                code = -1;
+            continue;
+        }
+        for (; head != cq_tail; ++head, ++reaped) {
+            struct io_uring_cqe const *cqe = &r->cqes[head & *r->cq_mask];
+            probe_done(&b->probes[cqe->user_data], cqe->res);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return code;
+}
+
+// Open the paths of all probes, as many at a time as fit in the ring, and
+// wait for the results. Returns -1 when the ring can no longer be used, in
+// which case the remaining probes stay unknown. Nothing is in flight when it
+// returns, so the probes and their paths can be reused either way.
+static int probe_ring_open(struct probe_ring_t *r, struct probe_batch_t *b) {
+    for (size_t start = 0; start < b->n; start += r->entries) {
+        unsigned batch =
+            b->n - start < r->entries ? (unsigned)(b->n - start) : r->entries;
+
+        // Only we write the tail, the kernel reads it.
+        unsigned tail = *r->sq_tail;
+        for (unsigned j = 0; j < batch; ++j) {
+            struct probe_t *p = &b->probes[start + j];
+            unsigned idx = (tail + j) & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uintptr_t)(b->paths.arr + p->path);
+            sqe->open_flags = O_RDONLY;
+            sqe->user_data = start + j;
+            r->sq_array[idx] = idx;
+        }
+        __atomic_store_n(r->sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        // When the kernel returns a count, it is of the entries it took,
+        // even if waiting for them failed.
+        long submitted = syscall(__NR_io_uring_enter, r->fd, batch, batch,
+                                 IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted != (long)batch) {
+            // Take back the entries it did not take, so that they are never
+            // submitted, and wait for the ones it did.
+            unsigned taken = submitted > 0 ? (unsigned)submitted : 0;
+            __atomic_store_n(r->sq_tail, tail + taken, __ATOMIC_RELEASE);
+            probe_ring_reap(r, b, taken);
+            return -1;
+        }
+
+        // Completions arrive in any order, they are used in search order
+        // once all of them are in.
+        if (probe_ring_reap(r, b, batch) != 0)
+            return -1;
+    }
+    return 0;
+}
+#else
+static void probe_ring_free(struct probe_ring_t *r) { (void)r; }
+
+static struct probe_ring_t *probe_ring_new(unsigned entries) {
+    (void)entries;
+    return NULL;
+}
+
+static int probe_ring_open(struct probe_ring_t *r, struct probe_batch_t *b) {
+    (void)r;
+    (void)b;
+    return -1;
+}
+#endif
+
+static struct probe_ring_t *probe_ring_get(struct libtree_state_t *s) {
+    if (s->ring == NULL && !s->ring_tried) {
+        s->ring_tried = 1;
+        s->ring = probe_ring_new(PROBE_RING_ENTRIES);
+    }
+    return s->ring;
+}
+
+// Close the files that were found but not taken.
+static void probe_batch_free(struct probe_batch_t *b) {
+    for (size_t j = 0; j < b->n; ++j)
+        if (b->probes[j].fd != -1)
+            close(b->probes[j].fd);
+    free(b->probes);
+    free(b->paths.arr);
+}
+
+static void probe_batch_add(struct probe_batch_t *b, size_t d,
+                            struct search_dir_t const *dir,
+                            struct soname_t const *soname) {
+    if (b->n == b->capacity) {
+        b->capacity = b->capacity == 0 ? 16 : 2 * b->capacity;
+        b->probes = realloc(b->probes, b->capacity * sizeof(struct probe_t));
+        if (b->probes == NULL)
+            exit(1);
+    }
+    struct probe_t *p = &b->probes[b->n++];
+    p->dir = d;
+    p->soname = soname;
+    p->path = b->paths.n;
+    p->result = PROBE_UNKNOWN;
+    p->fd = -1;
+
+    string_table_maybe_grow(&b->paths, dir->len + soname->len + 1);
+    memcpy(b->paths.arr + b->paths.n, dir->path, dir->len);
+    memcpy(b->paths.arr + b->paths.n + dir->len, soname->name,
+           soname->len + 1);
+    b->paths.n += dir->len + soname->len + 1;
+}
+
+// Open in one go the candidates that check_search_paths() is about to try.
+// For every soname that is the first one a directory listing shows, which
+// is usually the one that is used, and every one in directories that could
+// not be listed, up to MAX_PROBES. Does nothing when the kernel can't batch
+// them, or when there is only one.
+static void probe_batch_run(struct probe_batch_t *b,
+                            struct search_path_t const *search_path,
+                            size_t needed_not_found,
+                            struct soname_t const **needed,
+                            struct libtree_state_t *s) {
+    // In low metadata mode files are opened relative to directories kept open.
+    if (s->low_metadata || probe_ring_get(s) == NULL)
+        return;
+
+    unsigned char claimed_buf[SMALL_VEC_SIZE];
+    unsigned char *claimed = claimed_buf;
+    if (needed_not_found > SMALL_VEC_SIZE) {
+        claimed = malloc(needed_not_found);
+        if (claimed == NULL)
+            exit(1);
+    }
+    memset(claimed, 0, needed_not_found);
+
+    size_t unclaimed = needed_not_found;
+    for (size_t d = 0; d < search_path->n && unclaimed && b->n < MAX_PROBES;
+         ++d) {
+        struct search_dir_t const *dir = &search_path->dirs[d];
+        for (size_t i = 0; i < needed_not_found && b->n < MAX_PROBES; ++i) {
+            struct soname_t const *soname = needed[i];
+            if (claimed[i] || dir->len + soname->len + 1 >= MAX_PATH_LENGTH)
+                continue;
+            int may = dir_cache_may_contain(s->dirs, s->arena, dir, soname,
+                                            NULL, &s->stats);
+            if (may == 0)
+                continue;
+            probe_batch_add(b, d, dir, soname);
+            if (may == 2) {
+                claimed[i] = 1;
+                --unclaimed;
+            }
+        }
+    }
+
+    if (claimed != claimed_buf)
+        free(claimed);
+
+    if (b->n < 2) {
+        b->n = 0;
+        return;
+    }
+
+    s->stats.opens += b->n;
+    if (probe_ring_open(s->ring, b) != 0) {
+        probe_ring_free(s->ring);
+        s->ring = NULL;
+    }
+}
+
+// The probe of `soname` in the d-th directory, if any. Probes are ordered by
+// directory, `*cursor` is the first one of the current directory or later.
+static struct probe_t *probe_batch_find(struct probe_batch_t *b,
+                                        size_t *cursor, size_t d,
+                                        struct soname_t const *soname) {
+    while (*cursor < b->n && b->probes[*cursor].dir < d)
+        ++*cursor;
+    for (size_t j = *cursor; j < b->n && b->probes[j].dir == d; ++j)
+        if (b->probes[j].soname == soname)
+            return &b->probes[j];
+    return NULL;
+}
+
+static void check_search_paths(struct found_t reason,
+                               struct search_path_t const *search_path,
+                               size_t *needed_not_found,
+                               struct soname_t const **needed,
+                               struct dag_node_t *parent,
+                               struct dag_edges_t *edges,
+                               struct libtree_state_t *s) {
+    char path[MAX_PATH_LENGTH];
+
+    struct probe_batch_t batch = {NULL, 0, 0, {NULL, 0, 0}};
+    probe_batch_run(&batch, search_path, *needed_not_found, needed, s);
+    size_t cursor = 0;
+
+    for (size_t d = 0; d < search_path->n && *needed_not_found; ++d) {
+        struct search_dir_t const *dir = &search_path->dirs[d];
+
+        // Try to open it -- if we've found anything, swap it with the back.
+        for (size_t i = 0; i < *needed_not_found;) {
+            struct soname_t const *soname = needed[i];
+
+            // Path too long, can't handle.
+            if (dir->len + soname->len + 1 >= MAX_PATH_LENGTH) {
+                ++i;
+                continue;
+            }
+
+            // Most candidates do not exist, which we can tell from the
+            // directory listing without opening anything.
+            int dirfd;
+            if (!dir_cache_may_contain(s->dirs, s->arena, dir, soname, &dirfd,
+                                       &s->stats)) {
+                ++s->stats.ruled_out[reason.how];
+                ++i;
+                continue;
+            }
+            ++s->stats.tried[reason.how];
+
+            // Skip what the batch did not find, and take what it opened.
+            struct probe_t *probe =
+                probe_batch_find(&batch, &cursor, d, soname);
+            if (probe != NULL && probe->result == PROBE_MISSING) {
+                ++i;
+                continue;
+            }
+
+            memcpy(path, dir->path, dir->len);
+            memcpy(path + dir->len, soname->name, soname->len + 1);
+
+            // And try to locate the lib.
+            struct file_ref_t ref = {path, -1, AT_FDCWD, path};
+            if (probe != NULL) {
+                ref.fd = probe->fd;
+                probe->fd = -1;
+            }
+            if (dirfd != -1) {
+                ref.dirfd = dirfd;
+                ref.name = soname->name;
+            }
+            struct dag_node_t *node = dag_candidate(&ref, parent, s);
+            struct dag_edge_t edge = {.node = node,
+                                      .soname = soname->name,
+                                      .reason = reason,
+                                      .last = *needed_not_found <= 1};
+            if (edge.node != NULL) {
+                ++s->stats.found[reason.how];
+                dag_edges_append(edges, &edge);
+
+                // Found the direct dependency, so swap out the current
+                // soname to the back and reduce the number of to be found by
+                // one.
+                needed_found(needed, i, needed_not_found);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    probe_batch_free(&batch);
+}
+
+static void check_ld_cache(size_t *needed_not_found,
+                           struct soname_t const **needed,
+                           struct dag_node_t *parent, struct dag_edges_t *edges,
+                           struct libtree_state_t *s) {
+    struct ld_cache_t const *c = &s->ld_cache;
+
+    for (size_t i = 0; i < *needed_not_found;) {
+        struct dag_edge_t edge = {.soname = needed[i]->name,
+                                  .reason = {.how = LD_SO_CACHE},
+                                  .last = *needed_not_found <= 1};
+
+        // Try all entries for this soname in order, since some may be for a
+        // different architecture.
+        uint32_t e = ld_cache_find(c, needed[i]->name);
+        for (; e != 0 && edge.node == NULL; e = c->entries[e - 1].next) {
+            char const *path = c->entries[e - 1].path;
+            struct file_ref_t ref = {path, -1, AT_FDCWD, path};
+            edge.node = dag_candidate(&ref, parent, s);
+            ++s->stats.tried[LD_SO_CACHE];
+        }
+
+        if (edge.node != NULL) {
+            ++s->stats.found[LD_SO_CACHE];
+            dag_edges_append(edges, &edge);
+            needed_found(needed, i, needed_not_found);
+        } else {
+            ++i;
+        }
+    }
+}
+
+// Substitute $ORIGIN, $LIB, etc. Returns src itself when there is nothing to
+// substitute, and a copy in the cache's arena otherwise.
+static char const *interpolate_variables(struct libtree_state_t *s,
+                                         char const *src, char const *ORIGIN) {
+    // We do not write to dst if there is no variables to interpolate.
+    char const *prev_src = src;
+    char const *curr_src = src;
+
+    struct string_table_t *st = &s->scratch;
+    st->n = 0;
+
+    while (1) {
+        // Find the next potential variable.
+        char const *dollar = strchr(curr_src, '$');
+        if (dollar == NULL)
+            break;
+        curr_src = dollar;
+
+        size_t bytes_to_dollar = curr_src - prev_src;
+
+        // Go past the dollar.
+        ++curr_src;
+
+        // Remember if we have to look for matching curly braces.
+        int curly = 0;
+        if (*curr_src == '{') {
+            curly = 1;
+            ++curr_src;
+        }
+
+        // String to interpolate.
+        char const *var_val = NULL;
+        if (strncmp(curr_src, "ORIGIN", 6) == 0) {
+            var_val = ORIGIN;
+            curr_src += 6;
+        } else if (strncmp(curr_src, "LIB", 3) == 0) {
+            var_val = s->LIB;
+            curr_src += 3;
+        } else if (strncmp(curr_src, "PLATFORM", 8) == 0) {
+            var_val = s->PLATFORM;
+            curr_src += 8;
+        } else if (strncmp(curr_src, "OSNAME", 6) == 0) {
+            var_val = s->OSNAME;
+            curr_src += 6;
+        } else if (strncmp(curr_src, "OSREL", 5) == 0) {
+            var_val = s->OSREL;
+            curr_src += 5;
+        } else {
+            continue;
+        }
+
+        // Require matching {...}.
+        if (curly) {
+            if (*curr_src != '}') {
+                continue;
+            }
+            ++curr_src;
+        }
+
+        size_t var_len = strlen(var_val);
+
+        // Make sure we have enough space to write to.
+        string_table_maybe_grow(st, bytes_to_dollar + var_len);
+
+        // First copy over the string until the variable.
+        memcpy(st->arr + st->n, prev_src, bytes_to_dollar);
+        st->n += bytes_to_dollar;
+
+        // Then move prev_src until after the variable.
+        prev_src = curr_src;
+
+        // Then copy the variable value (without null).
+        memcpy(st->arr + st->n, var_val, var_len);
+        st->n += var_len;
+    }
+
+    // Did we copy anything? That implies a variable was interpolated.
+    if (prev_src == src)
+        return src;
+
+    // Copy the remainder, including the \0.
+    string_table_store(st, prev_src);
+    return arena_copy(s->arena, st->arr, st->n);
+}
+
+// Split a colon-separated search path into directories, skipping empty ones
+// and ones too long to handle. `str` is not copied.
+static struct search_path_t *search_path_parse(struct arena_t *a,
+                                               char const *str) {
+    struct search_path_t *p = arena_alloc(a, sizeof(*p));
+    p->str = str;
+    p->hash = hash_str(str, strlen(str));
+    p->n = 0;
+
+    size_t max_dirs = 1;
+    for (char const *c = str; *c != '\0'; ++c)
+        max_dirs += *c == ':';
+    p->dirs = arena_alloc(a, max_dirs * sizeof(struct search_dir_t));
+
+    char const *curr = str;
+    while (*curr != '\0') {
+        char const *end = curr;
+        while (*end != '\0' && *end != ':')
+            ++end;
+        size_t len = end - curr;
+
+        if (len > 0 && len + 1 < MAX_PATH_LENGTH) {
+            // Add a separator if necessary
+            int slash = curr[len - 1] != '/';
+            char *path = arena_alloc(a, len + slash + 1);
+            memcpy(path, curr, len);
+            if (slash)
+                path[len] = '/';
+            path[len + slash] = '\0';
+
+            struct search_dir_t *dir = &p->dirs[p->n++];
+            dir->path = path;
+            dir->len = len + slash;
+            dir->hash = hash_str(path, dir->len);
+        }
+
+        curr = *end == ':' ? end + 1 : end;
+    }
+
+    return p;
+}
+
+static size_t soname_slot(struct elf_cache_t const *c, char const *name,
+                          size_t len, uint64_t hash) {
+    size_t mask = c->sonames_capacity - 1;
+    size_t i = hash & mask;
+    while (c->sonames[i] != NULL) {
+        struct soname_t const *n = c->sonames[i];
+        if (n->hash == hash && n->len == len && memcmp(n->name, name, len) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// The interned soname `name`, which is not copied. Call with the cache
+// locked.
+static struct soname_t const *soname_intern(struct elf_cache_t *c,
+                                            struct arena_t *a,
+                                            char const *name) {
+    size_t len = strlen(name);
+    uint64_t hash = hash_str(name, len);
+    size_t i = soname_slot(c, name, len, hash);
+    if (c->sonames[i] != NULL)
+        return c->sonames[i];
+
+    struct soname_t *n = arena_alloc(a, sizeof(*n));
+    n->name = name;
+    n->len = len;
+    n->hash = hash;
+    n->excluded = is_in_exclude_list(name);
+
+    // Keep the load factor below 1/2.
+    if (2 * (c->num_sonames + 1) > c->sonames_capacity) {
+        struct soname_t **old = c->sonames;
+        size_t old_capacity = c->sonames_capacity;
+        c->sonames_capacity *= 2;
+        c->sonames = calloc(c->sonames_capacity, sizeof(struct soname_t *));
+        if (c->sonames == NULL)
+            exit(1);
+        for (size_t j = 0; j < old_capacity; ++j)
+            if (old[j] != NULL)
+                c->sonames[soname_slot(c, old[j]->name, old[j]->len,
+                                       old[j]->hash)] = old[j];
+        free(old);
+        i = soname_slot(c, name, len, hash);
+    }
+    c->sonames[i] = n;
+    ++c->num_sonames;
+    return n;
+}
+
+static size_t search_memo_slot(struct elf_cache_t const *c, char const *raw,
+                               char const *origin, uint64_t hash) {
+    size_t mask = c->memo_capacity - 1;
+    size_t i = hash & mask;
+    while (c->memo[i] != NULL) {
+        struct search_memo_t const *m = c->memo[i];
+        if (m->hash == hash && strcmp(m->raw, raw) == 0 &&
+            strcmp(m->origin, origin) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// The rpath or runpath `raw` of a file in directory `origin`, with variables
+// substituted and split into directories. Files of the same package tend to
+// share both, so this is done once per (raw, origin). Call with the cache
+// locked.
+static struct search_path_t const *
+search_path_get(struct libtree_state_t *s, char const *raw,
+                char const *origin) {
+    struct elf_cache_t *c = s->cache;
+
+    // Without variables the origin does not matter.
+    if (strchr(raw, '$') == NULL)
+        origin = "";
+
+    uint64_t hash = hash_str(raw, strlen(raw)) ^
+                    hash_u64(hash_str(origin, strlen(origin)));
+    size_t i = search_memo_slot(c, raw, origin, hash);
+    if (c->memo[i] != NULL)
+        return c->memo[i]->path;
+
+    struct search_memo_t *m = arena_alloc(s->arena, sizeof(*m));
+    m->raw = raw;
+    m->origin = arena_copy(s->arena, origin, strlen(origin) + 1);
+    m->hash = hash;
+    m->path = search_path_parse(s->arena, interpolate_variables(s, raw, origin));
+
+    // Keep the load factor below 1/2.
+    if (2 * (c->num_memo + 1) > c->memo_capacity) {
+        struct search_memo_t **old = c->memo;
+        size_t old_capacity = c->memo_capacity;
+        c->memo_capacity *= 2;
+        c->memo = calloc(c->memo_capacity, sizeof(struct search_memo_t *));
+        if (c->memo == NULL)
+            exit(1);
+        for (size_t j = 0; j < old_capacity; ++j)
+            if (old[j] != NULL)
+                c->memo[search_memo_slot(c, old[j]->raw, old[j]->origin,
+                                         old[j]->hash)] = old[j];
+        free(old);
+        i = search_memo_slot(c, raw, origin, hash);
+    }
+    c->memo[i] = m;
+    ++c->num_memo;
+    return m->path;
+}
+
+#ifndef LIBTREE_LIBRARY
+static void print_colon_delimited_paths(char const *start, char const *indent,
+                                        FILE *out) {
+    while (1) {
+        // Don't print empty string
+        if (*start == '\0')
+            break;
+
+        // Find the next delimiter after start
+        char *next = strchr(start, ':');
+
+        // Don't print empty strings
+        if (start == next) {
+            ++start;
+            continue;
+        }
+
+        fputs(indent, out);
+        fputs(JUST_INDENT, out);
+
+        // Print up to but not including : or \0, followed by a newline.
+        if (next == NULL) {
+            fputs(start, out);
+            fputc('\n', out);
+        } else {
+            fwrite(start, 1, next - start, out);
+            fputc('\n', out);
+        }
+
+        // We done yet?
+        if (next == NULL)
+            break;
+
+        // Otherwise put the : back in place and continue.
+        start = next + 1;
+    }
+}
+
+static void print_line(size_t depth, char const *name, char *color_bold,
+                       char *color_regular, int highlight,
+                       struct found_t reason, char const *suffix,
+                       struct libtree_state_t *s, struct tree_printer_t *p) {
+    if (p->out == NULL)
+        return;
+
+    tree_preamble(p, depth);
+    // Color the filename different than the path name, if we have a path.
+    char const *slash = NULL;
+    if (s->color && highlight && (slash = strrchr(name, '/')) != NULL) {
+        fputs(color_regular, p->out);
+        fwrite(name, 1, slash + 1 - name, p->out);
+        fputs(color_bold, p->out);
+        fputs(slash + 1, p->out);
+    } else {
+        if (s->color)
+            fputs(color_bold, p->out);
+
+        fputs(name, p->out);
+    }
+    if (s->color && highlight)
+        fputs(CLEAR " " BOLD_YELLOW, p->out);
+    else
+        fputc(' ', p->out);
+    switch (reason.how) {
+    case RPATH:
+        if (reason.up == 0) {
+            fputs("[rpath]", p->out);
+        } else {
+            char num[8];
+            utoa(num, depth - reason.up);
+            fputs("[rpath of ", p->out);
+            fputs(num, p->out);
+            fputc(']', p->out);
+        }
+        break;
+    case LD_LIBRARY_PATH:
+        fputs("[LD_LIBRARY_PATH]", p->out);
+        break;
+    case RUNPATH:
+        fputs("[runpath]", p->out);
+        break;
+    case LD_SO_CONF:
+        fputc('[', p->out);
+        char *conf_name = strrchr(s->ld_conf_file, '/');
+        conf_name = conf_name == NULL ? s->ld_conf_file : conf_name + 1;
+        fputs(conf_name, p->out);
+        fputc(']', p->out);
+        break;
+    case LD_SO_CACHE:
+        fputc('[', p->out);
+        char *cache_name = strrchr(s->ld_cache_file, '/');
+        cache_name = cache_name == NULL ? s->ld_cache_file : cache_name + 1;
+        fputs(cache_name, p->out);
+        fputc(']', p->out);
+        break;
+    case DIRECT:
+        fputs("[direct]", p->out);
+        break;
+    case DEFAULT:
+        fputs("[default path]", p->out);
+        break;
+    default:
+        break;
+    }
+    if (suffix != NULL)
+        fputs(suffix, p->out);
+    if (s->color)
+        fputs(CLEAR "\n", p->out);
+    else
+        fputc('\n', p->out);
+}
+
+// List the dependencies of the node that could not be located, and where we
+// looked for them.
+static void print_error(size_t depth, struct dag_node_t const *node,
+                        struct libtree_state_t *s, struct tree_printer_t *p) {
+    if (p->out == NULL)
+        return;
+
+    size_t needed_not_found = node->num_missing;
+    struct search_path_t const *runpath = node->runpath;
+    int no_def_lib = node->no_def_lib;
+
+    for (size_t i = 0; i < needed_not_found; ++i) {
+        p->stack[depth].found_all_needed = i + 1 >= needed_not_found;
+        tree_preamble(p, depth + 1);
+        if (s->color)
+            fputs(BOLD_RED, p->out);
+        fputs(node->missing[i]->name, p->out);
+        fputs(" not found\n", p->out);
+        if (s->color)
+            fputs(CLEAR, p->out);
+    }
+
+    // If anything was not found, we print the search paths in order they
+    // are considered.
+    char *box_vertical =
+        s->color ? JUST_INDENT REGULAR_RED LIGHT_QUADRUPLE_DASH_VERTICAL CLEAR
+                 : JUST_INDENT LIGHT_QUADRUPLE_DASH_VERTICAL;
+    char *indent = malloc(sizeof(LIGHT_VERTICAL_WITH_INDENT) * depth +
+                          strlen(box_vertical) + 1);
+    char *q = indent;
+    for (size_t i = 0; i < depth; ++i) {
+        if (p->stack[i].found_all_needed) {
+            int len = sizeof(JUST_INDENT) - 1;
+            memcpy(q, JUST_INDENT, len);
+            q += len;
+        } else {
+            int len = sizeof(LIGHT_VERTICAL_WITH_INDENT) - 1;
+            memcpy(q, LIGHT_VERTICAL_WITH_INDENT, len);
+            q += len;
+        }
+    }
+    // dotted | in red
+    strcpy(q, box_vertical);
+
+    fputs(indent, p->out);
+    if (s->color)
+        fputs(BRIGHT_BLACK, p->out);
+    fputs(" Paths considered in this order:\n", p->out);
+    if (s->color)
+        fputs(CLEAR, p->out);
+
+    // Consider rpaths only when runpath is empty
+    fputs(indent, p->out);
+    if (runpath != NULL) {
+        if (s->color)
+            fputs(BRIGHT_BLACK, p->out);
+        fputs(" 1. rpath is skipped because runpath was set\n", p->out);
+        if (s->color)
+            fputs(CLEAR, p->out);
+    } else {
+        if (s->color)
+            fputs(BRIGHT_BLACK, p->out);
+        fputs(" 1. rpath:\n", p->out);
+        if (s->color)
+            fputs(CLEAR, p->out);
+        size_t up = node->rpaths_up;
+        for (struct rpath_chain_t const *c = node->rpaths; c != NULL;
+             up += c->up, c = c->parent) {
+            char num[8];
+            utoa(num, depth - up + 1);
+            fputs(indent, p->out);
+            if (s->color)
+                fputs(BRIGHT_BLACK, p->out);
+            fputs("    depth ", p->out);
+            fputs(num, p->out);
+            if (s->color)
+                fputs(CLEAR, p->out);
+            fputc('\n', p->out);
+            print_colon_delimited_paths(c->rpath->str, indent, p->out);
+        }
+    }
+
+    // Environment variables
+    fputs(indent, p->out);
+    if (s->color)
+        fputs(BRIGHT_BLACK, p->out);
+    fputs(s->ld_library_path == NULL ? " 2. LD_LIBRARY_PATH was not set\n"
+                                     : " 2. LD_LIBRARY_PATH:\n",
+          p->out);
+    if (s->color)
+        fputs(CLEAR, p->out);
+    if (s->ld_library_path != NULL)
+        print_colon_delimited_paths(s->ld_library_path->str, indent, p->out);
+
+    // runpath
+    fputs(indent, p->out);
+    if (s->color)
+        fputs(BRIGHT_BLACK, p->out);
+    fputs(runpath == NULL ? " 3. runpath was not set\n" : " 3. runpath:\n",
+          p->out);
+    if (s->color)
+        fputs(CLEAR, p->out);
+    if (runpath != NULL)
+        print_colon_delimited_paths(runpath->str, indent, p->out);
+
+    fputs(indent, p->out);
+    if (s->color)
+        fputs(BRIGHT_BLACK, p->out);
+    if (s->ld_cache_file != NULL) {
+        fputs(no_def_lib
+                  ? " 4. ld.so.cache not considered due to NODEFLIB flag\n"
+                  : " 4. ld.so.cache:\n",
+              p->out);
+        if (s->color)
+            fputs(CLEAR, p->out);
+        fputs(indent, p->out);
+        fputs(JUST_INDENT, p->out);
+        fputs(s->ld_cache_file, p->out);
+        fputc('\n', p->out);
+    } else {
+        fputs(no_def_lib
+                  ? " 4. ld config files not considered due to NODEFLIB flag\n"
+                  : " 4. ld config files:\n",
+              p->out);
+        if (s->color)
+            fputs(CLEAR, p->out);
+        print_colon_delimited_paths(s->ld_so_conf->str, indent, p->out);
+    }
+
+    fputs(indent, p->out);
+    if (s->color)
+        fputs(BRIGHT_BLACK, p->out);
+    fputs(no_def_lib
+              ? " 5. Standard paths not considered due to NODEFLIB flag\n"
+              : " 5. Standard paths:\n",
+          p->out);
+    if (s->color)
+        fputs(CLEAR, p->out);
+    print_colon_delimited_paths(s->default_paths->str, indent, p->out);
+
+    free(indent);
+}
+#endif
+
+static inline size_t visited_file_hash(dev_t dev, ino_t ino) {
+    return hash_u64((uint64_t)ino ^ hash_u64((uint64_t)dev));
+}
+
+static void visited_files_init(struct visited_file_set_t *files) {
+    files->n = 0;
+    files->capacity = 256;
+    files->arr = malloc(files->capacity * sizeof(struct visited_file_t));
+    files->used = calloc(files->capacity, sizeof(char));
+    if (files->arr == NULL || files->used == NULL)
+        exit(1);
+}
+
+static void visited_files_free(struct visited_file_set_t *files) {
+    free(files->arr);
+    free(files->used);
+}
+
+#ifndef LIBTREE_LIBRARY
+static void visited_files_clear(struct visited_file_set_t *files) {
+    memset(files->used, 0, files->capacity * sizeof(char));
+    files->n = 0;
+}
+
+// Returns the slot of the file if present, or the empty slot where it should
+// be inserted.
+static size_t visited_files_slot(struct visited_file_set_t const *files,
+                                 dev_t dev, ino_t ino) {
+    size_t mask = files->capacity - 1;
+    size_t i = visited_file_hash(dev, ino) & mask;
+    while (files->used[i]) {
+        struct visited_file_t const *f = &files->arr[i];
+        if (f->st_dev == dev && f->st_ino == ino)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int visited_files_contains(struct visited_file_set_t *files, dev_t dev,
+                                  ino_t ino) {
+    size_t i = visited_files_slot(files, dev, ino);
+    return files->used[i];
+}
+
+static void visited_files_grow(struct visited_file_set_t *files) {
+    struct visited_file_set_t old = *files;
+    files->capacity *= 2;
+    files->arr = malloc(files->capacity * sizeof(struct visited_file_t));
+    files->used = calloc(files->capacity, sizeof(char));
+    if (files->arr == NULL || files->used == NULL)
+        exit(1);
+    for (size_t j = 0; j < old.capacity; ++j) {
+        if (!old.used[j])
+            continue;
+        size_t i =
+            visited_files_slot(files, old.arr[j].st_dev, old.arr[j].st_ino);
+        files->arr[i] = old.arr[j];
+        files->used[i] = 1;
+    }
+    visited_files_free(&old);
+}
+
+static void visited_files_append(struct visited_file_set_t *files, dev_t dev,
+                                 ino_t ino) {
+    // Keep the load factor below 1/2.
+    if (2 * (files->n + 1) > files->capacity)
+        visited_files_grow(files);
+    size_t i = visited_files_slot(files, dev, ino);
+    if (files->used[i])
+        return;
+    files->arr[i].st_dev = dev;
+    files->arr[i].st_ino = ino;
+    files->used[i] = 1;
+    ++files->n;
+}
+#endif
+
+// Store a \0-terminated string in the record's string table.
+static uint64_t elf_record_store(char *strtab, size_t *n, char const *str) {
+    if (str == NULL)
+        return MAX_OFFSET_T;
+    size_t offset = *n;
+    size_t len = strlen(str) + 1;
+    memcpy(strtab + offset, str, len);
+    *n += len;
+    return offset;
+}
+
+// The file offset of virtual address `vaddr`, given the virtual addresses of
+// the PT_LOAD segments in ascending order, and their file offsets.
+static uint64_t vaddr_to_offset(struct small_vec_u64_t const *vaddrs,
+                                struct small_vec_u64_t const *offsets,
+                                uint64_t vaddr) {
+    size_t i = 0;
+    while (i + 1 != vaddrs->n && vaddr >= vaddrs->p[i + 1])
+        ++i;
+    return offsets->p[i] + vaddr - vaddrs->p[i];
+}
+
+static void elf_record_parse(struct elf_file_t *f,
+                             struct elf_record_t *r, struct arena_t *a) {
+    // Parse the header
+    char e_ident[16];
+    if (!elf_file_copy(f, 0, e_ident, 16)) {
+        r->header_error = ERR_INVALID_MAGIC;
+        return;
+    }
+
+    // Find magic elfs
+    if (e_ident[0] != 0x7f || e_ident[1] != 'E' || e_ident[2] != 'L' ||
+        e_ident[3] != 'F') {
+        r->header_error = ERR_INVALID_MAGIC;
+        return;
     }
 
     // Do at least *some* header validation
     if (e_ident[4] != BITS32 && e_ident[4] != BITS64) {
-        fclose(fptr);
-        return ERR_INVALID_CLASS;
+        r->header_error = ERR_INVALID_CLASS;
+        return;
+    }
+
+    if (e_ident[5] != '\x01' && e_ident[5] != '\x02') {
+        r->header_error = ERR_INVALID_DATA;
+        return;
+    }
+
+    r->type.class = e_ident[4];
+    int is_little_endian = e_ident[5] == '\x01';
+
+    // Make sure that the elf file has a the host's endianness
+    // Byte swapping is on the TODO list
+    if (is_little_endian ^ host_is_little_endian()) {
+        r->header_error = ERR_INVALID_ENDIANNESS;
+        return;
+    }
+
+    // And get the type
+    union {
+        struct header_64_t h64;
+        struct header_32_t h32;
+    } header;
+
+    // Read the (rest of the) elf header
+    uint64_t e_phoff;
+    uint64_t e_phnum;
+    if (r->type.class == BITS64) {
+        if (!elf_file_copy(f, 16, &header.h64, sizeof(struct header_64_t))) {
+            r->header_error = ERR_INVALID_HEADER;
+            return;
+        }
+        if (header.h64.e_type != ET_EXEC && header.h64.e_type != ET_DYN) {
+            r->header_error = ERR_NO_EXEC_OR_DYN;
+            return;
+        }
+        r->type.machine = header.h64.e_machine;
+        e_phoff = header.h64.e_phoff;
+        e_phnum = header.h64.e_phnum;
+    } else {
+        if (!elf_file_copy(f, 16, &header.h32, sizeof(struct header_32_t))) {
+            r->header_error = ERR_INVALID_HEADER;
+            return;
+        }
+        if (header.h32.e_type != ET_EXEC && header.h32.e_type != ET_DYN) {
+            r->header_error = ERR_NO_EXEC_OR_DYN;
+            return;
+        }
+        r->type.machine = header.h32.e_machine;
+        e_phoff = header.h32.e_phoff;
+        e_phnum = header.h32.e_phnum;
+    }
+
+    if (e_phoff > f->size) {
+        r->header_error = ERR_INVALID_PHOFF;
+        return;
+    }
+
+    // Make sure it's an executable or library
+    union {
+        struct prog_64_t p64;
+        struct prog_32_t p32;
+    } prog;
+
+    // map vaddr to file offset (we don't rely on the file being mapped like the
+    // dynamic loader would, so we have to translate vaddr to file offset)
+    struct small_vec_u64_t pt_load_offset;
+    struct small_vec_u64_t pt_load_vaddr;
+
+    small_vec_u64_init(&pt_load_offset);
+    small_vec_u64_init(&pt_load_vaddr);
+
+    // Read the program header.
+    uint64_t p_offset = MAX_OFFSET_T;
+    size_t prog_size = r->type.class == BITS64 ? sizeof(struct prog_64_t)
+                                               : sizeof(struct prog_32_t);
+    for (uint64_t i = 0; i < e_phnum; ++i) {
+        if (!elf_file_copy(f, e_phoff + i * prog_size, &prog, prog_size)) {
+            small_vec_u64_free(&pt_load_offset);
+            small_vec_u64_free(&pt_load_vaddr);
+            r->header_error = ERR_INVALID_PROG_HEADER;
+            return;
+        }
+
+        if (r->type.class == BITS64) {
+            if (prog.p64.p_type == PT_LOAD) {
+                small_vec_u64_append(&pt_load_offset, prog.p64.p_offset);
+                small_vec_u64_append(&pt_load_vaddr, prog.p64.p_vaddr);
+            } else if (prog.p64.p_type == PT_DYNAMIC) {
+                p_offset = prog.p64.p_offset;
+            }
+        } else {
+            if (prog.p32.p_type == PT_LOAD) {
+                small_vec_u64_append(&pt_load_offset, prog.p32.p_offset);
+                small_vec_u64_append(&pt_load_vaddr, prog.p32.p_vaddr);
+            } else if (prog.p32.p_type == PT_DYNAMIC) {
+                p_offset = prog.p32.p_offset;
+            }
+        }
+    }
+
+    // No dynamic section?
+    if (p_offset == MAX_OFFSET_T) {
+        small_vec_u64_free(&pt_load_offset);
+        small_vec_u64_free(&pt_load_vaddr);
+        return;
+    }
+
+    r->has_dynamic = 1;
+
+    // I guess you always have to load at least a string
+    // table, so if there are not PT_LOAD sections, then
+    // it is an error.
+    if (pt_load_offset.n == 0) {
+        small_vec_u64_free(&pt_load_offset);
+        small_vec_u64_free(&pt_load_vaddr);
+        r->dynamic_error = ERR_NO_PT_LOAD;
+        return;
+    }
+
+    // Go to the dynamic section
+    if (p_offset > f->size) {
+        small_vec_u64_free(&pt_load_offset);
+        small_vec_u64_free(&pt_load_vaddr);
+        r->dynamic_error = ERR_INVALID_DYNAMIC_SECTION;
+        return;
+    }
+
+    uint64_t strtab = MAX_OFFSET_T;
+    uint64_t strsz = MAX_OFFSET_T;
+    uint64_t rpath = MAX_OFFSET_T;
+    uint64_t runpath = MAX_OFFSET_T;
+    uint64_t soname = MAX_OFFSET_T;
+
+    // Offsets in strtab
+    struct small_vec_u64_t needed;
+    small_vec_u64_init(&needed);
+
+    size_t dyn_size = r->type.class == BITS64 ? sizeof(struct dyn_64_t)
+                                              : sizeof(struct dyn_32_t);
+    for (uint64_t dyn_offset = p_offset;; dyn_offset += dyn_size) {
+        uint64_t d_tag;
+        uint64_t d_val;
+
+        if (r->type.class == BITS64) {
+            struct dyn_64_t dyn;
+            if (!elf_file_copy(f, dyn_offset, &dyn, dyn_size)) {
+                small_vec_u64_free(&pt_load_offset);
+                small_vec_u64_free(&pt_load_vaddr);
+                small_vec_u64_free(&needed);
+                r->dynamic_error = ERR_INVALID_DYNAMIC_ARRAY_ENTRY;
+                return;
+            }
+            d_tag = dyn.d_tag;
+            d_val = dyn.d_val;
+
+        } else {
+            struct dyn_32_t dyn;
+            if (!elf_file_copy(f, dyn_offset, &dyn, dyn_size)) {
+                small_vec_u64_free(&pt_load_offset);
+                small_vec_u64_free(&pt_load_vaddr);
+                small_vec_u64_free(&needed);
+                r->dynamic_error = ERR_INVALID_DYNAMIC_ARRAY_ENTRY;
+                return;
+            }
+            d_tag = dyn.d_tag;
+            d_val = dyn.d_val;
+        }
+
+        if (d_tag == DT_NULL)
+            break;
+
+        // Store strtab / rpath / runpath / needed / soname info.
+        switch (d_tag) {
+        case DT_STRTAB:
+            strtab = d_val;
+            break;
+        case DT_STRSZ:
+            strsz = d_val;
+            break;
+        case DT_RPATH:
+            rpath = d_val;
+            break;
+        case DT_RUNPATH:
+            runpath = d_val;
+            break;
+        case DT_NEEDED:
+            small_vec_u64_append(&needed, d_val);
+            break;
+        case DT_SONAME:
+            soname = d_val;
+            break;
+        case DT_FLAGS_1:
+            r->dt_flags_1 |= d_val;
+            break;
+        }
+    }
+
+    if (strtab == MAX_OFFSET_T) {
+        small_vec_u64_free(&pt_load_offset);
+        small_vec_u64_free(&pt_load_vaddr);
+        small_vec_u64_free(&needed);
+        r->dynamic_error = ERR_NO_STRTAB;
+        return;
+    }
+
+    // Let's verify just to be sure that the offsets are
+    // ordered.
+    if (!is_ascending_order(pt_load_vaddr.p, pt_load_vaddr.n)) {
+        small_vec_u64_free(&pt_load_vaddr);
+        small_vec_u64_free(&pt_load_offset);
+        small_vec_u64_free(&needed);
+        r->dynamic_error = ERR_VADDRS_NOT_ORDERED;
+        return;
+    }
+
+    // Find the file offset corresponding to the strtab virtual address
+    uint64_t strtab_offset =
+        vaddr_to_offset(&pt_load_vaddr, &pt_load_offset, strtab);
+
+    small_vec_u64_free(&pt_load_vaddr);
+    small_vec_u64_free(&pt_load_offset);
+
+    // Validate the strings we need in the order recurse() used to read them,
+    // and figure out how much space they take.
+    size_t strtab_size = 0;
+
+    char const *soname_p = NULL;
+    if (soname != MAX_OFFSET_T) {
+        soname_p = elf_file_string(f, strtab_offset, strsz, soname);
+        if (soname_p == NULL) {
+            small_vec_u64_free(&needed);
+            r->dynamic_error = ERR_INVALID_SONAME;
+            return;
+        }
+        strtab_size += strlen(soname_p) + 1;
+    }
+
+    char const *rpath_p = NULL;
+    if (rpath != MAX_OFFSET_T) {
+        rpath_p = elf_file_string(f, strtab_offset, strsz, rpath);
+        if (rpath_p == NULL)
+            r->needed_error = ERR_INVALID_RPATH;
+        else
+            strtab_size += strlen(rpath_p) + 1;
+    }
+
+    char const *runpath_p = NULL;
+    if (runpath != MAX_OFFSET_T && !r->needed_error) {
+        runpath_p = elf_file_string(f, strtab_offset, strsz, runpath);
+        if (runpath_p == NULL)
+            r->needed_error = ERR_INVALID_RUNPATH;
+        else
+            strtab_size += strlen(runpath_p) + 1;
+    }
+
+    for (size_t i = 0; i < needed.n && !r->needed_error; ++i) {
+        char const *needed_p =
+            elf_file_string(f, strtab_offset, strsz, needed.p[i]);
+        if (needed_p == NULL)
+            r->needed_error = ERR_INVALID_NEEDED;
+        else
+            strtab_size += strlen(needed_p) + 1;
+    }
+
+    // Copy them over into a compact string table of our own.
+    char *record_strtab = arena_alloc(a, strtab_size);
+    size_t n = 0;
+    r->strtab = record_strtab;
+    r->soname = elf_record_store(record_strtab, &n, soname_p);
+
+    if (r->needed_error) {
+        r->strtab_size = n;
+        small_vec_u64_free(&needed);
+        return;
+    }
+
+    r->rpath = elf_record_store(record_strtab, &n, rpath_p);
+    r->runpath = elf_record_store(record_strtab, &n, runpath_p);
+
+    r->num_needed = needed.n;
+    r->needed = arena_alloc(a, needed.n * sizeof(uint64_t));
+    for (size_t i = 0; i < needed.n; ++i) {
+        char const *needed_p =
+            elf_file_string(f, strtab_offset, strsz, needed.p[i]);
+        r->needed[i] = elf_record_store(record_strtab, &n, needed_p);
+    }
+    r->strtab_size = n;
+
+    small_vec_u64_free(&needed);
+}
+
+static inline uint16_t load_u16(unsigned char const *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t load_u32(unsigned char const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load_u64(unsigned char const *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#ifndef LIBTREE_LIBRARY
+// The `n` bytes at `offset` of the mapped file, or NULL when they are not all
+// inside it.
+static unsigned char const *elf_symbols_at(struct elf_symbols_t const *t,
+                                           uint64_t offset, uint64_t n) {
+    if (offset > t->file.size || n > t->file.size - offset)
+        return NULL;
+    return t->file.data + offset;
+}
+
+// The string at `index` of the dynamic string table, or NULL.
+static char const *elf_symbols_string(struct elf_symbols_t const *t,
+                                      uint64_t index) {
+    if (index >= t->strtab_size)
+        return NULL;
+    char const *str = t->strtab + index;
+    if (memchr(str, '\0', t->strtab_size - index) == NULL)
+        return NULL;
+    return str;
+}
+
+// Read the names of the versions that the file defines, and those it needs
+// from its libraries.
+static int elf_symbols_parse_versions(struct elf_symbols_t *t, uint64_t verdef,
+                                      uint64_t verdefnum, uint64_t verneed,
+                                      uint64_t verneednum) {
+    if (verdefnum > t->file.size / sizeof(struct verdef_t) ||
+        verneednum > t->file.size / sizeof(struct verneed_t))
+        return 1;
+
+    uint64_t offset = verdef;
+    for (uint64_t i = 0; verdef != MAX_OFFSET_T && i < verdefnum; ++i) {
+        struct verdef_t vd;
+        struct verdaux_t vda;
+        if (!elf_file_copy(&t->file, offset, &vd, sizeof(vd)) ||
+            !elf_file_copy(&t->file, offset + vd.vd_aux, &vda, sizeof(vda)))
+            return 1;
+        char const *name = elf_symbols_string(t, vda.vda_name);
+        if (name == NULL)
+            return 1;
+        size_t index = vd.vd_ndx & ~VERSYM_HIDDEN;
+        if (index >= t->num_defined) {
+            t->defined = realloc(t->defined, (index + 1) * sizeof(char *));
+            if (t->defined == NULL)
+                exit(1);
+            memset(t->defined + t->num_defined, 0,
+                   (index + 1 - t->num_defined) * sizeof(char *));
+            t->num_defined = index + 1;
+        }
+        t->defined[index] = name;
+        if (vd.vd_next == 0)
+            break;
+        offset += vd.vd_next;
+    }
+
+    size_t capacity = 0;
+    offset = verneed;
+    for (uint64_t i = 0; verneed != MAX_OFFSET_T && i < verneednum; ++i) {
+        struct verneed_t vn;
+        if (!elf_file_copy(&t->file, offset, &vn, sizeof(vn)))
+            return 1;
+        char const *file = elf_symbols_string(t, vn.vn_file);
+        if (file == NULL)
+            return 1;
+        uint64_t aux = offset + vn.vn_aux;
+        for (uint16_t j = 0; j < vn.vn_cnt; ++j) {
+            struct vernaux_t vna;
+            if (!elf_file_copy(&t->file, aux, &vna, sizeof(vna)))
+                return 1;
+            char const *name = elf_symbols_string(t, vna.vna_name);
+            if (name == NULL)
+                return 1;
+            if (t->num_needed == capacity) {
+                capacity = capacity == 0 ? 8 : 2 * capacity;
+                t->needed = realloc(t->needed, capacity *
+                                                   sizeof(struct version_need_t));
+                if (t->needed == NULL)
+                    exit(1);
+            }
+            struct version_need_t *need = &t->needed[t->num_needed++];
+            need->file = file;
+            need->name = name;
+            need->index = vna.vna_other & ~VERSYM_HIDDEN;
+            need->flags = vna.vna_flags;
+            if (vna.vna_next == 0)
+                break;
+            aux += vna.vna_next;
+        }
+        if (vn.vn_next == 0)
+            break;
+        offset += vn.vn_next;
+    }
+
+    return 0;
+}
+
+// Locate the symbol tables in the mapped file the way elf_record_parse()
+// locates the string table. Returns 1 when they can't be used.
+static int elf_symbols_parse(struct elf_symbols_t *t) {
+    struct elf_file_t *f = &t->file;
+
+    uint64_t e_phoff;
+    uint64_t e_phnum;
+    if (t->class == BITS64) {
+        struct header_64_t h;
+        if (!elf_file_copy(f, 16, &h, sizeof(h)))
+            return 1;
+        e_phoff = h.e_phoff;
+        e_phnum = h.e_phnum;
+    } else {
+        struct header_32_t h;
+        if (!elf_file_copy(f, 16, &h, sizeof(h)))
+            return 1;
+        e_phoff = h.e_phoff;
+        e_phnum = h.e_phnum;
+    }
+
+    struct small_vec_u64_t pt_load_offset;
+    struct small_vec_u64_t pt_load_vaddr;
+    small_vec_u64_init(&pt_load_offset);
+    small_vec_u64_init(&pt_load_vaddr);
+
+    uint64_t p_offset = MAX_OFFSET_T;
+    uint64_t interp = MAX_OFFSET_T;
+    uint64_t interp_size = 0;
+    size_t prog_size = t->class == BITS64 ? sizeof(struct prog_64_t)
+                                          : sizeof(struct prog_32_t);
+    for (uint64_t i = 0; i < e_phnum; ++i) {
+        union {
+            struct prog_64_t p64;
+            struct prog_32_t p32;
+        } prog;
+        if (!elf_file_copy(f, e_phoff + i * prog_size, &prog, prog_size)) {
+            p_offset = MAX_OFFSET_T;
+            break;
+        }
+        uint32_t p_type =
+            t->class == BITS64 ? prog.p64.p_type : prog.p32.p_type;
+        if (p_type == PT_LOAD && t->class == BITS64) {
+            small_vec_u64_append(&pt_load_offset, prog.p64.p_offset);
+            small_vec_u64_append(&pt_load_vaddr, prog.p64.p_vaddr);
+            t->cost.file_size += prog.p64.p_filesz;
+            t->cost.mem_size += prog.p64.p_memsz;
+        } else if (p_type == PT_LOAD) {
+            small_vec_u64_append(&pt_load_offset, prog.p32.p_offset);
+            small_vec_u64_append(&pt_load_vaddr, prog.p32.p_vaddr);
+            t->cost.file_size += prog.p32.p_filesz;
+            t->cost.mem_size += prog.p32.p_memsz;
+        } else if (p_type == PT_TLS) {
+            t->cost.tls_size =
+                t->class == BITS64 ? prog.p64.p_memsz : prog.p32.p_memsz;
+        } else if (p_type == PT_DYNAMIC) {
+            p_offset =
+                t->class == BITS64 ? prog.p64.p_offset : prog.p32.p_offset;
+        } else if (p_type == PT_INTERP) {
+            interp = t->class == BITS64 ? prog.p64.p_offset : prog.p32.p_offset;
+            interp_size =
+                t->class == BITS64 ? prog.p64.p_filesz : prog.p32.p_filesz;
+        }
+    }
+
+    if (interp != MAX_OFFSET_T) {
+        char const *path = (char const *)elf_symbols_at(t, interp, interp_size);
+        if (path != NULL && memchr(path, '\0', interp_size) != NULL)
+            t->interp = path;
+    }
+
+    if (p_offset == MAX_OFFSET_T || pt_load_vaddr.n == 0 ||
+        !is_ascending_order(pt_load_vaddr.p, pt_load_vaddr.n)) {
+        small_vec_u64_free(&pt_load_offset);
+        small_vec_u64_free(&pt_load_vaddr);
+        return 1;
+    }
+
+    // Virtual addresses of the tables, and their sizes.
+    uint64_t symtab = MAX_OFFSET_T;
+    uint64_t syment = 0;
+    uint64_t strtab = MAX_OFFSET_T;
+    uint64_t strsz = 0;
+    uint64_t gnu_hash = MAX_OFFSET_T;
+    uint64_t hash = MAX_OFFSET_T;
+    uint64_t versym = MAX_OFFSET_T;
+    uint64_t verdef = MAX_OFFSET_T;
+    uint64_t verdefnum = 0;
+    uint64_t verneed = MAX_OFFSET_T;
+    uint64_t verneednum = 0;
+    // Sizes of the relocation tables and their entries.
+    uint64_t relasz = 0;
+    uint64_t relaent = 0;
+    uint64_t relsz = 0;
+    uint64_t relent = 0;
+    uint64_t pltrelsz = 0;
+    uint64_t pltrel = DT_RELA;
+    uint64_t relr = MAX_OFFSET_T;
+    uint64_t relrsz = 0;
+    uint64_t relrent = 0;
+
+    size_t dyn_size = t->class == BITS64 ? sizeof(struct dyn_64_t)
+                                         : sizeof(struct dyn_32_t);
+    for (uint64_t dyn_offset = p_offset;; dyn_offset += dyn_size) {
+        uint64_t d_tag;
+        uint64_t d_val;
+        if (t->class == BITS64) {
+            struct dyn_64_t dyn;
+            if (!elf_file_copy(f, dyn_offset, &dyn, dyn_size))
+                break;
+            d_tag = dyn.d_tag;
+            d_val = dyn.d_val;
+        } else {
+            struct dyn_32_t dyn;
+            if (!elf_file_copy(f, dyn_offset, &dyn, dyn_size))
+                break;
+            d_tag = dyn.d_tag;
+            d_val = dyn.d_val;
+        }
+
+        if (d_tag == DT_NULL)
+            break;
+
+        switch (d_tag) {
+        case DT_SYMTAB:
+            symtab = d_val;
+            break;
+        case DT_SYMENT:
+            syment = d_val;
+            break;
+        case DT_STRTAB:
+            strtab = d_val;
+            break;
+        case DT_STRSZ:
+            strsz = d_val;
+            break;
+        case DT_GNU_HASH:
+            gnu_hash = d_val;
+            break;
+        case DT_HASH:
+            hash = d_val;
+            break;
+        case DT_VERSYM:
+            versym = d_val;
+            break;
+        case DT_VERDEF:
+            verdef = d_val;
+            break;
+        case DT_VERDEFNUM:
+            verdefnum = d_val;
+            break;
+        case DT_VERNEED:
+            verneed = d_val;
+            break;
+        case DT_VERNEEDNUM:
+            verneednum = d_val;
+            break;
+        case DT_RELASZ:
+            relasz = d_val;
+            break;
+        case DT_RELAENT:
+            relaent = d_val;
+            break;
+        case DT_RELSZ:
+            relsz = d_val;
+            break;
+        case DT_RELENT:
+            relent = d_val;
+            break;
+        case DT_PLTRELSZ:
+            pltrelsz = d_val;
+            break;
+        case DT_PLTREL:
+            pltrel = d_val;
+            break;
+        case DT_RELACOUNT:
+        case DT_RELCOUNT:
+            t->cost.relative += d_val;
+            break;
+        case DT_RELR:
+            relr = d_val;
+            break;
+        case DT_RELRSZ:
+            relrsz = d_val;
+            break;
+        case DT_RELRENT:
+            relrent = d_val;
+            break;
+        case DT_BIND_NOW:
+            t->cost.bind_now = 1;
+            break;
+        case DT_FLAGS:
+            if (d_val & DF_BIND_NOW)
+                t->cost.bind_now = 1;
+            break;
+        case DT_FLAGS_1:
+            if (d_val & DT_1_NOW)
+                t->cost.bind_now = 1;
+            break;
+        }
+    }
+
+    // Translate the virtual addresses to file offsets.
+    uint64_t *addrs[] = {&symtab, &strtab, &gnu_hash, &hash,
+                         &versym, &verdef, &verneed, &relr};
+    for (size_t i = 0; i < sizeof(addrs) / sizeof(addrs[0]); ++i)
+        if (*addrs[i] != MAX_OFFSET_T)
+            *addrs[i] = vaddr_to_offset(&pt_load_vaddr, &pt_load_offset,
+                                        *addrs[i]);
+    small_vec_u64_free(&pt_load_offset);
+    small_vec_u64_free(&pt_load_vaddr);
+
+    // DT_RELAENT and DT_RELENT may be missing when the PLT is the only
+    // table, entries have their standard size then.
+    uint64_t entry = t->class == BITS64 ? 8 : 4;
+    if (relaent == 0)
+        relaent = 3 * entry;
+    if (relent == 0)
+        relent = 2 * entry;
+    t->cost.relocs = relasz / relaent + relsz / relent;
+    t->cost.plt_relocs = pltrelsz / (pltrel == DT_REL ? relent : relaent);
+    t->cost.has_gnu_hash = gnu_hash != MAX_OFFSET_T;
+    t->cost.has_hash = hash != MAX_OFFSET_T;
+
+    // DT_RELR packs relative relocations: an even entry is the address of
+    // one, an odd entry is a bitmap of the words after the previous ones.
+    unsigned char const *packed =
+        relr == MAX_OFFSET_T || (relrent != 0 && relrent != entry)
+            ? NULL
+            : elf_symbols_at(t, relr, relrsz);
+    for (uint64_t i = 0; packed != NULL && i + entry <= relrsz; i += entry) {
+        uint64_t e = entry == 8 ? load_u64(packed + i) : load_u32(packed + i);
+        uint64_t n = 1;
+        if (e & 1)
+            for (n = 0, e >>= 1; e != 0; e &= e - 1)
+                ++n;
+        t->cost.relocs += n;
+        t->cost.relative += n;
+    }
+
+    t->sym_size = t->class == BITS64 ? sizeof(struct sym_64_t)
+                                     : sizeof(struct sym_32_t);
+    if (symtab == MAX_OFFSET_T || strtab == MAX_OFFSET_T ||
+        (syment != 0 && syment != t->sym_size) ||
+        (gnu_hash == MAX_OFFSET_T && hash == MAX_OFFSET_T))
+        return 1;
+
+    t->strtab = (char const *)elf_symbols_at(t, strtab, strsz);
+    t->strtab_size = strsz;
+    if (t->strtab == NULL)
+        return 1;
+
+    if (gnu_hash != MAX_OFFSET_T) {
+        unsigned char const *h = elf_symbols_at(t, gnu_hash, 16);
+        if (h == NULL)
+            return 1;
+        t->gnu_nbuckets = load_u32(h);
+        t->gnu_symoffset = load_u32(h + 4);
+        t->bloom_size = load_u32(h + 8);
+        t->bloom_shift = load_u32(h + 12);
+        uint64_t word = t->class == BITS64 ? 8 : 4;
+        uint64_t bloom = gnu_hash + 16;
+        uint64_t buckets = bloom + t->bloom_size * word;
+        uint64_t chains = buckets + 4 * (uint64_t)t->gnu_nbuckets;
+        t->bloom = elf_symbols_at(t, bloom, t->bloom_size * word);
+        t->gnu_buckets =
+            elf_symbols_at(t, buckets, 4 * (uint64_t)t->gnu_nbuckets);
+        if (t->gnu_nbuckets == 0 || t->bloom_size == 0 ||
+            t->bloom_shift >= 32 || t->bloom == NULL || t->gnu_buckets == NULL)
+            return 1;
+
+        // The table has no size, every chain ends with a hash whose lowest
+        // bit is set, and the last chain ends with the last symbol.
+        t->gnu_num_syms = t->gnu_symoffset;
+        for (uint32_t b = 0; b < t->gnu_nbuckets; ++b) {
+            uint64_t i = load_u32(t->gnu_buckets + 4 * (uint64_t)b);
+            if (i < t->gnu_symoffset)
+                continue;
+            for (;; ++i) {
+                unsigned char const *c =
+                    elf_symbols_at(t, chains + 4 * (i - t->gnu_symoffset), 4);
+                if (c == NULL)
+                    return 1;
+                if (i + 1 > t->gnu_num_syms)
+                    t->gnu_num_syms = i + 1;
+                if (load_u32(c) & 1)
+                    break;
+            }
+        }
+        t->gnu_chains = t->file.data + chains;
+        t->num_syms = t->gnu_num_syms;
+    }
+
+    if (hash != MAX_OFFSET_T) {
+        unsigned char const *h = elf_symbols_at(t, hash, 8);
+        if (h == NULL)
+            return 1;
+        t->nbuckets = load_u32(h);
+        uint32_t nchain = load_u32(h + 4);
+        t->buckets = elf_symbols_at(t, hash + 8, 4 * (uint64_t)t->nbuckets);
+        t->chains = elf_symbols_at(t, hash + 8 + 4 * (uint64_t)t->nbuckets,
+                                   4 * (uint64_t)nchain);
+        if (t->buckets == NULL || t->chains == NULL)
+            return 1;
+        // The number of chain entries is the number of symbols.
+        if (t->nbuckets == 0)
+            t->buckets = NULL;
+        t->num_syms = nchain;
+    }
+
+    t->symtab = elf_symbols_at(t, symtab, t->num_syms * t->sym_size);
+    if (t->symtab == NULL)
+        return 1;
+
+    if (versym != MAX_OFFSET_T) {
+        t->versym = elf_symbols_at(t, versym, 2 * t->num_syms);
+        if (t->versym == NULL)
+            return 1;
+    }
+
+    return elf_symbols_parse_versions(t, verdef, verdefnum, verneed,
+                                      verneednum);
+}
+
+// Map the file at `path` of the given class and locate its symbol tables.
+static struct elf_symbols_t *elf_symbols_load(char const *path, uint8_t class,
+                                              struct stats_t *stats) {
+    struct elf_symbols_t *t = malloc(sizeof(struct elf_symbols_t));
+    if (t == NULL)
+        exit(1);
+    memset(t, 0, sizeof(*t));
+    t->class = class;
+
+    struct stat finfo;
+    ++stats->stat_calls;
+    if (stat(path, &finfo) != 0 ||
+        elf_file_open(&t->file, path, &finfo, 1, stats) != 0)
+        t->invalid = 1;
+    else
+        t->invalid = elf_symbols_parse(t);
+    return t;
+}
+#endif
+
+static void elf_symbols_free(struct elf_symbols_t *t) {
+    elf_file_close(&t->file);
+    free(t->defined);
+    free(t->needed);
+    free(t);
+}
+
+#ifndef LIBTREE_LIBRARY
+// The hash function of DT_GNU_HASH.
+static uint32_t gnu_hash(char const *name) {
+    uint32_t h = 5381;
+    for (unsigned char const *p = (unsigned char const *)name; *p != '\0'; ++p)
+        h = h * 33 + *p;
+    return h;
+}
+
+// The hash function of DT_HASH.
+static uint32_t sysv_hash(char const *name) {
+    uint32_t h = 0;
+    for (unsigned char const *p = (unsigned char const *)name; *p != '\0';
+         ++p) {
+        h = (h << 4) + *p;
+        uint32_t g = h & 0xf0000000;
+        if (g != 0)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+// Symbol `i` of the dynamic symbol table, in the layout of 64 bits files.
+static void elf_symbols_sym(struct elf_symbols_t const *t, size_t i,
+                            struct sym_64_t *sym) {
+    unsigned char const *p = t->symtab + i * t->sym_size;
+    if (t->class == BITS64) {
+        memcpy(sym, p, sizeof(*sym));
+        return;
+    }
+    struct sym_32_t sym32;
+    memcpy(&sym32, p, sizeof(sym32));
+    sym->st_name = sym32.st_name;
+    sym->st_info = sym32.st_info;
+    sym->st_other = sym32.st_other;
+    sym->st_shndx = sym32.st_shndx;
+    sym->st_value = sym32.st_value;
+    sym->st_size = sym32.st_size;
+}
+
+// Whether symbol `i` is a definition that a reference to `name` binds to, where
+// `version` is the version of the reference or NULL. Follows what the dynamic
+// loader accepts, except that an unversioned reference binds to any version
+// that is not hidden, rather than only to the one when there is just one.
+static int elf_symbols_defines(struct elf_symbols_t const *t, size_t i,
+                               char const *name, char const *version) {
+    if (i >= t->num_syms)
+        return 0;
+    struct sym_64_t sym;
+    elf_symbols_sym(t, i, &sym);
+    int bind = sym.st_info >> 4;
+    int type = sym.st_info & 0xf;
+    if (sym.st_shndx == SHN_UNDEF ||
+        (sym.st_value == 0 && sym.st_shndx != SHN_ABS && type != STT_TLS))
+        return 0;
+    if (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE)
+        return 0;
+    // No sections and files, or types we don't know.
+    if (type == 3 || type == 4 || (type > STT_TLS && type != STT_GNU_IFUNC))
+        return 0;
+    char const *str = elf_symbols_string(t, sym.st_name);
+    if (str == NULL || strcmp(str, name) != 0)
+        return 0;
+
+    if (t->versym == NULL)
+        return 1;
+    uint16_t v = load_u16(t->versym + 2 * i);
+    size_t index = v & ~VERSYM_HIDDEN;
+    int hidden = (v & VERSYM_HIDDEN) != 0;
+
+    // Local, global or the default version; or not hidden.
+    if (version == NULL)
+        return index < 3 || !hidden;
+
+    if (index < t->num_defined && t->defined[index] != NULL &&
+        strcmp(t->defined[index], version) == 0)
+        return 1;
+
+    // An unversioned definition satisfies a versioned reference.
+    return index < 2 && !hidden;
+}
+
+// Whether the file defines `name` for a reference with `version`, looked up
+// through its GNU hash table and Bloom filter, or else its SysV hash table.
+static int elf_symbols_find(struct elf_symbols_t const *t, char const *name,
+                            uint32_t gnu_h, uint32_t sysv_h,
+                            char const *version) {
+    if (t->invalid)
+        return 0;
+
+    if (t->gnu_buckets != NULL) {
+        // Two bits of the hash must be set in a word of the filter, which
+        // rules out most files without looking at their symbols.
+        uint32_t bits = t->class == BITS64 ? 64 : 32;
+        uint64_t word =
+            bits == 64
+                ? load_u64(t->bloom + 8 * (uint64_t)((gnu_h / 64) %
+                                                      t->bloom_size))
+                : load_u32(t->bloom + 4 * (uint64_t)((gnu_h / 32) %
+                                                      t->bloom_size));
+        uint64_t mask = ((uint64_t)1 << (gnu_h % bits)) |
+                        ((uint64_t)1 << ((gnu_h >> t->bloom_shift) % bits));
+        if ((word & mask) != mask)
+            return 0;
+
+        uint64_t i = load_u32(t->gnu_buckets +
+                              4 * (uint64_t)(gnu_h % t->gnu_nbuckets));
+        if (i < t->gnu_symoffset)
+            return 0;
+        for (; i < t->gnu_num_syms; ++i) {
+            uint32_t h = load_u32(t->gnu_chains + 4 * (i - t->gnu_symoffset));
+            if ((h | 1) == (gnu_h | 1) &&
+                elf_symbols_defines(t, i, name, version))
+                return 1;
+            if (h & 1)
+                break;
+        }
+        return 0;
+    }
+
+    if (t->buckets == NULL)
+        return 0;
+    // Chains can't be longer than the number of symbols, unless they loop.
+    uint64_t i = load_u32(t->buckets + 4 * (uint64_t)(sysv_h % t->nbuckets));
+    for (size_t n = 0; i != 0 && i < t->num_syms && n < t->num_syms; ++n) {
+        if (elf_symbols_defines(t, i, name, version))
+            return 1;
+        i = load_u32(t->chains + 4 * i);
+    }
+    return 0;
+}
+#endif
+
+static inline size_t elf_cache_hash(dev_t dev, ino_t ino) {
+    return visited_file_hash(dev, ino);
+}
+
+static void elf_cache_init(struct elf_cache_t *c) {
+    c->n = 0;
+    c->capacity = 256;
+    c->arr = calloc(c->capacity, sizeof(struct elf_record_t *));
+    c->arena.head = NULL;
+    c->lock = NULL;
+    c->parsed = NULL;
+    c->disk = NULL;
+    c->low_metadata = 0;
+    c->num_paths = 0;
+    c->paths_capacity = 64;
+    c->paths = calloc(c->paths_capacity, sizeof(struct path_memo_t));
+    c->num_sonames = 0;
+    c->sonames_capacity = 256;
+    c->sonames = calloc(c->sonames_capacity, sizeof(struct soname_t *));
+    c->num_memo = 0;
+    c->memo_capacity = 64;
+    c->memo = calloc(c->memo_capacity, sizeof(struct search_memo_t *));
+    if (c->arr == NULL || c->paths == NULL || c->sonames == NULL ||
+        c->memo == NULL)
+        exit(1);
+}
+
+static void elf_cache_free(struct elf_cache_t *c) {
+    for (size_t i = 0; i < c->capacity; ++i)
+        if (c->arr[i] != NULL && c->arr[i]->symbols != NULL)
+            elf_symbols_free(c->arr[i]->symbols);
+    free(c->arr);
+    free(c->paths);
+    free(c->sonames);
+    free(c->memo);
+    arena_free(&c->arena);
+}
+
+static size_t elf_cache_slot(struct elf_cache_t const *c, dev_t dev,
+                             ino_t ino) {
+    size_t mask = c->capacity - 1;
+    size_t i = elf_cache_hash(dev, ino) & mask;
+    while (c->arr[i] != NULL) {
+        struct elf_record_t const *r = c->arr[i];
+        if (r->st_dev == dev && r->st_ino == ino)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void elf_cache_grow(struct elf_cache_t *c) {
+    struct elf_record_t **old = c->arr;
+    size_t old_capacity = c->capacity;
+    c->capacity *= 2;
+    c->arr = calloc(c->capacity, sizeof(struct elf_record_t *));
+    if (c->arr == NULL)
+        exit(1);
+    for (size_t j = 0; j < old_capacity; ++j) {
+        if (old[j] == NULL)
+            continue;
+        c->arr[elf_cache_slot(c, old[j]->st_dev, old[j]->st_ino)] = old[j];
+    }
+    free(old);
+}
+
+static size_t path_memo_slot(struct elf_cache_t const *c, char const *path,
+                             uint64_t hash) {
+    size_t mask = c->paths_capacity - 1;
+    size_t i = hash & mask;
+    while (c->paths[i].path != NULL &&
+           (c->paths[i].hash != hash || strcmp(c->paths[i].path, path) != 0))
+        i = (i + 1) & mask;
+    return i;
+}
+
+// Remember the record of `path`, must be called with the cache locked.
+static void path_memo_add(struct elf_cache_t *c, struct arena_t *a,
+                          char const *path, uint64_t hash,
+                          struct elf_record_t *record) {
+    size_t i = path_memo_slot(c, path, hash);
+    if (c->paths[i].path != NULL)
+        return;
+
+    // Keep the load factor below 1/2.
+    if (2 * (c->num_paths + 1) > c->paths_capacity) {
+        struct path_memo_t *old = c->paths;
+        size_t old_capacity = c->paths_capacity;
+        c->paths_capacity *= 2;
+        c->paths = calloc(c->paths_capacity, sizeof(struct path_memo_t));
+        if (c->paths == NULL)
+            exit(1);
+        for (size_t j = 0; j < old_capacity; ++j)
+            if (old[j].path != NULL)
+                c->paths[path_memo_slot(c, old[j].path, old[j].hash)] = old[j];
+        free(old);
+        i = path_memo_slot(c, path, hash);
+    }
+
+    c->paths[i].path = arena_copy(a, path, strlen(path) + 1);
+    c->paths[i].hash = hash;
+    c->paths[i].record = record;
+    ++c->num_paths;
+}
+
+// Get the parsed ELF file, parsing it only the first time we see it. New
+// records are allocated in `a`.
+static int elf_cache_get(struct elf_cache_t *c, struct arena_t *a,
+                         struct file_ref_t const *ref,
+                         struct stats_t *stats,
+                         struct elf_record_t **record) {
+    char const *path = ref->path;
+    uint64_t path_hash = hash_str(path, strlen(path));
+    cache_lock(c->lock);
+    size_t j = path_memo_slot(c, path, path_hash);
+    struct elf_record_t *r = c->paths[j].record;
+    while (r != NULL && r->pending)
+        pthread_cond_wait(c->parsed, c->lock);
+    cache_unlock(c->lock);
+    if (r != NULL) {
+        if (ref->fd != -1)
+            close(ref->fd);
+        *record = r;
+        return 0;
+    }
+
+    // Otherwise tell whether we've seen it from the open file, so that the
+    // record describes the file that is parsed.
+    struct stat finfo;
+    int fd = ref->fd;
+    if (fd == -1) {
+        ++stats->opens;
+        fd = openat(ref->dirfd, ref->name, O_RDONLY);
+        if (fd == -1)
+            return ERR_COULD_NOT_OPEN_FILE;
+    }
+    ++stats->stat_calls;
+    if (fstat(fd, &finfo) != 0) {
+        close(fd);
+        return ERR_COULD_NOT_OPEN_FILE;
+    }
+
+    cache_lock(c->lock);
+    size_t i = elf_cache_slot(c, finfo.st_dev, finfo.st_ino);
+    if (c->arr[i] != NULL) {
+        // Wait for the thread that is parsing it.
+        r = c->arr[i];
+        while (r->pending)
+            pthread_cond_wait(c->parsed, c->lock);
+        path_memo_add(c, a, path, path_hash, r);
+        *record = r;
+        cache_unlock(c->lock);
+        close(fd);
+        return 0;
+    }
+
+    // Claim the file, so that it is parsed only once.
+    struct elf_record_t *pending = arena_alloc(a, sizeof(*pending));
+    memset(pending, 0, sizeof(*pending));
+    pending->st_dev = finfo.st_dev;
+    pending->st_ino = finfo.st_ino;
+    pending->pending = 1;
+
+    // Keep the load factor below 1/2.
+    if (2 * (c->n + 1) > c->capacity) {
+        elf_cache_grow(c);
+        i = elf_cache_slot(c, finfo.st_dev, finfo.st_ino);
+    }
+    c->arr[i] = pending;
+    ++c->n;
+    path_memo_add(c, a, path, path_hash, pending);
+    cache_unlock(c->lock);
+
+    // Take the record of a previous run, or parse the file, without holding
+    // the lock.
+    r = c->disk == NULL ? NULL : disk_cache_find_record(c->disk, &finfo, a);
+
+    if (r != NULL)
+        close(fd);
+
+    if (r == NULL) {
+        r = arena_alloc(a, sizeof(*r));
+        memset(r, 0, sizeof(*r));
+        r->st_dev = finfo.st_dev;
+        r->st_ino = finfo.st_ino;
+        disk_stat_set(&r->st, &finfo);
+
+        // In low metadata mode only what is parsed is read.
+        struct elf_file_t f;
+        f.data = NULL;
+        f.fd = -1;
+        f.pieces = NULL;
+        f.stats = stats;
+        int code = c->low_metadata ? elf_file_open_fd(&f, fd, &finfo, stats)
+                                   : elf_file_load(&f, fd, &finfo, 1);
+        if (code != 0) {
+            r->header_error = code;
+        } else {
+            elf_record_parse(&f, r, a);
+            elf_file_close(&f);
+        }
+        ++stats->parsed;
+    } else {
+        ++stats->from_cache_file;
+    }
+
+    cache_lock(c->lock);
+    *pending = *r;
+    if (c->parsed != NULL)
+        pthread_cond_broadcast(c->parsed);
+    cache_unlock(c->lock);
+
+    *record = pending;
+    return 0;
+}
+
+// Whether `n` bytes at `offset` are inside the cache file.
+static int disk_cache_contains(struct disk_cache_t const *dc, uint64_t offset,
+                               uint64_t n) {
+    return offset % 8 == 0 && offset <= dc->file.size &&
+           n <= dc->file.size - offset;
+}
+
+static void disk_cache_close(struct disk_cache_t *dc) {
+    if (dc->header != NULL)
+        elf_file_close(&dc->file);
+    dc->header = NULL;
+}
+
+// Map the cache file, returns 1 when it does not exist or can't be used.
+static int disk_cache_open(struct disk_cache_t *dc, char const *path) {
+    memset(dc, 0, sizeof(*dc));
+
+    struct stat finfo;
+    if (stat(path, &finfo) != 0 ||
+        elf_file_open(&dc->file, path, &finfo, 0, NULL) != 0)
+        return 1;
+
+    struct disk_header_t const *h = (struct disk_header_t const *)dc->file.data;
+    uint64_t records_size = sizeof(struct disk_record_t);
+    uint64_t dirs_size = sizeof(struct disk_dir_t);
+    if (dc->file.size < sizeof(*h) || dc->file.data[dc->file.size - 1] != '\0' ||
+        memcmp(h->magic, DISK_CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != DISK_CACHE_VERSION ||
+        h->byte_order != DISK_CACHE_BYTE_ORDER || h->size != dc->file.size ||
+        h->records_capacity == 0 ||
+        (h->records_capacity & (h->records_capacity - 1)) != 0 ||
+        h->records_capacity > dc->file.size / records_size ||
+        !disk_cache_contains(dc, h->records,
+                             h->records_capacity * records_size) ||
+        h->dirs_capacity == 0 ||
+        (h->dirs_capacity & (h->dirs_capacity - 1)) != 0 ||
+        h->dirs_capacity > dc->file.size / dirs_size ||
+        !disk_cache_contains(dc, h->dirs, h->dirs_capacity * dirs_size)) {
+        elf_file_close(&dc->file);
+        return 1;
+    }
+
+    dc->header = h;
+    dc->records =
+        (struct disk_record_t const *)(dc->file.data + h->records);
+    dc->dirs = (struct disk_dir_t const *)(dc->file.data + h->dirs);
+    return 0;
+}
+
+// A record as stored in the cache file, or NULL if it is corrupt. Strings
+// point into the mapped file.
+static struct elf_record_t *disk_cache_record(struct disk_cache_t const *dc,
+                                              struct disk_record_t const *e,
+                                              struct arena_t *a) {
+    if (e->strtab_size != 0 &&
+        (!disk_cache_contains(dc, e->strtab, e->strtab_size) ||
+         dc->file.data[e->strtab + e->strtab_size - 1] != '\0'))
+        return NULL;
+    if (e->num_needed > dc->file.size / sizeof(uint64_t) ||
+        !disk_cache_contains(dc, e->needed, e->num_needed * sizeof(uint64_t)))
+        return NULL;
+    uint64_t const *needed = (uint64_t const *)(dc->file.data + e->needed);
+    for (uint64_t i = 0; i < e->num_needed; ++i)
+        if (needed[i] >= e->strtab_size)
+            return NULL;
+    if ((e->soname != MAX_OFFSET_T && e->soname >= e->strtab_size) ||
+        (e->rpath != MAX_OFFSET_T && e->rpath >= e->strtab_size) ||
+        (e->runpath != MAX_OFFSET_T && e->runpath >= e->strtab_size))
+        return NULL;
+
+    struct elf_record_t *r = arena_alloc(a, sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    r->st_dev = e->st.dev;
+    r->st_ino = e->st.ino;
+    r->st = e->st;
+    r->from_disk = 1;
+    r->header_error = e->header_error;
+    r->dynamic_error = e->dynamic_error;
+    r->needed_error = e->needed_error;
+    r->type.class = e->class;
+    r->type.machine = e->machine;
+    r->has_dynamic = e->has_dynamic;
+    r->dt_flags_1 = e->dt_flags_1;
+    r->strtab = e->strtab_size == 0 ? NULL : (char const *)dc->file.data + e->strtab;
+    r->strtab_size = e->strtab_size;
+    r->soname = e->soname;
+    r->rpath = e->rpath;
+    r->runpath = e->runpath;
+    // Never written to.
+    r->needed = (uint64_t *)needed;
+    r->num_needed = e->num_needed;
+    return r;
+}
+
+// The record of the file with `finfo` from a previous run, or NULL if there is
+// none or the file changed since.
+static struct elf_record_t *disk_cache_find_record(struct disk_cache_t const *dc,
+                                                   struct stat const *finfo,
+                                                   struct arena_t *a) {
+    struct disk_stat_t st;
+    disk_stat_set(&st, finfo);
+
+    size_t mask = dc->header->records_capacity - 1;
+    size_t i = visited_file_hash(finfo->st_dev, finfo->st_ino) & mask;
+    for (size_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+        struct disk_record_t const *e = &dc->records[i];
+        if (!e->used)
+            return NULL;
+        if (e->st.dev != st.dev || e->st.ino != st.ino)
+            continue;
+        return disk_stat_equal(&e->st, &st) ? disk_cache_record(dc, e, a)
+                                            : NULL;
+    }
+    return NULL;
+}
+
+// A listing as stored in the cache file, or NULL if it is corrupt.
+static struct dir_listing_t *disk_cache_dir(struct disk_cache_t const *dc,
+                                            struct disk_dir_t const *e,
+                                            struct arena_t *a) {
+    if (e->capacity > dc->file.size / sizeof(uint64_t) ||
+        (e->capacity & (e->capacity - 1)) != 0 ||
+        !disk_cache_contains(dc, e->names, e->capacity * sizeof(uint64_t)) ||
+        e->path >= dc->file.size ||
+        strlen((char const *)dc->file.data + e->path) != e->path_len)
+        return NULL;
+
+    uint64_t const *names = (uint64_t const *)(dc->file.data + e->names);
+    for (uint64_t i = 0; i < e->capacity; ++i)
+        if (names[i] >= dc->file.size)
+            return NULL;
+
+    struct dir_listing_t *d = arena_alloc(a, sizeof(*d));
+    d->path = (char const *)dc->file.data + e->path;
+    d->path_len = e->path_len;
+    d->hash = e->hash;
+    d->listed = 1;
+    d->has_stat = 1;
+    d->st = e->st;
+    d->from_disk = 1;
+    d->fd = -1;
+    d->capacity = e->capacity;
+    d->names = NULL;
+    if (e->capacity != 0) {
+        d->names = arena_alloc(a, e->capacity * sizeof(char const *));
+        for (uint64_t i = 0; i < e->capacity; ++i)
+            d->names[i] = names[i] == 0
+                              ? NULL
+                              : (char const *)dc->file.data + names[i];
+    }
+    return d;
+}
+
+// The listing of directory `path` from a previous run, or NULL if there is
+// none or the directory changed since.
+static struct dir_listing_t *disk_cache_find_dir(struct disk_cache_t const *dc,
+                                                 struct arena_t *a,
+                                                 char const *path,
+                                                 size_t path_len, uint64_t hash,
+                                                 struct stats_t *stats) {
+    size_t mask = dc->header->dirs_capacity - 1;
+    size_t i = hash & mask;
+    for (size_t probes = 0; probes <= mask; ++probes, i = (i + 1) & mask) {
+        struct disk_dir_t const *e = &dc->dirs[i];
+        if (!e->used)
+            return NULL;
+        if (e->hash != hash || e->path_len != path_len ||
+            !disk_cache_contains(dc, e->path, path_len + 1) ||
+            memcmp(dc->file.data + e->path, path, path_len) != 0)
+            continue;
+
+        struct dir_listing_t *d = disk_cache_dir(dc, e, a);
+        if (d == NULL)
+            return NULL;
+
+        // The directory changes when files are added, removed or renamed.
+        struct stat finfo;
+        struct disk_stat_t st;
+        ++stats->stat_calls;
+        if (stat(d->path, &finfo) != 0)
+            return NULL;
+        disk_stat_set(&st, &finfo);
+        return disk_stat_equal(&e->st, &st) ? d : NULL;
+    }
+    return NULL;
+}
+
+// Append `n` bytes to the image of a cache file at the next 8-byte boundary,
+// or `n` zeros when `p` is NULL, and return their offset.
+static uint64_t disk_image_append(struct string_table_t *img, void const *p,
+                                  size_t n) {
+    size_t padding = (8 - img->n % 8) % 8;
+    string_table_maybe_grow(img, padding + n);
+    memset(img->arr + img->n, 0, padding);
+    img->n += padding;
+    uint64_t offset = img->n;
+    if (p == NULL)
+        memset(img->arr + img->n, 0, n);
+    else if (n > 0)
+        memcpy(img->arr + img->n, p, n);
+    img->n += n;
+    return offset;
+}
+
+static void disk_image_add_record(struct string_table_t *img,
+                                  struct disk_header_t const *h,
+                                  struct elf_record_t const *r) {
+    struct disk_record_t e;
+    memset(&e, 0, sizeof(e));
+    e.st = r->st;
+    e.used = 1;
+    e.header_error = r->header_error;
+    e.dynamic_error = r->dynamic_error;
+    e.needed_error = r->needed_error;
+    e.machine = r->type.machine;
+    e.class = r->type.class;
+    e.has_dynamic = r->has_dynamic;
+    e.dt_flags_1 = r->dt_flags_1;
+    e.strtab = disk_image_append(img, r->strtab, r->strtab_size);
+    e.strtab_size = r->strtab_size;
+    e.soname = r->soname;
+    e.rpath = r->rpath;
+    e.runpath = r->runpath;
+    e.needed = disk_image_append(img, r->needed, r->num_needed * sizeof(uint64_t));
+    e.num_needed = r->num_needed;
+
+    size_t mask = h->records_capacity - 1;
+    size_t i = visited_file_hash(r->st_dev, r->st_ino) & mask;
+    struct disk_record_t *table =
+        (struct disk_record_t *)(img->arr + h->records);
+    while (table[i].used)
+        i = (i + 1) & mask;
+    table[i] = e;
+}
+
+static void disk_image_add_dir(struct string_table_t *img,
+                               struct disk_header_t const *h,
+                               struct dir_listing_t const *d) {
+    struct disk_dir_t e;
+    memset(&e, 0, sizeof(e));
+    e.st = d->st;
+    e.used = 1;
+    e.hash = d->hash;
+    e.path = disk_image_append(img, d->path, d->path_len + 1);
+    e.path_len = d->path_len;
+    e.capacity = d->capacity;
+    e.names = disk_image_append(img, NULL, d->capacity * sizeof(uint64_t));
+    for (size_t i = 0; i < d->capacity; ++i) {
+        if (d->names[i] == NULL)
+            continue;
+        uint64_t name = disk_image_append(img, d->names[i],
+                                          strlen(d->names[i]) + 1);
+        memcpy(img->arr + e.names + i * sizeof(uint64_t), &name,
+               sizeof(uint64_t));
+    }
+
+    size_t mask = h->dirs_capacity - 1;
+    size_t i = d->hash & mask;
+    struct disk_dir_t *table = (struct disk_dir_t *)(img->arr + h->dirs);
+    while (table[i].used)
+        i = (i + 1) & mask;
+    table[i] = e;
+}
+
+static size_t disk_table_capacity(size_t n) {
+    // Keep the load factor below 1/2.
+    size_t capacity = 16;
+    while (capacity < 2 * n)
+        capacity *= 2;
+    return capacity;
+}
+
+// Write what we learned in this run together with the entries of the old
+// cache file that we did not look at to a new cache file. Nothing is written
+// when everything came from the old file.
+static void disk_cache_save(struct disk_cache_t const *dc,
+                            struct elf_cache_t const *records,
+                            struct dir_cache_t const *dirs, char const *path) {
+    // The in-memory tables win over old entries of the same file.
+    struct arena_t arena = {NULL};
+    struct elf_cache_t old_records;
+    struct dir_cache_t old_dirs;
+    elf_cache_init(&old_records);
+    dir_cache_init(&old_dirs);
+
+    int changed = 0;
+    size_t num_records = 0;
+    size_t num_dirs = 0;
+    for (size_t i = 0; i < records->capacity; ++i) {
+        if (records->arr[i] == NULL)
+            continue;
+        changed |= !records->arr[i]->from_disk;
+        ++num_records;
+    }
+    for (size_t i = 0; i < dirs->capacity; ++i) {
+        struct dir_listing_t const *d = dirs->arr[i];
+        if (d == NULL || !d->has_stat)
+            continue;
+        changed |= !d->from_disk;
+        ++num_dirs;
+    }
+
+    if (!changed) {
+        elf_cache_free(&old_records);
+        dir_cache_free(&old_dirs);
+        return;
+    }
+
+    if (dc->header != NULL) {
+        for (size_t i = 0; i < dc->header->records_capacity; ++i) {
+            struct disk_record_t const *e = &dc->records[i];
+            if (!e->used ||
+                records->arr[elf_cache_slot(records, e->st.dev, e->st.ino)] !=
+                    NULL)
+                continue;
+            struct elf_record_t *r = disk_cache_record(dc, e, &arena);
+            if (r == NULL ||
+                old_records.arr[elf_cache_slot(&old_records, r->st_dev,
+                                               r->st_ino)] != NULL)
+                continue;
+            if (2 * (old_records.n + 1) > old_records.capacity)
+                elf_cache_grow(&old_records);
+            old_records.arr[elf_cache_slot(&old_records, r->st_dev,
+                                           r->st_ino)] = r;
+            ++old_records.n;
+            ++num_records;
+        }
+        for (size_t i = 0; i < dc->header->dirs_capacity; ++i) {
+            struct disk_dir_t const *e = &dc->dirs[i];
+            if (!e->used)
+                continue;
+            struct dir_listing_t *d = disk_cache_dir(dc, e, &arena);
+            if (d == NULL ||
+                dirs->arr[dir_cache_slot(dirs, d->path, d->path_len,
+                                         d->hash)] != NULL ||
+                old_dirs.arr[dir_cache_slot(&old_dirs, d->path, d->path_len,
+                                            d->hash)] != NULL)
+                continue;
+            if (2 * (old_dirs.n + 1) > old_dirs.capacity)
+                dir_cache_grow(&old_dirs);
+            old_dirs.arr[dir_cache_slot(&old_dirs, d->path, d->path_len,
+                                        d->hash)] = d;
+            ++old_dirs.n;
+            ++num_dirs;
+        }
+    }
+
+    struct disk_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DISK_CACHE_MAGIC, sizeof(h.magic));
+    h.version = DISK_CACHE_VERSION;
+    h.byte_order = DISK_CACHE_BYTE_ORDER;
+    h.records_capacity = disk_table_capacity(num_records);
+    h.dirs_capacity = disk_table_capacity(num_dirs);
+
+    struct string_table_t img = {NULL, 0, 0};
+    disk_image_append(&img, &h, sizeof(h));
+    h.records = disk_image_append(
+        &img, NULL, h.records_capacity * sizeof(struct disk_record_t));
+    h.dirs =
+        disk_image_append(&img, NULL, h.dirs_capacity * sizeof(struct disk_dir_t));
+
+    struct elf_cache_t const *record_tables[] = {records, &old_records};
+    for (size_t t = 0; t < 2; ++t)
+        for (size_t i = 0; i < record_tables[t]->capacity; ++i)
+            if (record_tables[t]->arr[i] != NULL)
+                disk_image_add_record(&img, &h, record_tables[t]->arr[i]);
+
+    struct dir_cache_t const *dir_tables[] = {dirs, &old_dirs};
+    for (size_t t = 0; t < 2; ++t)
+        for (size_t i = 0; i < dir_tables[t]->capacity; ++i)
+            if (dir_tables[t]->arr[i] != NULL && dir_tables[t]->arr[i]->has_stat)
+                disk_image_add_dir(&img, &h, dir_tables[t]->arr[i]);
+
+    // End with a NUL byte, so that no string runs past the end of the file.
+    char nul = '\0';
+    disk_image_append(&img, &nul, 1);
+    h.size = img.n;
+    memcpy(img.arr, &h, sizeof(h));
+
+    elf_cache_free(&old_records);
+    dir_cache_free(&old_dirs);
+    arena_free(&arena);
+
+    // Replace the old file at once, readers that mapped it keep their copy.
+    size_t path_len = strlen(path);
+    char *tmp = malloc(path_len + 8);
+    if (tmp == NULL)
+        exit(1);
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".XXXXXX", 8);
+
+    int fd = mkstemp(tmp);
+    int ok = fd != -1;
+    for (size_t n = 0; ok && n < img.n;) {
+        ssize_t written = write(fd, img.arr + n, img.n - n);
+        ok = written > 0;
+        n += ok ? (size_t)written : 0;
+    }
+    if (fd != -1) {
+        ok = fchmod(fd, 0644) == 0 && close(fd) == 0 && ok;
+        ok = ok && rename(tmp, path) == 0;
+        if (!ok)
+            unlink(tmp);
+    }
+    if (!ok) {
+        fputs("Warning [", stderr);
+        fputs(path, stderr);
+        fputs("]: Could not write the cache file\n", stderr);
+    }
+
+    free(tmp);
+    free(img.arr);
+}
+
+#ifndef LIBTREE_LIBRARY
+static void missing_set_init(struct missing_set_t *m) {
+    m->n = 0;
+    m->capacity = 64;
+    m->arr = calloc(m->capacity, sizeof(struct missing_entry_t));
+    m->lock = NULL;
+    if (m->arr == NULL)
+        exit(1);
+}
+
+static void missing_set_free(struct missing_set_t *m) { free(m->arr); }
+
+static size_t missing_set_slot(struct missing_set_t const *m,
+                               char const *soname) {
+    size_t mask = m->capacity - 1;
+    size_t i = hash_str(soname, strlen(soname)) & mask;
+    while (m->arr[i].soname != NULL && strcmp(m->arr[i].soname, soname) != 0)
+        i = (i + 1) & mask;
+    return i;
+}
+
+// The sonames are not copied, they should outlive the set.
+static void missing_set_add(struct missing_set_t *m, size_t num_missing,
+                            struct soname_t const *const *missing,
+                            size_t input) {
+    cache_lock(m->lock);
+    for (size_t j = 0; j < num_missing; ++j) {
+        char const *soname = missing[j]->name;
+
+        // Keep the load factor below 1/2.
+        if (2 * (m->n + 1) > m->capacity) {
+            struct missing_entry_t *old = m->arr;
+            size_t old_capacity = m->capacity;
+            m->capacity *= 2;
+            m->arr = calloc(m->capacity, sizeof(struct missing_entry_t));
+            if (m->arr == NULL)
+                exit(1);
+            for (size_t k = 0; k < old_capacity; ++k)
+                if (old[k].soname != NULL)
+                    m->arr[missing_set_slot(m, old[k].soname)] = old[k];
+            free(old);
+        }
+
+        struct missing_entry_t *e = &m->arr[missing_set_slot(m, soname)];
+        if (e->soname == NULL) {
+            e->soname = soname;
+            ++m->n;
+        }
+
+        // Count every input once.
+        if (e->last_input != input) {
+            e->last_input = input;
+            ++e->files;
+        }
+    }
+    cache_unlock(m->lock);
+}
+
+static int missing_entry_cmp(void const *a, void const *b) {
+    struct missing_entry_t const *x = a;
+    struct missing_entry_t const *y = b;
+    if (x->files != y->files)
+        return x->files < y->files ? 1 : -1;
+    return strcmp(x->soname, y->soname);
+}
+
+// Print the missing sonames, the most needed first.
+static void missing_set_print(struct missing_set_t *m, int color) {
+    if (m->n == 0)
+        return;
+
+    struct missing_entry_t *entries =
+        malloc(m->n * sizeof(struct missing_entry_t));
+    if (entries == NULL)
+        exit(1);
+    size_t n = 0;
+    for (size_t i = 0; i < m->capacity; ++i)
+        if (m->arr[i].soname != NULL)
+            entries[n++] = m->arr[i];
+    qsort(entries, n, sizeof(struct missing_entry_t), missing_entry_cmp);
+
+    fputs("Not found:\n", stdout);
+    for (size_t i = 0; i < n; ++i) {
+        char num[24];
+        utoa(num, entries[i].files);
+        fputs(JUST_INDENT, stdout);
+        if (color)
+            fputs(BOLD_RED, stdout);
+        fputs(entries[i].soname, stdout);
+        if (color)
+            fputs(CLEAR, stdout);
+        fputs(" needed by ", stdout);
+        fputs(num, stdout);
+        fputs(entries[i].files == 1 ? " file\n" : " files\n", stdout);
+    }
+
+    free(entries);
+}
+#endif
+
+static void dag_init(struct dag_t *d) {
+    d->num_nodes = 0;
+    d->nodes_capacity = 256;
+    d->nodes = calloc(d->nodes_capacity, sizeof(struct dag_node_t *));
+    d->num_chains = 0;
+    d->chains_capacity = 64;
+    d->chains = calloc(d->chains_capacity, sizeof(struct rpath_chain_t *));
+    d->by_depth = 0;
+    d->lock = NULL;
+    if (d->nodes == NULL || d->chains == NULL)
+        exit(1);
+}
+
+static void dag_free(struct dag_t *d) {
+    free(d->nodes);
+    free(d->chains);
+}
+
+static size_t dag_chain_slot(struct dag_t const *d,
+                             struct rpath_chain_t const *parent,
+                             struct search_path_t const *rpath, size_t up,
+                             uint64_t hash) {
+    size_t mask = d->chains_capacity - 1;
+    size_t i = hash & mask;
+    while (d->chains[i] != NULL) {
+        struct rpath_chain_t const *c = d->chains[i];
+        if (c->hash == hash && c->parent == parent && c->up == up &&
+            (c->rpath == rpath || (c->rpath->hash == rpath->hash &&
+                                   strcmp(c->rpath->str, rpath->str) == 0)))
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// The chain of `parent` extended with `rpath` of a file `up` levels below the
+// file of the first entry of `parent`.
+static struct rpath_chain_t const *
+dag_chain_intern(struct dag_t *d, struct arena_t *a,
+                 struct rpath_chain_t const *parent,
+                 struct search_path_t const *rpath, size_t up) {
+    uint64_t hash =
+        hash_u64((parent == NULL ? 0 : parent->hash) ^ up) ^ rpath->hash;
+    cache_lock(d->lock);
+    size_t i = dag_chain_slot(d, parent, rpath, up, hash);
+    if (d->chains[i] != NULL) {
+        struct rpath_chain_t const *c = d->chains[i];
+        cache_unlock(d->lock);
+        return c;
+    }
+
+    struct rpath_chain_t *c = arena_alloc(a, sizeof(*c));
+    c->parent = parent;
+    c->rpath = rpath;
+    c->up = up;
+    c->hash = hash;
+
+    // Keep the load factor below 1/2.
+    if (2 * (d->num_chains + 1) > d->chains_capacity) {
+        struct rpath_chain_t **old = d->chains;
+        size_t old_capacity = d->chains_capacity;
+        d->chains_capacity *= 2;
+        d->chains = calloc(d->chains_capacity, sizeof(struct rpath_chain_t *));
+        if (d->chains == NULL)
+            exit(1);
+        for (size_t j = 0; j < old_capacity; ++j)
+            if (old[j] != NULL)
+                d->chains[dag_chain_slot(d, old[j]->parent, old[j]->rpath,
+                                         old[j]->up, old[j]->hash)] = old[j];
+        free(old);
+        i = dag_chain_slot(d, parent, rpath, up, hash);
+    }
+    d->chains[i] = c;
+    ++d->num_chains;
+    cache_unlock(d->lock);
+    return c;
+}
+
+static size_t dag_node_slot(struct dag_t const *d, char const *path,
+                            struct rpath_chain_t const *parent_rpaths,
+                            size_t parent_rpaths_up, size_t depth,
+                            uint64_t hash) {
+    size_t mask = d->nodes_capacity - 1;
+    size_t i = hash & mask;
+    while (d->nodes[i] != NULL) {
+        struct dag_node_t const *n = d->nodes[i];
+        if (n->hash == hash && n->parent_rpaths == parent_rpaths &&
+            n->parent_rpaths_up == parent_rpaths_up && n->depth == depth &&
+            strcmp(n->path, path) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// The node of the file at `path` with ancestors that have `parent_rpaths`,
+// the first of which is `parent_rpaths_up` levels up, at `depth` when the
+// graph is kept per depth.
+static struct dag_node_t *dag_node_get(struct dag_t *d, struct arena_t *a,
+                                       char const *path,
+                                       struct elf_record_t *record,
+                                       struct rpath_chain_t const *parent_rpaths,
+                                       size_t parent_rpaths_up, size_t depth) {
+    if (parent_rpaths == NULL)
+        parent_rpaths_up = 0;
+    uint64_t hash = hash_str(path, strlen(path)) ^
+                    hash_u64((parent_rpaths == NULL ? 0 : parent_rpaths->hash) ^
+                             parent_rpaths_up ^ (uint64_t)depth << 32);
+    cache_lock(d->lock);
+    size_t i = dag_node_slot(d, path, parent_rpaths, parent_rpaths_up, depth,
+                             hash);
+    if (d->nodes[i] != NULL) {
+        struct dag_node_t *n = d->nodes[i];
+        cache_unlock(d->lock);
+        return n;
+    }
+
+    struct dag_node_t *n = arena_alloc(a, sizeof(*n));
+    memset(n, 0, sizeof(*n));
+    n->path = arena_copy(a, path, strlen(path) + 1);
+    n->record = record;
+    n->parent_rpaths = parent_rpaths;
+    n->parent_rpaths_up = parent_rpaths_up;
+    n->depth = depth;
+    n->hash = hash;
+
+    // Keep the load factor below 1/2.
+    if (2 * (d->num_nodes + 1) > d->nodes_capacity) {
+        struct dag_node_t **old = d->nodes;
+        size_t old_capacity = d->nodes_capacity;
+        d->nodes_capacity *= 2;
+        d->nodes = calloc(d->nodes_capacity, sizeof(struct dag_node_t *));
+        if (d->nodes == NULL)
+            exit(1);
+        for (size_t j = 0; j < old_capacity; ++j)
+            if (old[j] != NULL)
+                d->nodes[dag_node_slot(d, old[j]->path, old[j]->parent_rpaths,
+                                       old[j]->parent_rpaths_up, old[j]->depth,
+                                       old[j]->hash)] = old[j];
+        free(old);
+        i = dag_node_slot(d, path, parent_rpaths, parent_rpaths_up, depth,
+                          hash);
+    }
+    d->nodes[i] = n;
+    ++d->num_nodes;
+    cache_unlock(d->lock);
+    return n;
+}
+
+// The node of an input file, or an error code when it can't be used at all.
+static int dag_root(char const *path, struct libtree_state_t *s,
+                    struct dag_node_t **node) {
+    struct elf_record_t *r;
+    struct file_ref_t ref = {path, -1, AT_FDCWD, path};
+    int code = elf_cache_get(s->cache, s->arena, &ref, &s->stats, &r);
+    if (code != 0)
+        return code;
+
+    if (r->header_error != 0)
+        return r->header_error;
+
+    *node = dag_node_get(s->dag, s->arena, path, r, NULL, 0, 0);
+    return 0;
+}
+
+static struct dag_node_t *dag_candidate(struct file_ref_t const *ref,
+                                        struct dag_node_t *parent,
+                                        struct libtree_state_t *s) {
+    // Get the parsed file, which only touches the file system the first time.
+    struct elf_record_t *r;
+    if (elf_cache_get(s->cache, s->arena, ref, &s->stats, &r) != 0)
+        return NULL;
+
+    if (r->header_error != 0)
+        return NULL;
+
+    // Make sure that we have matching bits with parent
+    struct compat_t compat = parent->record->type;
+    if (compat.class != r->type.class || compat.machine != r->type.machine)
+        return NULL;
+
+    // Libraries we can't get the dependencies of are skipped.
+    if (r->dynamic_error != 0 || r->needed_error != 0)
+        return NULL;
+
+    // A library reached at another depth is the same node, unless the graph
+    // is kept per depth.
+    size_t depth = s->dag->by_depth ? parent->depth + 1 : 0;
+    return dag_node_get(s->dag, s->arena, ref->path, r, parent->rpaths,
+                        parent->rpaths_up + 1, depth);
+}
+
+// Locate the dependencies of the node.
+static void dag_resolve(struct dag_node_t *node, struct libtree_state_t *s) {
+    struct elf_record_t *r = node->record;
+    char const *current_file = node->path;
+
+    // Store the ORIGIN string.
+    char origin[MAX_PATH_LENGTH];
+    char const *last_slash = strrchr(current_file, '/');
+    if (last_slash != NULL) {
+        // Exclude the last slash
+        size_t bytes = last_slash - current_file;
+        memcpy(origin, current_file, bytes);
+        origin[bytes] = '\0';
+    } else {
+        // this only happens when the input is relative (e.g. in current dir)
+        memcpy(origin, "./", 3);
+    }
+
+    // Substitute variables in DT_RPATH and DT_RUNPATH, unless we've done that
+    // already for this origin.
+    cache_lock(s->cache->lock);
+    if (r->origin == NULL || strcmp(r->origin, origin) != 0) {
+        r->origin = arena_copy(s->arena, origin, strlen(origin) + 1);
+        r->rpath_dirs = r->rpath == MAX_OFFSET_T
+                            ? NULL
+                            : search_path_get(s, r->strtab + r->rpath, origin);
+        r->runpath_dirs =
+            r->runpath == MAX_OFFSET_T
+                ? NULL
+                : search_path_get(s, r->strtab + r->runpath, origin);
+    }
+
+    if (r->sonames == NULL) {
+        struct soname_t const **sonames =
+            arena_alloc(s->arena, r->num_needed * sizeof(struct soname_t *));
+        for (size_t i = 0; i < r->num_needed; ++i)
+            sonames[i] = soname_intern(s->cache, s->arena,
+                                       r->strtab + r->needed[i]);
+        r->sonames = sonames;
+    }
+
+    struct search_path_t const *rpath = r->rpath_dirs;
+    node->runpath = r->runpath_dirs;
+    struct soname_t const **sonames = r->sonames;
+    cache_unlock(s->cache->lock);
+
+    // rpath stack: if lib_a needs lib_b needs lib_c and all have rpaths
+    // then first lib_c's rpaths are considered, then lib_b's, then lib_a's.
+    if (rpath != NULL) {
+        node->rpaths = dag_chain_intern(s->dag, s->arena, node->parent_rpaths,
+                                        rpath, node->parent_rpaths_up);
+        node->rpaths_up = 0;
+    } else {
+        node->rpaths = node->parent_rpaths;
+        node->rpaths_up = node->parent_rpaths_up;
+    }
+    node->no_def_lib = (r->dt_flags_1 & DT_1_NODEFLIB) == DT_1_NODEFLIB;
+
+    // Copy the needed libraries, since the search reorders them.
+    struct soname_t const *needed_buf[SMALL_VEC_SIZE];
+    struct soname_t const **needed = needed_buf;
+    if (r->num_needed > SMALL_VEC_SIZE) {
+        needed = malloc(r->num_needed * sizeof(struct soname_t *));
+        if (needed == NULL)
+            exit(1);
+    }
+    if (r->num_needed > 0)
+        memcpy(needed, sonames, r->num_needed * sizeof(struct soname_t *));
+
+    struct dag_edges_t edges = {NULL, 0, 0};
+    struct search_path_t const *runpath = node->runpath;
+    int no_def_lib = node->no_def_lib;
+
+    size_t needed_not_found = r->num_needed;
+
+    // Skip common libraries if not verbose
+    if (needed_not_found && s->verbosity == 0)
+        apply_exclude_list(&needed_not_found, needed);
+
+    if (needed_not_found)
+        check_absolute_paths(&needed_not_found, needed, node, &edges, s);
+
+    // Consider rpaths only when runpath is empty
+    if (runpath == NULL) {
+        // We have a stack of rpaths, try them all, starting with one set at
+        // this lib, then the parents.
+        size_t up = node->rpaths_up;
+        for (struct rpath_chain_t const *c = node->rpaths;
+             c != NULL && needed_not_found; up += c->up, c = c->parent)
+            check_search_paths((struct found_t){.how = RPATH, .up = up},
+                               c->rpath, &needed_not_found, needed, node,
+                               &edges, s);
+    }
+
+    // Then try LD_LIBRARY_PATH, if we have it.
+    if (needed_not_found && s->ld_library_path != NULL) {
+        check_search_paths((struct found_t){.how = LD_LIBRARY_PATH},
+                           s->ld_library_path, &needed_not_found, needed, node,
+                           &edges, s);
+    }
+
+    // Then consider runpaths
+    if (needed_not_found && runpath != NULL) {
+        check_search_paths((struct found_t){.how = RUNPATH}, runpath,
+                           &needed_not_found, needed, node, &edges, s);
+    }
+
+    // Check ld.so.cache or ld.so.conf paths
+    if (needed_not_found && !no_def_lib && s->ld_cache_file != NULL) {
+        check_ld_cache(&needed_not_found, needed, node, &edges, s);
+    } else if (needed_not_found && !no_def_lib) {
+        check_search_paths((struct found_t){.how = LD_SO_CONF}, s->ld_so_conf,
+                           &needed_not_found, needed, node, &edges, s);
+    }
+
+    // Then consider standard paths
+    if (needed_not_found && !no_def_lib) {
+        check_search_paths((struct found_t){.how = DEFAULT}, s->default_paths,
+                           &needed_not_found, needed, node, &edges, s);
+    }
+
+    node->num_edges = edges.n;
+    node->edges = arena_alloc(s->arena, edges.n * sizeof(struct dag_edge_t));
+    if (edges.n > 0)
+        memcpy(node->edges, edges.p, edges.n * sizeof(struct dag_edge_t));
+    free(edges.p);
+
+    // Finally keep those that could not be found.
+    node->num_missing = needed_not_found;
+    node->missing =
+        arena_alloc(s->arena, needed_not_found * sizeof(struct soname_t *));
+    if (needed_not_found > 0)
+        memcpy(node->missing, needed,
+               needed_not_found * sizeof(struct soname_t *));
+    if (needed != needed_buf)
+        free(needed);
+
+    node->resolved = 1;
+}
+
+// The description of an error code, or NULL if there is no error.
+static char const *error_message(int code) {
+    char const *msg = NULL;
+    switch (code) {
+    case ERR_INVALID_MAGIC:
+        msg = "Invalid ELF magic bytes";
+        break;
+    case ERR_INVALID_CLASS:
+        msg = "Invalid ELF class";
+        break;
+    case ERR_INVALID_DATA:
+        msg = "Invalid ELF data";
+        break;
+    case ERR_INVALID_HEADER:
+        msg = "Invalid ELF header";
+        break;
+    case ERR_INVALID_BITS:
+        msg = "Invalid bits";
+        break;
+    case ERR_INVALID_ENDIANNESS:
+        msg = "Invalid endianness";
+        break;
+    case ERR_NO_EXEC_OR_DYN:
+        msg = "Not an ET_EXEC or ET_DYN ELF file";
+        break;
+    case ERR_INVALID_PHOFF:
+        msg = "Invalid ELF program header offset";
+        break;
+    case ERR_INVALID_PROG_HEADER:
+        msg = "Invalid ELF program header";
+        break;
+    case ERR_CANT_STAT:
+        msg = "Can't stat file";
+        break;
+    case ERR_INVALID_DYNAMIC_SECTION:
+        msg = "Invalid ELF dynamic section";
+        break;
+    case ERR_INVALID_DYNAMIC_ARRAY_ENTRY:
+        msg = "Invalid ELF dynamic array entry";
+        break;
+    case ERR_NO_STRTAB:
+        msg = "No ELF string table found";
+        break;
+    case ERR_INVALID_SONAME:
+        msg = "Can't read DT_SONAME";
+        break;
+    case ERR_INVALID_RPATH:
+        msg = "Can't read DT_RPATH";
+        break;
+    case ERR_INVALID_RUNPATH:
+        msg = "Can't read DT_RUNPATH";
+        break;
+    case ERR_INVALID_NEEDED:
+        msg = "Can't read DT_NEEDED";
+        break;
+    case ERR_DEPENDENCY_NOT_FOUND:
+        msg = "Not all dependencies were found";
+        break;
+    case ERR_NO_PT_LOAD:
+        msg = "No PT_LOAD found in ELF file";
+        break;
+    case ERR_VADDRS_NOT_ORDERED:
+        msg = "Virtual addresses are not ordered";
+        break;
+    case ERR_COULD_NOT_OPEN_FILE:
+        msg = "Could not open file";
+        break;
+    case ERR_FILE_TOO_LARGE:
+        msg = "File too large to read";
+        break;
+    case ERR_INCOMPATIBLE_ISA:
+        msg = "Incompatible ISA";
+        break;
+    case ERR_SYMBOL_NOT_FOUND:
+        msg = "Not all symbols or versions were found";
+        break;
+    }
+
+    return msg;
+}
+
+static char const *how_name(how_t how) {
+    switch (how) {
+    case INPUT:
+        return "input";
+    case DIRECT:
+        return "direct";
+    case RPATH:
+        return "rpath";
+    case LD_LIBRARY_PATH:
+        return "LD_LIBRARY_PATH";
+    case RUNPATH:
+        return "runpath";
+    case LD_SO_CONF:
+        return "ld.so.conf";
+    case LD_SO_CACHE:
+        return "ld.so.cache";
+    case DEFAULT:
+        return "default path";
+    }
+    return NULL;
+}
+
+#ifndef LIBTREE_LIBRARY
+// Write a quoted string with escapes that work for both JSON and DOT.
+static void json_string(char const *str, FILE *out) {
+    static char const hex[] = "0123456789abcdef";
+    fputc('"', out);
+    for (unsigned char const *c = (unsigned char const *)str; *c != '\0';
+         ++c) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+            fputc(*c, out);
+        } else if (*c < 0x20) {
+            fputs("\\u00", out);
+            fputc(hex[*c >> 4], out);
+            fputc(hex[*c & 0xf], out);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Write `,"key":` followed by the number `v`.
+static void json_number(char const *key, size_t v, FILE *out) {
+    char num[24];
+    utoa(num, v);
+    fputs(",\"", out);
+    fputs(key, out);
+    fputs("\":", out);
+    fputs(num, out);
+}
+
+// The fields that describe a line, shared by JSON and NDJSON.
+static void json_line_fields(struct tree_line_t const *l, FILE *out) {
+    struct elf_record_t const *r = l->node->record;
+    fputs("\"soname\":", out);
+    if (l->soname != NULL)
+        json_string(l->soname, out);
+    else if (r->has_dynamic && r->soname != MAX_OFFSET_T)
+        json_string(r->strtab + r->soname, out);
+    else
+        fputs("null", out);
+    fputs(",\"path\":", out);
+    json_string(l->node->path, out);
+    fputs(",\"how\":", out);
+    json_string(how_name(l->reason.how), out);
+    if (l->reason.how == RPATH)
+        json_number("rpath_depth", l->depth - 1 - l->reason.up, out);
+    fputs(l->seen_before ? ",\"seen\":true" : ",\"seen\":false", out);
+    if (l->ref != 0)
+        json_number(l->is_ref ? "see" : "id", l->ref, out);
+}
+
+// `{"type":"<type>","input":"<input>","depth":<depth>`, which starts every
+// NDJSON record.
+static void ndjson_begin(char const *type, size_t depth,
+                         struct tree_printer_t *p) {
+    fputs("{\"type\":\"", p->out);
+    fputs(type, p->out);
+    fputs("\",\"input\":", p->out);
+    json_string(p->input, p->out);
+    json_number("depth", depth, p->out);
+}
+
+static void tree_line_print(struct tree_line_t const *l,
+                            struct libtree_state_t *s,
+                            struct tree_printer_t *p) {
+    // No dynamic section?
+    if (!l->node->record->has_dynamic) {
+        print_line(l->depth, l->name, BOLD_CYAN, REGULAR_CYAN, 1, l->reason,
+                   NULL, s, p);
+        return;
+    }
+
+    char *bold_color = l->in_exclude_list ? REGULAR_MAGENTA
+                       : l->seen_before   ? REGULAR_BLUE
+                                          : BOLD_CYAN;
+    char *regular_color = l->in_exclude_list ? REGULAR_MAGENTA
+                          : l->seen_before   ? REGULAR_BLUE
+                                             : REGULAR_CYAN;
+
+    int highlight = !l->seen_before && !l->in_exclude_list;
+
+    char suffix[32];
+    if (l->ref != 0) {
+        if (l->is_ref) {
+            memcpy(suffix, " \xe2\x86\x92 see #", 10);
+            utoa(suffix + 10, l->ref);
+        } else {
+            memcpy(suffix, " #", 2);
+            utoa(suffix + 2, l->ref);
+        }
+    }
+
+    print_line(l->depth, l->name, bold_color, regular_color, highlight,
+               l->reason, l->ref != 0 ? suffix : NULL, s, p);
+}
+
+// Start the output of a line, which is followed by its dependencies when it
+// is expanded, and then by output_line_end.
+static void output_line_begin(struct tree_line_t const *l,
+                              struct libtree_state_t *s,
+                              struct tree_printer_t *p) {
+    if (p->out == NULL)
+        return;
+
+    switch (s->format) {
+    case FORMAT_TREE:
+        tree_line_print(l, s, p);
+        break;
+    case FORMAT_NDJSON:
+        ndjson_begin(l->parent == NULL ? "input" : "edge", l->depth, p);
+        if (l->parent != NULL) {
+            fputs(",\"parent\":", p->out);
+            json_string(l->parent->path, p->out);
+        }
+        fputc(',', p->out);
+        json_line_fields(l, p->out);
+        fputs("}\n", p->out);
+        break;
+    case FORMAT_JSON:
+        if (p->need_comma)
+            fputc(',', p->out);
+        fputc('{', p->out);
+        json_line_fields(l, p->out);
+        if (l->expanded) {
+            fputs(",\"dependencies\":[", p->out);
+            p->need_comma = 0;
+        }
+        break;
+    case FORMAT_DOT:
+        fputs("  ", p->out);
+        json_string(l->node->path, p->out);
+        fputs(" [label=", p->out);
+        json_string(l->name, p->out);
+        fputs("];\n", p->out);
+        if (l->parent != NULL) {
+            fputs("  ", p->out);
+            json_string(l->parent->path, p->out);
+            fputs(" -> ", p->out);
+            json_string(l->node->path, p->out);
+            fputs(" [label=", p->out);
+            json_string(how_name(l->reason.how), p->out);
+            fputs("];\n", p->out);
+        }
+        break;
+    }
+}
+
+// A DT_NEEDED entry of the node of line `l` that could not be located, or that
+// is not an absolute path when `invalid` is set.
+static void output_missing(struct tree_line_t const *l, char const *soname,
+                           int invalid, struct libtree_state_t *s,
+                           struct tree_printer_t *p) {
+    struct dag_node_t const *parent = l->node;
+    size_t depth = l->depth + 1;
+    switch (s->format) {
+    case FORMAT_TREE:
+        tree_preamble(p, depth);
+        if (s->color)
+            fputs(BOLD_RED, p->out);
+        fputs(soname, p->out);
+        fputs(invalid ? " is not absolute" : " not found", p->out);
+        fputs(s->color ? CLEAR "\n" : "\n", p->out);
+        break;
+    case FORMAT_NDJSON:
+        ndjson_begin(invalid ? "invalid" : "missing", depth, p);
+        fputs(",\"parent\":", p->out);
+        json_string(parent->path, p->out);
+        fputs(",\"soname\":", p->out);
+        json_string(soname, p->out);
+        fputs("}\n", p->out);
+        break;
+    case FORMAT_JSON:
+        if (p->need_comma)
+            fputc(',', p->out);
+        json_string(soname, p->out);
+        p->need_comma = 1;
+        break;
+    case FORMAT_DOT:
+        fputs("  ", p->out);
+        json_string(soname, p->out);
+        fputs(" [color=red];\n  ", p->out);
+        json_string(parent->path, p->out);
+        fputs(" -> ", p->out);
+        json_string(soname, p->out);
+        fputs(invalid ? " [color=red,label=\"not absolute\"];\n"
+                      : " [color=red,label=\"not found\"];\n",
+              p->out);
+        break;
+    }
+}
+
+// DT_NEEDED paths of the node of an expanded line that are not absolute.
+static void output_invalid(struct tree_line_t const *l, char const *soname,
+                           struct libtree_state_t *s,
+                           struct tree_printer_t *p) {
+    if (p->out == NULL)
+        return;
+
+    // In JSON they are listed with the missing libraries.
+    if (s->format == FORMAT_JSON)
+        return;
+
+    output_missing(l, soname, 1, s, p);
+}
+
+// The DT_NEEDED entries of the node of an expanded line that could not be
+// located.
+static void output_not_found(struct tree_line_t const *l,
+                             struct libtree_state_t *s,
+                             struct tree_printer_t *p) {
+    if (p->out == NULL)
+        return;
+
+    struct dag_node_t const *node = l->node;
+    if (s->format == FORMAT_TREE) {
+        print_error(l->depth, node, s, p);
+        return;
+    }
+
+    // In JSON they follow the dependencies.
+    if (s->format == FORMAT_JSON)
+        return;
+
+    for (size_t i = 0; i < node->num_missing; ++i)
+        output_missing(l, node->missing[i]->name, 0, s, p);
+}
+
+static void output_line_end(struct tree_line_t const *l,
+                            struct libtree_state_t *s,
+                            struct tree_printer_t *p) {
+    if (p->out == NULL || s->format != FORMAT_JSON)
+        return;
+
+    struct dag_node_t const *node = l->node;
+    if (l->expanded) {
+        fputc(']', p->out);
+        size_t num_invalid = 0;
+        for (size_t i = 0; i < node->num_edges; ++i)
+            num_invalid += node->edges[i].node == NULL;
+        if (node->num_missing + num_invalid > 0) {
+            fputs(",\"missing\":[", p->out);
+            p->need_comma = 0;
+            for (size_t i = 0; i < node->num_edges; ++i)
+                if (node->edges[i].node == NULL)
+                    output_missing(l, node->edges[i].soname, 1, s, p);
+            for (size_t i = 0; i < node->num_missing; ++i)
+                output_missing(l, node->missing[i]->name, 0, s, p);
+            fputc(']', p->out);
+        }
+    }
+    fputc('}', p->out);
+    p->need_comma = 1;
+}
+
+// An input file that could not be analyzed.
+static void output_error(int code, struct libtree_state_t *s,
+                         struct tree_printer_t *p) {
+    if (p->out == NULL)
+        return;
+
+    switch (s->format) {
+    case FORMAT_TREE:
+    case FORMAT_DOT:
+        break;
+    case FORMAT_NDJSON:
+        ndjson_begin("error", 0, p);
+        fputs(",\"error\":", p->out);
+        json_string(error_message(code), p->out);
+        fputs("}\n", p->out);
+        break;
+    case FORMAT_JSON:
+        fputs("{\"path\":", p->out);
+        json_string(p->input, p->out);
+        fputs(",\"error\":", p->out);
+        json_string(error_message(code), p->out);
+        fputc('}', p->out);
+        break;
+    }
+}
+
+// What goes before the output of the input with number `index`.
+static void output_separator(size_t index, struct libtree_state_t *s,
+                             FILE *out) {
+    if (s->format == FORMAT_JSON && index > 0)
+        fputs(",\n", out);
+}
+
+static void output_document_begin(struct libtree_state_t *s) {
+    if (s->format == FORMAT_JSON)
+        fputs("[\n", stdout);
+    else if (s->format == FORMAT_DOT)
+        fputs("strict digraph libtree {\n", stdout);
+}
+
+static void output_document_end(struct libtree_state_t *s) {
+    if (s->format == FORMAT_JSON)
+        fputs("\n]\n", stdout);
+    else if (s->format == FORMAT_DOT)
+        fputs("}\n", stdout);
+    fflush(stdout);
+}
+
+// Print the line of `node`. When its dependencies should follow, a frame is
+// pushed for them and `*pushed` is set; otherwise the exit code of the line is
+// returned.
+static int print_node(struct dag_node_t *node, struct dag_node_t const *parent,
+                      char const *soname, struct found_t reason,
+                      struct libtree_state_t *s, struct tree_printer_t *p,
+                      int *pushed) {
+    struct elf_record_t *r = node->record;
+    char const *current_file = node->path;
+    *pushed = 0;
+
+    struct tree_line_t l = {.node = node,
+                            .parent = parent,
+                            .soname = soname,
+                            .name = current_file,
+                            .reason = reason,
+                            .depth = p->depth};
+    size_t depth = l.depth;
+
+    // At this point we're going to store the file as "success"
+    l.seen_before = visited_files_contains(&s->visited, r->st_dev, r->st_ino);
+
+    if (l.seen_before)
+        ++s->stats.seen_before;
+    else
+        visited_files_append(&s->visited, r->st_dev, r->st_ino);
+
+    // No dynamic section?
+    if (!r->has_dynamic) {
+        output_line_begin(&l, s, p);
+        output_line_end(&l, s, p);
+        return 0;
+    }
+
+    // Only input files can get here with errors, libraries with errors are
+    // never located.
+    if (r->dynamic_error != 0)
+        return r->dynamic_error;
+
+    char const *own_soname =
+        r->soname == MAX_OFFSET_T ? NULL : r->strtab + r->soname;
+
+    l.in_exclude_list = own_soname != NULL && is_in_exclude_list(own_soname);
+
+    // No need to recurse deeper when we aren't in very verbose mode.
+    int should_recurse =
+        depth < s->max_depth &&
+        ((!l.seen_before && !l.in_exclude_list) ||
+         (!l.seen_before && l.in_exclude_list && s->verbosity >= 2) ||
+         s->verbosity >= 3);
+
+    // When scanning directories, show which file the tree belongs to.
+    if (own_soname != NULL && !s->path && !(s->scan && depth == 0))
+        l.name = own_soname;
+
+    // A library reached at any depth is one node. Refer to the line below
+    // which its dependencies were printed before, unless --max-depth cut them
+    // shorter there than here. A graph has every edge only once anyway.
+    int compress = s->compress || s->format == FORMAT_DOT;
+    if (compress && node->ref_tree == s->tree && node->ref != 0 &&
+        (!node->ref_cut || node->ref_depth <= depth)) {
+        if (node->ref_cut && p->depth > 0)
+            p->stack[p->depth - 1].cut = 1;
+        l.ref = node->ref;
+        l.is_ref = 1;
+        output_line_begin(&l, s, p);
+        output_line_end(&l, s, p);
+        return should_recurse ? node->ref_code : 0;
+    }
+
+    if (depth >= s->max_depth && r->num_needed > 0 && p->depth > 0)
+        p->stack[p->depth - 1].cut = 1;
+
+    // Just print the library and return
+    if (!should_recurse) {
+        output_line_begin(&l, s, p);
+        output_line_end(&l, s, p);
+        return 0;
+    }
+
+    if (r->needed_error != 0)
+        return r->needed_error;
+
+    if (!node->resolved)
+        dag_resolve(node, s);
+
+    // Number the line if it has dependencies that could be referred to.
+    if (compress && node->num_edges + node->num_missing > 0) {
+        node->ref_tree = s->tree;
+        node->ref = ++s->num_refs;
+        node->ref_depth = depth;
+        l.ref = node->ref;
+    }
+
+    l.expanded = 1;
+    output_line_begin(&l, s, p);
+
+    // The frame of a node ends up at index `depth`.
+    if (p->depth == p->capacity) {
+        p->capacity = p->capacity == 0 ? 16 : 2 * p->capacity;
+        p->stack = realloc(p->stack, p->capacity * sizeof(*p->stack));
+        if (p->stack == NULL)
+            exit(1);
+    }
+    struct print_frame_t *f = &p->stack[p->depth++];
+    f->node = node;
+    f->line = l;
+    f->next_edge = 0;
+    f->exit_code = 0;
+    f->cut = 0;
+    f->found_all_needed = 0;
+    *pushed = 1;
+    return 0;
+}
+
+// Print the libraries that could not be found and the end of the line of the
+// top frame, and pop it.
+static int print_node_done(struct libtree_state_t *s,
+                           struct tree_printer_t *p) {
+    struct print_frame_t *f = &p->stack[p->depth - 1];
+    struct dag_node_t *node = f->node;
+    int exit_code = f->exit_code;
+
+    // Finally summarize those that could not be found.
+    if (node->num_missing) {
+        if (s->missing != NULL)
+            missing_set_add(s->missing, node->num_missing, node->missing,
+                            s->input);
+        output_not_found(&f->line, s, p);
+        exit_code = ERR_DEPENDENCY_NOT_FOUND;
+    }
+
+    output_line_end(&f->line, s, p);
+
+    node->ref_code = exit_code;
+    node->ref_cut = f->cut;
+    --p->depth;
+    if (f->cut && p->depth > 0)
+        p->stack[p->depth - 1].cut = 1;
+    return exit_code;
+}
+
+// Take the next dependency of the top frame. Returns 0 once the stack is
+// empty, with the exit code of the input file in `p->exit_code`.
+static int print_step(struct libtree_state_t *s, struct tree_printer_t *p) {
+    struct print_frame_t *f = &p->stack[p->depth - 1];
+    struct dag_node_t *node = f->node;
+
+    if (f->next_edge == node->num_edges) {
+        int code = print_node_done(s, p);
+        if (p->depth == 0) {
+            p->exit_code = code;
+            return 0;
+        }
+        if (code == ERR_DEPENDENCY_NOT_FOUND)
+            p->stack[p->depth - 1].exit_code = code;
+        return 1;
+    }
+
+    struct dag_edge_t const *e = &node->edges[f->next_edge++];
+    f->found_all_needed = e->last;
+
+    if (e->node != NULL) {
+        // Pushing a frame may move the stack, so don't use `f` after this.
+        int pushed;
+        int code =
+            print_node(e->node, node, e->soname, e->reason, s, p, &pushed);
+        if (!pushed && code == ERR_DEPENDENCY_NOT_FOUND)
+            p->stack[p->depth - 1].exit_code = code;
+        return 1;
+    }
+
+    if (e->error)
+        f->exit_code = e->error;
+
+    output_invalid(&f->line, e->soname, s, p);
+    return 1;
+}
+
+// The symbol tables of the file of `node`, read the first time they are
+// needed.
+static struct elf_symbols_t *elf_symbols_get(struct dag_node_t const *node,
+                                             struct libtree_state_t *s) {
+    struct elf_record_t *r = node->record;
+    cache_lock(s->cache->lock);
+    struct elf_symbols_t *t = r->symbols;
+    cache_unlock(s->cache->lock);
+    if (t != NULL)
+        return t;
+
+    t = elf_symbols_load(node->path, r->type.class, &s->stats);
+
+    // Another thread may have been first.
+    struct elf_symbols_t *unused = NULL;
+    cache_lock(s->cache->lock);
+    if (r->symbols == NULL) {
+        r->symbols = t;
+    } else {
+        unused = t;
+        t = r->symbols;
+    }
+    cache_unlock(s->cache->lock);
+    if (unused != NULL)
+        elf_symbols_free(unused);
+    return t;
+}
+
+// The library located for the DT_NEEDED entry `soname` of `node`, or NULL.
+static struct dag_node_t *dag_node_needed(struct dag_node_t const *node,
+                                          char const *soname) {
+    for (size_t i = 0; i < node->num_edges; ++i)
+        if (node->edges[i].node != NULL &&
+            strcmp(node->edges[i].soname, soname) == 0)
+            return node->edges[i].node;
+    return NULL;
+}
+
+// Whether the file defines version `name`.
+static int elf_symbols_has_version(struct elf_symbols_t const *t,
+                                   char const *name) {
+    for (size_t i = 0; i < t->num_defined; ++i)
+        if (t->defined[i] != NULL && strcmp(t->defined[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+// The files that an input loads, in the order in which the dynamic loader
+// looks up symbols in them: breadth first in the order of the DT_NEEDED
+// entries, every file once. The libraries located for the DT_NEEDED entries
+// of file k are files deps[first_dep[k]] up to deps[first_dep[k + 1]].
+struct scope_t {
+    struct dag_node_t **nodes;
+    struct elf_symbols_t **tables;
+    size_t n;
+    size_t capacity;
+    size_t *first_dep;
+    size_t *deps;
+    size_t num_deps;
+    size_t deps_capacity;
+};
+
+// The index of the file of `node` in the scope, or `scope->n`.
+static size_t scope_index(struct scope_t const *scope,
+                          struct dag_node_t const *node) {
+    size_t i = 0;
+    while (i < scope->n &&
+           (scope->nodes[i]->record->st_dev != node->record->st_dev ||
+            scope->nodes[i]->record->st_ino != node->record->st_ino))
+        ++i;
+    return i;
+}
+
+static void scope_init(struct scope_t *scope, struct dag_node_t *root,
+                       struct libtree_state_t *s) {
+    scope->n = 0;
+    scope->capacity = 64;
+    scope->num_deps = 0;
+    scope->deps_capacity = 64;
+    scope->nodes = malloc(scope->capacity * sizeof(struct dag_node_t *));
+    scope->first_dep = malloc((scope->capacity + 1) * sizeof(size_t));
+    scope->deps = malloc(scope->deps_capacity * sizeof(size_t));
+    if (scope->nodes == NULL || scope->first_dep == NULL ||
+        scope->deps == NULL)
+        exit(1);
+
+    struct visited_file_set_t files;
+    visited_files_init(&files);
+    scope->nodes[scope->n++] = root;
+    visited_files_append(&files, root->record->st_dev, root->record->st_ino);
+    for (size_t k = 0; k < scope->n; ++k) {
+        scope->first_dep[k] = scope->num_deps;
+
+        // The scope needs all libraries, not just those that the tree shows,
+        // and every file is loaded once.
+        struct elf_record_t const *r = scope->nodes[k]->record;
+        if (!r->has_dynamic || r->dynamic_error != 0 || r->needed_error != 0)
+            continue;
+        if (!scope->nodes[k]->resolved)
+            dag_resolve(scope->nodes[k], s);
+
+        for (size_t i = 0; i < r->num_needed; ++i) {
+            struct dag_node_t *dep =
+                dag_node_needed(scope->nodes[k], r->strtab + r->needed[i]);
+            if (dep == NULL)
+                continue;
+
+            size_t index;
+            if (visited_files_contains(&files, dep->record->st_dev,
+                                       dep->record->st_ino)) {
+                index = scope_index(scope, dep);
+            } else {
+                visited_files_append(&files, dep->record->st_dev,
+                                     dep->record->st_ino);
+                if (scope->n == scope->capacity) {
+                    scope->capacity *= 2;
+                    scope->nodes =
+                        realloc(scope->nodes,
+                                scope->capacity * sizeof(struct dag_node_t *));
+                    scope->first_dep =
+                        realloc(scope->first_dep,
+                                (scope->capacity + 1) * sizeof(size_t));
+                    if (scope->nodes == NULL || scope->first_dep == NULL)
+                        exit(1);
+                }
+                index = scope->n;
+                scope->nodes[scope->n++] = dep;
+            }
+
+            if (scope->num_deps == scope->deps_capacity) {
+                scope->deps_capacity *= 2;
+                scope->deps = realloc(scope->deps,
+                                      scope->deps_capacity * sizeof(size_t));
+                if (scope->deps == NULL)
+                    exit(1);
+            }
+            scope->deps[scope->num_deps++] = index;
+        }
+    }
+    scope->first_dep[scope->n] = scope->num_deps;
+    visited_files_free(&files);
+
+    scope->tables = malloc(scope->n * sizeof(struct elf_symbols_t *));
+    if (scope->tables == NULL)
+        exit(1);
+    for (size_t k = 0; k < scope->n; ++k)
+        scope->tables[k] = scope->nodes[k]->record->has_dynamic
+                               ? elf_symbols_get(scope->nodes[k], s)
+                               : NULL;
+}
+
+static void scope_free(struct scope_t *scope) {
+    free(scope->nodes);
+    free(scope->tables);
+    free(scope->first_dep);
+    free(scope->deps);
+}
+
+// Whether a file of the scope defines `name` for a reference with `version`.
+static int scope_defines(struct scope_t const *scope, char const *name,
+                         char const *version) {
+    uint32_t gnu_h = gnu_hash(name);
+    uint32_t sysv_h = sysv_hash(name);
+    for (size_t m = 0; m < scope->n; ++m)
+        if (scope->tables[m] != NULL &&
+            elf_symbols_find(scope->tables[m], name, gnu_h, sysv_h, version))
+            return 1;
+    return 0;
+}
+
+// The name and version of symbol `i` when it is undefined and global or weak,
+// or NULL.
+static char const *elf_symbols_undefined(struct elf_symbols_t const *t,
+                                         size_t i, int *weak,
+                                         char const **version) {
+    struct sym_64_t sym;
+    elf_symbols_sym(t, i, &sym);
+    int bind = sym.st_info >> 4;
+    if (sym.st_shndx != SHN_UNDEF || (bind != STB_GLOBAL && bind != STB_WEAK))
+        return NULL;
+    char const *name = elf_symbols_string(t, sym.st_name);
+    if (name == NULL || *name == '\0')
+        return NULL;
+
+    *weak = bind == STB_WEAK;
+    *version = NULL;
+    if (t->versym != NULL) {
+        size_t index = load_u16(t->versym + 2 * i) & ~VERSYM_HIDDEN;
+        for (size_t j = 0; index >= 2 && j < t->num_needed; ++j)
+            if (t->needed[j].index == index)
+                *version = t->needed[j].name;
+    }
+    return name;
+}
+
+static void symbols_report(FILE *err, char const *path, char const *what,
+                           char const *name, char const *detail,
+                           char const *detail_value) {
+    fputs(path, err);
+    fputs(": ", err);
+    fputs(what, err);
+    fputs(name, err);
+    if (detail_value != NULL) {
+        fputs(detail, err);
+        fputs(detail_value, err);
+    }
+    fputc('\n', err);
+}
+
+// Check that every version that a file needs from a library is defined by
+// the library that was located, and that every undefined symbol is defined
+// in the scope, where the first definition wins. Undefined weak symbols may
+// stay undefined. Writes what is missing to `err`, and returns
+// ERR_SYMBOL_NOT_FOUND when anything is.
+static int symbols_undefined(struct scope_t const *scope,
+                             struct libtree_state_t *s, FILE *err) {
+    int code = 0;
+    for (size_t k = 0; k < scope->n; ++k) {
+        struct elf_symbols_t const *t = scope->tables[k];
+        char const *path = scope->nodes[k]->path;
+        if (t == NULL)
+            continue;
+        if (t->invalid) {
+            symbols_report(err, path, "can't read the dynamic symbol table",
+                           "", NULL, NULL);
+            code = ERR_SYMBOL_NOT_FOUND;
+            continue;
+        }
+
+        // Libraries without versions are not checked by the loader either.
+        for (size_t j = 0; j < t->num_needed; ++j) {
+            struct version_need_t const *need = &t->needed[j];
+            if (need->flags & VER_FLG_WEAK)
+                continue;
+            struct dag_node_t *dep =
+                dag_node_needed(scope->nodes[k], need->file);
+            if (dep == NULL || !dep->record->has_dynamic)
+                continue;
+            struct elf_symbols_t const *d = elf_symbols_get(dep, s);
+            if (d->invalid || d->num_defined == 0 ||
+                elf_symbols_has_version(d, need->name))
+                continue;
+            symbols_report(err, path, "version ", need->name,
+                           " not found in ", dep->path);
+            code = ERR_SYMBOL_NOT_FOUND;
+        }
+
+        for (size_t i = 1; i < t->num_syms; ++i) {
+            int weak;
+            char const *version;
+            char const *name = elf_symbols_undefined(t, i, &weak, &version);
+            if (name == NULL || weak || scope_defines(scope, name, version))
+                continue;
+            symbols_report(err, path, "undefined symbol ", name, ", version ",
+                           version);
+            code = ERR_SYMBOL_NOT_FOUND;
+        }
+    }
+    return code;
+}
+
+// The number of files and their bytes that are loaded when the edges of the
+// scope that are set in `skip` are left out. The interpreter of the input,
+// file `interp` or `scope->n`, is loaded anyway.
+static void scope_reach(struct scope_t const *scope, char const *skip,
+                        size_t interp, size_t *queue, char *reached,
+                        size_t *files, uint64_t *bytes) {
+    memset(reached, 0, scope->n);
+    size_t n = 0;
+    queue[n++] = 0;
+    reached[0] = 1;
+    if (interp < scope->n && !reached[interp]) {
+        queue[n++] = interp;
+        reached[interp] = 1;
+    }
+    *files = 0;
+    *bytes = 0;
+    for (size_t q = 0; q < n; ++q) {
+        size_t k = queue[q];
+        ++*files;
+        *bytes += scope->nodes[k]->record->st.size;
+        for (size_t j = scope->first_dep[k]; j < scope->first_dep[k + 1];
+             ++j) {
+            if (skip[j] || reached[scope->deps[j]])
+                continue;
+            reached[scope->deps[j]] = 1;
+            queue[n++] = scope->deps[j];
+        }
+    }
+}
+
+static void unused_report(FILE *err, char const *path, char const *before,
+                          char const *soname, size_t files, uint64_t bytes,
+                          char const *after) {
+    char num[32];
+    fputs(path, err);
+    fputs(before, err);
+    fputs(soname, err);
+    fputs(", ", err);
+    utoa(num, files);
+    fputs(num, err);
+    fputs(files == 1 ? " file and " : " files and ", err);
+    utoa(num, bytes);
+    fputs(num, err);
+    fputs(" bytes", err);
+    fputs(after, err);
+    fputc('\n', err);
+}
+
+// Report the DT_NEEDED entries whose library defines none of the undefined
+// symbols of the file that needs it, together with the files and bytes that
+// would not be loaded without the entry, and without all of them. The
+// interpreter is loaded anyway, so needing it is not reported.
+static void symbols_unused(struct scope_t const *scope, FILE *err) {
+    char *unused = calloc(scope->num_deps + 1, 1);
+    if (unused == NULL)
+        exit(1);
+
+    size_t interp = scope->n;
+    struct stat finfo;
+    if (scope->tables[0] != NULL && scope->tables[0]->interp != NULL &&
+        stat(scope->tables[0]->interp, &finfo) == 0) {
+        for (interp = 0; interp < scope->n; ++interp)
+            if (scope->nodes[interp]->record->st_dev == finfo.st_dev &&
+                scope->nodes[interp]->record->st_ino == finfo.st_ino)
+                break;
+    }
+
+    size_t num_unused = 0;
+    for (size_t k = 0; k < scope->n; ++k) {
+        struct elf_symbols_t const *t = scope->tables[k];
+        size_t begin = scope->first_dep[k];
+        size_t end = scope->first_dep[k + 1];
+        if (t == NULL || t->invalid || begin == end)
+            continue;
+
+        // Libraries whose symbols we can't tell are used.
+        size_t left = 0;
+        for (size_t j = begin; j < end; ++j) {
+            struct elf_symbols_t const *d = scope->tables[scope->deps[j]];
+            unused[j] = d != NULL && !d->invalid && scope->deps[j] != interp;
+            left += unused[j];
+        }
+
+        for (size_t i = 1; i < t->num_syms && left > 0; ++i) {
+            int weak;
+            char const *version;
+            char const *name = elf_symbols_undefined(t, i, &weak, &version);
+            if (name == NULL)
+                continue;
+            uint32_t gnu_h = gnu_hash(name);
+            uint32_t sysv_h = sysv_hash(name);
+            for (size_t j = begin; j < end; ++j) {
+                if (unused[j] &&
+                    elf_symbols_find(scope->tables[scope->deps[j]], name,
+                                     gnu_h, sysv_h, version)) {
+                    unused[j] = 0;
+                    --left;
+                }
+            }
+        }
+        num_unused += left;
+    }
+
+    if (num_unused > 0) {
+        size_t *queue = malloc(scope->n * sizeof(size_t));
+        char *reached = malloc(scope->n);
+        char *skip = calloc(scope->num_deps + 1, 1);
+        if (queue == NULL || reached == NULL || skip == NULL)
+            exit(1);
+
+        size_t all_files;
+        uint64_t all_bytes;
+        scope_reach(scope, skip, interp, queue, reached, &all_files,
+                    &all_bytes);
+
+        for (size_t k = 0; k < scope->n; ++k) {
+            for (size_t j = scope->first_dep[k]; j < scope->first_dep[k + 1];
+                 ++j) {
+                if (!unused[j])
+                    continue;
+                size_t files;
+                uint64_t bytes;
+                skip[j] = 1;
+                scope_reach(scope, skip, interp, queue, reached, &files,
+                            &bytes);
+                skip[j] = 0;
+                struct dag_node_t const *dep = scope->nodes[scope->deps[j]];
+                char const *soname =
+                    dep->record->soname == MAX_OFFSET_T
+                        ? dep->path
+                        : dep->record->strtab + dep->record->soname;
+                unused_report(err, scope->nodes[k]->path, ": unused ", soname,
+                              all_files - files, all_bytes - bytes, " less");
+            }
+        }
+
+        size_t files;
+        uint64_t bytes;
+        scope_reach(scope, unused, interp, queue, reached, &files, &bytes);
+        unused_report(err, scope->nodes[0]->path, ": ",
+                      "without the unused libraries", all_files - files,
+                      all_bytes - bytes, " less in total");
+
+        free(queue);
+        free(reached);
+        free(skip);
+    }
+
+    free(unused);
+}
+
+// A file of the scope in the --cost table.
+struct cost_row_t {
+    char const *path;
+    struct elf_symbols_t const *t;
+};
+
+// The relocations that need a symbol lookup, most of the work of relocating.
+static uint64_t cost_lookups(struct load_cost_t const *c) {
+    uint64_t relative = c->relative < c->relocs ? c->relative : c->relocs;
+    return c->relocs - relative + c->plt_relocs;
+}
+
+// Most symbol lookups first, then most memory.
+static int cost_row_compare(void const *a, void const *b) {
+    struct cost_row_t const *x = (struct cost_row_t const *)a;
+    struct cost_row_t const *y = (struct cost_row_t const *)b;
+    uint64_t x_lookups = cost_lookups(&x->t->cost);
+    uint64_t y_lookups = cost_lookups(&y->t->cost);
+    if (x_lookups != y_lookups)
+        return x_lookups < y_lookups ? 1 : -1;
+    if (x->t->cost.mem_size != y->t->cost.mem_size)
+        return x->t->cost.mem_size < y->t->cost.mem_size ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+// Right align `str` in a column of `width`.
+static void cost_column(FILE *err, char const *str, size_t width) {
+    for (size_t n = strlen(str); n < width; ++n)
+        fputc(' ', err);
+    fputs(str, err);
+    fputc(' ', err);
+}
+
+static void cost_row(FILE *err, struct load_cost_t const *c, size_t num_syms,
+                     char const *hash, char const *bind, char const *path) {
+    uint64_t values[] = {c->relocs,    c->relative,  c->plt_relocs,
+                         num_syms,     c->file_size, c->mem_size,
+                         c->tls_size};
+    char num[32];
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        utoa(num, values[i]);
+        cost_column(err, num, 9);
+    }
+    cost_column(err, hash, 4);
+    cost_column(err, bind, 4);
+    fputs(path, err);
+    fputc('\n', err);
+}
+
+// Print what it takes the dynamic loader to map and relocate every file of
+// the scope, the files with the most symbol lookups first, and the total.
+static void cost_report(struct scope_t const *scope, FILE *err) {
+    struct cost_row_t *rows = malloc(scope->n * sizeof(struct cost_row_t));
+    if (rows == NULL)
+        exit(1);
+    size_t num_rows = 0;
+    struct load_cost_t total;
+    memset(&total, 0, sizeof(total));
+    size_t total_syms = 0;
+    for (size_t k = 0; k < scope->n; ++k) {
+        struct elf_symbols_t const *t = scope->tables[k];
+        if (t == NULL)
+            continue;
+        rows[num_rows].path = scope->nodes[k]->path;
+        rows[num_rows++].t = t;
+        total.file_size += t->cost.file_size;
+        total.mem_size += t->cost.mem_size;
+        total.tls_size += t->cost.tls_size;
+        total.relocs += t->cost.relocs;
+        total.relative += t->cost.relative;
+        total.plt_relocs += t->cost.plt_relocs;
+        total_syms += t->num_syms;
+    }
+    qsort(rows, num_rows, sizeof(struct cost_row_t), cost_row_compare);
+
+    char num[32];
+    fputs(scope->nodes[0]->path, err);
+    fputs(": startup cost of ", err);
+    utoa(num, num_rows);
+    fputs(num, err);
+    fputs(num_rows == 1 ? " file\n" : " files\n", err);
+    char const *header[] = {"relocs", "relative", "plt",   "symbols",
+                            "file",   "memory",   "tls"};
+    for (size_t i = 0; i < sizeof(header) / sizeof(header[0]); ++i)
+        cost_column(err, header[i], 9);
+    cost_column(err, "hash", 4);
+    cost_column(err, "bind", 4);
+    fputs("path\n", err);
+    for (size_t i = 0; i < num_rows; ++i) {
+        struct load_cost_t const *c = &rows[i].t->cost;
+        char const *hash = c->has_gnu_hash ? "gnu" : c->has_hash ? "sysv" : "-";
+        cost_row(err, c, rows[i].t->num_syms, hash,
+                 c->bind_now ? "now" : "lazy", rows[i].path);
+    }
+    cost_row(err, &total, total_syms, "", "", "total");
+    free(rows);
+}
+
+// A library located in the d-th entry of a search path.
+struct search_hit_t {
+    struct soname_t const *soname;
+    size_t d;
+};
+
+// An RPATH or RUNPATH of the scope, the libraries its entries locate, and
+// the first of the files that have it, for --probes.
+struct search_use_t {
+    struct search_path_t const *path;
+    how_t how;
+    struct dag_node_t const *owner;
+    size_t num_owners;
+    // The number of libraries located per entry.
+    size_t *counts;
+    struct search_hit_t *hits;
+    size_t num_hits;
+    size_t hits_capacity;
+    // The entries that locate libraries, in the suggested order.
+    size_t *order;
+    size_t num_order;
+};
+
+// The failed probes of the dynamic loader in a scope, for --probes.
+struct probe_count_t {
+    struct search_use_t *uses;
+    size_t num_uses;
+    size_t uses_capacity;
+    // Directories that do not exist, which the loader probes only once.
+    struct search_dir_t const **missing;
+    size_t num_missing;
+    size_t missing_capacity;
+    // Skip the entries of the RPATHs and RUNPATHs that locate nothing.
+    int suggested;
+};
+
+static struct search_use_t *search_use_get(struct probe_count_t *p,
+                                           struct search_path_t const *path,
+                                           how_t how) {
+    for (size_t i = 0; i < p->num_uses; ++i)
+        if (p->uses[i].path == path && p->uses[i].how == how)
+            return &p->uses[i];
+    if (p->num_uses == p->uses_capacity) {
+        p->uses_capacity = p->uses_capacity == 0 ? 16 : 2 * p->uses_capacity;
+        p->uses =
+            realloc(p->uses, p->uses_capacity * sizeof(struct search_use_t));
+        if (p->uses == NULL)
+            exit(1);
     }
+    struct search_use_t *use = &p->uses[p->num_uses++];
+    use->path = path;
+    use->how = how;
+    use->owner = NULL;
+    use->num_owners = 0;
+    use->counts = calloc(path->n + 1, sizeof(size_t));
+    use->order = malloc((path->n + 1) * sizeof(size_t));
+    if (use->counts == NULL || use->order == NULL)
+        exit(1);
+    use->hits = NULL;
+    use->num_hits = 0;
+    use->hits_capacity = 0;
+    use->num_order = 0;
+    return use;
+}
 
-    if (e_ident[5] != '\x01' && e_ident[5] != '\x02') {
-        fclose(fptr);
-        return ERR_INVALID_DATA;
+static void search_use_hit(struct search_use_t *use,
+                           struct soname_t const *soname, size_t d) {
+    ++use->counts[d];
+    if (use->num_hits == use->hits_capacity) {
+        use->hits_capacity =
+            use->hits_capacity == 0 ? 16 : 2 * use->hits_capacity;
+        use->hits = realloc(use->hits,
+                            use->hits_capacity * sizeof(struct search_hit_t));
+        if (use->hits == NULL)
+            exit(1);
+    }
+    use->hits[use->num_hits].soname = soname;
+    use->hits[use->num_hits++].d = d;
+}
+
+static size_t probe_missing_slot(struct probe_count_t const *p,
+                                 struct search_dir_t const *dir) {
+    size_t mask = p->missing_capacity - 1;
+    size_t i = dir->hash & mask;
+    while (p->missing[i] != NULL) {
+        if (p->missing[i]->len == dir->len &&
+            memcmp(p->missing[i]->path, dir->path, dir->len) == 0)
+            return i;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Whether the loader still has to find out that `dir` does not exist.
+static int probe_missing_dir(struct probe_count_t *p,
+                             struct search_dir_t const *dir) {
+    size_t i = probe_missing_slot(p, dir);
+    if (p->missing[i] != NULL)
+        return 0;
+
+    // Keep the load factor below 1/2.
+    if (2 * (p->num_missing + 1) > p->missing_capacity) {
+        struct search_dir_t const **old = p->missing;
+        size_t old_capacity = p->missing_capacity;
+        p->missing_capacity *= 2;
+        p->missing =
+            calloc(p->missing_capacity, sizeof(struct search_dir_t const *));
+        if (p->missing == NULL)
+            exit(1);
+        for (size_t j = 0; j < old_capacity; ++j)
+            if (old[j] != NULL)
+                p->missing[probe_missing_slot(p, old[j])] = old[j];
+        free(old);
+        i = probe_missing_slot(p, dir);
+    }
+    p->missing[i] = dir;
+    ++p->num_missing;
+    return 1;
+}
+
+// The failed probes for `soname` in `path`. The loader stops at `hit`, the
+// path where the library was located, and sets `*found` then.
+static size_t probe_search_path(struct probe_count_t *p,
+                                struct search_path_t const *path,
+                                struct search_use_t *use,
+                                struct soname_t const *soname,
+                                char const *hit, int *found,
+                                struct libtree_state_t *s) {
+    int suggested = p->suggested && use != NULL;
+    size_t n = suggested ? use->num_order : path->n;
+    size_t failed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t d = suggested ? use->order[i] : i;
+        struct search_dir_t const *dir = &path->dirs[d];
+        if (hit != NULL && strncmp(hit, dir->path, dir->len) == 0 &&
+            strcmp(hit + dir->len, soname->name) == 0) {
+            if (use != NULL && !p->suggested)
+                search_use_hit(use, soname, d);
+            *found = 1;
+            return failed;
+        }
+        // Paths too long are not probed.
+        if (dir->len + soname->len + 1 >= MAX_PATH_LENGTH)
+            continue;
+        struct dir_listing_t const *listing =
+            dir_cache_get(s->dirs, s->arena, dir, &s->stats);
+        if (!listing->listed || listing->has_stat ||
+            probe_missing_dir(p, dir))
+            ++failed;
+    }
+    return failed;
+}
+
+// The failed probes of the loader for the DT_NEEDED entry `soname` of `node`,
+// located through `edge`, or not at all when it is NULL. Directories of
+// ld.so.conf are looked up in ld.so.cache, which takes no probes.
+static size_t probe_needed(struct probe_count_t *p,
+                           struct dag_node_t const *node,
+                           struct soname_t const *soname,
+                           struct dag_edge_t const *edge,
+                           struct libtree_state_t *s) {
+    how_t how = edge == NULL ? DEFAULT : edge->reason.how;
+    char const *hit = edge == NULL ? NULL : edge->node->path;
+    if (how == DIRECT)
+        return 0;
+
+    int found = 0;
+    size_t failed = 0;
+    if (node->runpath == NULL) {
+        size_t up = node->rpaths_up;
+        for (struct rpath_chain_t const *c = node->rpaths; c != NULL && !found;
+             up += c->up, c = c->parent) {
+            int here = how == RPATH && edge->reason.up == up;
+            failed += probe_search_path(p, c->rpath,
+                                        search_use_get(p, c->rpath, RPATH),
+                                        soname, here ? hit : NULL, &found, s);
+        }
+    }
+    if (!found && s->ld_library_path != NULL)
+        failed += probe_search_path(p, s->ld_library_path, NULL, soname,
+                                    how == LD_LIBRARY_PATH ? hit : NULL,
+                                    &found, s);
+    if (!found && node->runpath != NULL)
+        failed += probe_search_path(
+            p, node->runpath, search_use_get(p, node->runpath, RUNPATH),
+            soname, how == RUNPATH ? hit : NULL, &found, s);
+    if (!found && how == DEFAULT && !node->no_def_lib)
+        failed += probe_search_path(p, s->default_paths, NULL, soname, hit,
+                                    &found, s);
+    return failed;
+}
+
+// The failed probes for all DT_NEEDED entries of the scope, in the order in
+// which the loader locates them. With `err`, report those of every entry.
+static size_t probe_scope(struct probe_count_t *p,
+                          struct scope_t const *scope, FILE *err,
+                          struct libtree_state_t *s) {
+    memset(p->missing, 0,
+           p->missing_capacity * sizeof(struct search_dir_t const *));
+    p->num_missing = 0;
+    size_t total = 0;
+    char num[32];
+    for (size_t k = 0; k < scope->n; ++k) {
+        struct dag_node_t const *node = scope->nodes[k];
+        struct elf_record_t const *r = node->record;
+        if (!node->resolved || r->sonames == NULL)
+            continue;
+        for (size_t i = 0; i < r->num_needed; ++i) {
+            struct soname_t const *soname = r->sonames[i];
+            struct dag_edge_t const *edge = NULL;
+            for (size_t j = 0; j < node->num_edges && edge == NULL; ++j)
+                if (strcmp(node->edges[j].soname, soname->name) == 0)
+                    edge = &node->edges[j];
+            size_t failed = probe_needed(p, node, soname, edge, s);
+            total += failed;
+            if (err == NULL || failed == 0)
+                continue;
+            fputs(node->path, err);
+            fputs(": ", err);
+            fputs(soname->name, err);
+            fputs(edge == NULL ? " not found after " : " found after ", err);
+            utoa(num, failed);
+            fputs(num, err);
+            fputs(failed == 1 ? " failed probe\n" : " failed probes\n", err);
+        }
+    }
+    return total;
+}
+
+static void search_use_prefix(struct search_use_t const *use, FILE *err) {
+    fputs(use->owner->path, err);
+    if (use->num_owners > 1) {
+        char num[32];
+        utoa(num, use->num_owners - 1);
+        fputs(" and ", err);
+        fputs(num, err);
+        fputs(use->num_owners == 2 ? " other file" : " other files", err);
+    }
+    fputs(use->how == RPATH ? ": RPATH" : ": RUNPATH", err);
+}
+
+// Print the d-th entry as it is in the file, unless empty entries or
+// entries too long to use make that ambiguous.
+static void search_use_entry(struct search_use_t const *use, size_t d,
+                             FILE *err) {
+    struct elf_record_t const *r = use->owner->record;
+    char const *raw =
+        r->strtab + (use->how == RPATH ? r->rpath : r->runpath);
+    size_t n = 0;
+    char const *entry = NULL;
+    size_t len = 0;
+    for (char const *curr = raw; *curr != '\0';) {
+        size_t l = strcspn(curr, ":");
+        if (l > 0 && n++ == d) {
+            entry = curr;
+            len = l;
+        }
+        curr += curr[l] == ':' ? l + 1 : l;
+    }
+    if (n == use->path->n)
+        fwrite(entry, 1, len, err);
+    else
+        fputs(use->path->dirs[d].path, err);
+}
+
+// Order the entries that locate libraries by how many they locate, when
+// that locates the same libraries: none of them may be in an entry that moves
+// before the one where it was located. Keep the order otherwise.
+static void search_use_suggest(struct search_use_t *use,
+                               struct libtree_state_t *s) {
+    use->num_order = 0;
+    for (size_t d = 0; d < use->path->n; ++d)
+        if (use->counts[d] > 0)
+            use->order[use->num_order++] = d;
+
+    size_t *order = malloc((use->num_order + 1) * sizeof(size_t));
+    size_t *position = malloc((use->path->n + 1) * sizeof(size_t));
+    if (order == NULL || position == NULL)
+        exit(1);
+    for (size_t i = 0; i < use->num_order; ++i) {
+        size_t j = i;
+        for (; j > 0 && use->counts[order[j - 1]] < use->counts[use->order[i]];
+             --j)
+            order[j] = order[j - 1];
+        order[j] = use->order[i];
+    }
+    for (size_t i = 0; i < use->num_order; ++i)
+        position[order[i]] = i;
+
+    int same = 1;
+    for (size_t h = 0; h < use->num_hits && same; ++h) {
+        struct search_hit_t const *hit = &use->hits[h];
+        for (size_t i = 0; i < position[hit->d] && same; ++i)
+            same = order[i] < hit->d ||
+                   !dir_cache_may_contain(s->dirs, s->arena,
+                                          &use->path->dirs[order[i]],
+                                          hit->soname, NULL, &s->stats);
+    }
+    if (same)
+        memcpy(use->order, order, use->num_order * sizeof(size_t));
+    free(order);
+    free(position);
+}
+
+// Report the entries of an RPATH or RUNPATH that do not exist or locate no
+// library, and the suggested search path.
+static void search_use_report(struct search_use_t const *use,
+                              struct libtree_state_t *s, FILE *err) {
+    int reordered = 0;
+    for (size_t i = 1; i < use->num_order; ++i)
+        reordered |= use->order[i] < use->order[i - 1];
+    for (size_t d = 0; d < use->path->n; ++d) {
+        if (use->counts[d] > 0)
+            continue;
+        struct dir_listing_t const *listing =
+            dir_cache_get(s->dirs, s->arena, &use->path->dirs[d], &s->stats);
+        search_use_prefix(use, err);
+        fputs(" entry ", err);
+        search_use_entry(use, d, err);
+        fputs(listing->listed && !listing->has_stat ? " does not exist\n"
+                                                    : " is not used\n",
+              err);
+    }
+    if (use->num_order == use->path->n && !reordered)
+        return;
+    search_use_prefix(use, err);
+    if (use->num_order == 0) {
+        fputs(" is not needed\n", err);
+        return;
+    }
+    fputs(" suggested: ", err);
+    for (size_t i = 0; i < use->num_order; ++i) {
+        if (i > 0)
+            fputc(':', err);
+        search_use_entry(use, use->order[i], err);
+    }
+    fputc('\n', err);
+}
+
+// Report how many probes the dynamic loader makes that find nothing, before
+// every library it locates and for every library it does not, the entries
+// of the RPATHs and RUNPATHs that do not exist or locate nothing, search
+// paths without them, and how many probes those would take.
+static void probe_report(struct scope_t const *scope,
+                         struct libtree_state_t *s, FILE *err) {
+    struct probe_count_t p;
+    memset(&p, 0, sizeof(p));
+
+    // Every file of the scope owns its search paths, shared ones are
+    // reported once.
+    for (size_t k = 0; k < scope->n; ++k) {
+        struct dag_node_t const *node = scope->nodes[k];
+        struct search_path_t const *own[] = {
+            node->rpaths == NULL || node->rpaths_up != 0 ? NULL
+                                                         : node->rpaths->rpath,
+            node->runpath};
+        for (size_t i = 0; i < 2; ++i) {
+            if (own[i] == NULL)
+                continue;
+            struct search_use_t *use =
+                search_use_get(&p, own[i], i == 0 ? RPATH : RUNPATH);
+            if (use->owner == NULL)
+                use->owner = node;
+            ++use->num_owners;
+        }
+    }
+    p.missing_capacity = 64;
+    p.missing = calloc(p.missing_capacity, sizeof(struct search_dir_t const *));
+    if (p.missing == NULL)
+        exit(1);
+
+    size_t failed = probe_scope(&p, scope, err, s);
+    for (size_t i = 0; i < p.num_uses; ++i) {
+        search_use_suggest(&p.uses[i], s);
+        if (p.uses[i].owner != NULL)
+            search_use_report(&p.uses[i], s, err);
+    }
+    p.suggested = 1;
+    size_t suggested = probe_scope(&p, scope, NULL, s);
+
+    char num[32];
+    fputs(scope->nodes[0]->path, err);
+    fputs(": ", err);
+    utoa(num, failed);
+    fputs(num, err);
+    fputs(failed == 1 ? " failed probe" : " failed probes", err);
+    fputs(" in total, ", err);
+    utoa(num, suggested);
+    fputs(num, err);
+    fputs(" with the suggested search paths\n", err);
+
+    for (size_t i = 0; i < p.num_uses; ++i) {
+        free(p.uses[i].counts);
+        free(p.uses[i].hits);
+        free(p.uses[i].order);
+    }
+    free(p.uses);
+    free(p.missing);
+}
+
+// With --symbols check that `root` would link, with --unused report its
+// libraries and those of its libraries that are not needed for symbols, with
+// --cost what it takes to load them, and with --probes what it takes to
+// locate them. All follow the dynamic loader, and write to `err`. Only
+// --probes reports anything when not all libraries were located.
+static int symbols_check(struct dag_node_t *root, struct libtree_state_t *s,
+                         int complete, FILE *err) {
+    if (!root->record->has_dynamic)
+        return 0;
+
+    struct scope_t scope;
+    scope_init(&scope, root, s);
+    int code = s->symbols && complete ? symbols_undefined(&scope, s, err) : 0;
+    if (s->unused && complete)
+        symbols_unused(&scope, err);
+    if (s->cost && complete)
+        cost_report(&scope, err);
+    if (s->probes)
+        probe_report(&scope, s, err);
+    scope_free(&scope);
+    return code;
+}
+
+// Print the dependency tree of an input file to `out`, or only resolve it
+// when `out` is NULL. With --symbols, --unused, --cost and --probes, what
+// symbols_check() reports goes to `err`.
+static int print_root(char const *path, struct libtree_state_t *s, FILE *out,
+                      FILE *err) {
+    struct tree_printer_t p;
+    p.out = out;
+    p.input = path;
+    p.need_comma = 0;
+    p.stack = NULL;
+    p.depth = 0;
+    p.capacity = 0;
+    p.exit_code = 0;
+
+    struct dag_node_t *node;
+    int code = dag_root(path, s, &node);
+    if (code == 0) {
+        int pushed;
+        code = print_node(node, NULL, NULL, (struct found_t){.how = INPUT}, s,
+                          &p, &pushed);
+        if (pushed) {
+            while (print_step(s, &p))
+                ;
+            code = p.exit_code;
+        }
+        // Symbols are only bound when all libraries are there, while the
+        // loader also probes for those that are not.
+        int complete = code == 0;
+        if ((complete && (s->symbols || s->unused || s->cost)) ||
+            ((complete || code == ERR_DEPENDENCY_NOT_FOUND) && s->probes)) {
+            fflush(out);
+            int check = symbols_check(node, s, complete, err);
+            if (complete)
+                code = check;
+        }
+    }
+    free(p.stack);
+
+    // Errors other than missing libraries happen before anything is printed.
+    if (code != 0 && code != ERR_DEPENDENCY_NOT_FOUND)
+        output_error(code, s, &p);
+
+    return code;
+}
+#endif
+
+static int parse_ld_config_file(struct string_table_t *st, char *path,
+                                struct ld_conf_newest_t *newest);
+
+static int ld_conf_globbing(struct string_table_t *st, char *pattern,
+                            struct ld_conf_newest_t *newest) {
+    glob_t result;
+    memset(&result, 0, sizeof(result));
+    int status = glob(pattern, 0, NULL, &result);
+
+    // Handle errors (no result is not an error...)
+    switch (status) {
+    case GLOB_NOSPACE:
+    case GLOB_ABORTED:
+        globfree(&result);
+        return 1;
+    case GLOB_NOMATCH:
+        globfree(&result);
+        return 0;
+    }
+
+    // Otherwise parse the files we've found!
+    int code = 0;
+    for (size_t i = 0; i < result.gl_pathc; ++i)
+        code |= parse_ld_config_file(st, result.gl_pathv[i], newest);
+
+    globfree(&result);
+    return code;
+}
+
+static int parse_ld_config_file(struct string_table_t *st, char *path,
+                                struct ld_conf_newest_t *newest) {
+    FILE *fptr = fopen(path, "r");
+
+    if (fptr == NULL)
+        return 1;
+
+    struct stat finfo;
+    if (stat(path, &finfo) == 0 && finfo.st_mtime > newest->mtime &&
+        strlen(path) < MAX_PATH_LENGTH) {
+        newest->mtime = finfo.st_mtime;
+        strcpy(newest->path, path);
+    }
+
+    int c = 0;
+    char line[MAX_PATH_LENGTH];
+    char tmp[MAX_PATH_LENGTH];
+
+    while (c != EOF) {
+        size_t line_len = 0;
+        while ((c = getc(fptr)) != '\n' && c != EOF) {
+            if (line_len < MAX_PATH_LENGTH - 1) {
+                line[line_len++] = c;
+            }
+        }
+
+        line[line_len] = '\0';
+
+        char *begin = line;
+        char *end = line + line_len;
+        // Remove leading whitespace
+        for (; isspace(*begin); ++begin) {
+        }
+
+        // Remove trailing comments
+        char *comment = strchr(begin, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        // Remove trailing whitespace
+        while (end != begin)
+            if (!isspace(*--end))
+                break;
+
+        // Skip empty lines
+        if (begin == end)
+            continue;
+
+        // Put back the end of the string
+        end[1] = '\0';
+
+        // 'include ': glob whatever follows.
+        if (strncmp(begin, "include", 7) == 0 && isspace(begin[7])) {
+            begin += 8;
+            // Remove more whitespace.
+            while (isspace(*begin))
+                ++begin;
+
+            // Prepend current dir when include dir is relative.
+            if (*begin != '/') {
+                char *wd = strrchr(path, '/');
+                wd = wd == NULL ? strrchr(path, '\0') : wd;
+
+                // bytes until /
+                size_t wd_len = wd - path;
+                size_t include_len = end - begin + 1;
+
+                // just skip then.
+                if (wd_len + 1 + include_len >= MAX_PATH_LENGTH)
+                    continue;
+
+                memcpy(tmp, path, wd_len);
+                tmp[wd_len] = '/';
+                memcpy(tmp + wd_len + 1, begin, include_len);
+                tmp[wd_len + 1 + include_len] = '\0';
+                begin = tmp;
+            }
+
+            ld_conf_globbing(st, begin, newest);
+        } else {
+            // Copy over and replace trailing \0 with :.
+            string_table_store(st, begin);
+            st->arr[st->n - 1] = ':';
+        }
+    }
+
+    fclose(fptr);
+
+    return 0;
+}
+
+static void parse_ld_so_conf(struct libtree_state_t *s,
+                             struct ld_conf_newest_t *newest) {
+    struct string_table_t *st = &s->string_table;
+    s->ld_so_conf_offset = st->n;
+
+    // Linux / glibc
+    newest->mtime = 0;
+    newest->path[0] = '\0';
+    parse_ld_config_file(st, s->ld_conf_file, newest);
+
+    // Replace the last semicolon with a '\0'
+    // if we have a nonzero number of paths.
+    if (st->n > s->ld_so_conf_offset) {
+        st->arr[st->n - 1] = '\0';
+    } else {
+        string_table_store(st, "");
+    }
+}
+
+static void load_ld_cache(struct libtree_state_t *s,
+                          struct ld_conf_newest_t const *newest) {
+    time_t mtime;
+    if (ld_cache_load(&s->ld_cache, s->ld_cache_file, &mtime) != 0) {
+        fputs("Warning [", stderr);
+        fputs(s->ld_cache_file, stderr);
+        fputs("]: Could not read ld.so.cache, using ld config files instead\n",
+              stderr);
+        s->ld_cache_file = NULL;
+        return;
+    }
+
+    // ldconfig writes the cache after reading the config files, so the cache
+    // is stale when a config file was modified later.
+    if (newest->mtime > mtime) {
+        fputs("Warning [", stderr);
+        fputs(s->ld_cache_file, stderr);
+        fputs("]: Older than ", stderr);
+        fputs(newest->path, stderr);
+        fputs(", run ldconfig to update it\n", stderr);
+    }
+}
+
+static void parse_ld_library_path(struct libtree_state_t *s) {
+    s->ld_library_path_offset = SIZE_MAX;
+    char *val = s->ld_library_path_env;
+
+    // not set, so nothing to do.
+    if (val == NULL)
+        return;
+
+    s->ld_library_path_offset = s->string_table.n;
+
+    // otherwise, we just copy it over and replace ; with :
+    string_table_store(&s->string_table, val);
+
+    // replace ; with :
+    char *search = s->string_table.arr + s->ld_library_path_offset;
+    while ((search = strchr(search, ';')) != NULL)
+        *search++ = ':';
+}
+
+static void set_default_paths(struct libtree_state_t *s) {
+    s->default_paths_offset = s->string_table.n;
+    // TODO: how to retrieve this list properly at runtime?
+    string_table_store(&s->string_table, "/lib:/lib64:/usr/lib:/usr/lib64");
+}
+
+// The string table does not grow after this, so we can point into it.
+static void split_search_paths(struct libtree_state_t *s) {
+    char const *st = s->string_table.arr;
+    s->ld_library_path =
+        s->ld_library_path_offset == SIZE_MAX
+            ? NULL
+            : search_path_parse(s->arena, st + s->ld_library_path_offset);
+    s->ld_so_conf = search_path_parse(s->arena, st + s->ld_so_conf_offset);
+    s->default_paths = search_path_parse(s->arena, st + s->default_paths_offset);
+}
+
+static void libtree_state_init(struct libtree_state_t *s) {
+    s->string_table.n = 0;
+    s->string_table.capacity = 1024;
+    s->string_table.arr = malloc(s->string_table.capacity * sizeof(char));
+    s->scratch.n = 0;
+    s->scratch.capacity = 1024;
+    s->scratch.arr = malloc(s->scratch.capacity * sizeof(char));
+    memset(&s->ld_cache, 0, sizeof(s->ld_cache));
+    visited_files_init(&s->visited);
+    s->cache = malloc(sizeof(struct elf_cache_t));
+    s->dirs = malloc(sizeof(struct dir_cache_t));
+    s->dag = malloc(sizeof(struct dag_t));
+    if (s->cache == NULL || s->dirs == NULL || s->dag == NULL)
+        exit(1);
+    elf_cache_init(s->cache);
+    dir_cache_init(s->dirs);
+    s->arena = &s->cache->arena;
+    dag_init(s->dag);
+    memset(&s->disk, 0, sizeof(s->disk));
+    s->tree = 1;
+    s->num_refs = 0;
+    s->missing = NULL;
+    s->input = 0;
+    s->ring = NULL;
+    s->ring_tried = 0;
+    memset(&s->stats, 0, sizeof(s->stats));
+    memset(s->phase_us, 0, sizeof(s->phase_us));
+}
+
+static void libtree_state_free(struct libtree_state_t *s) {
+    free(s->string_table.arr);
+    free(s->scratch.arr);
+    ld_cache_free(&s->ld_cache);
+    // Listings are allocated in the arena of the ELF cache.
+    dir_cache_free(s->dirs);
+    elf_cache_free(s->cache);
+    free(s->cache);
+    free(s->dirs);
+    visited_files_free(&s->visited);
+    dag_free(s->dag);
+    free(s->dag);
+    disk_cache_close(&s->disk);
+    probe_ring_free(s->ring);
+}
+
+// Remember the parsed files and directory listings for the next run.
+static void libtree_state_save(struct libtree_state_t *s) {
+    if (s->cache_file != NULL)
+        disk_cache_save(&s->disk, s->cache, s->dirs, s->cache_file);
+}
+
+#ifndef LIBTREE_LIBRARY
+// Print the error message for the exit code of an input file.
+static void report_error(char const *path, int code) {
+    char const *msg = error_message(code);
+    if (msg != NULL) {
+        fputs("Error [", stderr);
+        fputs(path, stderr);
+        fputs("]: ", stderr);
+        fputs(msg, stderr);
+        fputc('\n', stderr);
     }
 
-    struct compat_t curr_type = {.any = 0, .class = e_ident[4]};
-    int is_little_endian = e_ident[5] == '\x01';
+    fflush(stderr);
+}
+
+// Inputs are handed out to worker threads one at a time.
+// A node whose dependencies should be located, reached at `depth`.
+struct warm_up_task_t {
+    struct dag_node_t *node;
+    size_t depth;
+};
+
+struct warm_up_t {
+    // Guards the shared caches and graph.
+    pthread_mutex_t lock;
+    pthread_cond_t parsed;
+
+    // Guards the rest, `cond` is signaled when there is work or when all
+    // work is done.
+    pthread_mutex_t pool;
+    pthread_cond_t cond;
+
+    // Nodes whose dependencies should be located. A stack, so that the graph
+    // is walked roughly in the order in which it is printed.
+    struct warm_up_task_t *tasks;
+    size_t num_tasks;
+    size_t capacity;
+
+    // Input files that were not started yet.
+    int next;
+    int pathc;
+    char **pathv;
 
-    // Make sure that we have matching bits with parent
-    if (!compat.any && compat.class != curr_type.class) {
-        fclose(fptr);
-        return ERR_INVALID_BITS;
-    }
+    // The number of threads that are working on a task, which may queue
+    // more tasks.
+    long busy;
 
-    // Make sure that the elf file has a the host's endianness
-    // Byte swapping is on the TODO list
-    if (is_little_endian ^ host_is_little_endian()) {
-        fclose(fptr);
-        return ERR_INVALID_ENDIANNESS;
-    }
+    // Files whose dependencies were queued. The tree shows the dependencies
+    // of a file once, except with -vvv.
+    struct visited_file_set_t expanded;
 
-    // And get the type
-    union {
-        struct header_64_t h64;
-        struct header_32_t h32;
-    } header;
+    // Where the threads add their counts when they are done.
+    struct stats_t *stats;
 
-    // Read the (rest of the) elf header
-    if (curr_type.class == BITS64) {
-        if (fread(&header.h64, sizeof(struct header_64_t), 1, fptr) != 1) {
-            fclose(fptr);
-            return ERR_INVALID_HEADER;
-        }
-        if (header.h64.e_type != ET_EXEC && header.h64.e_type != ET_DYN) {
-            fclose(fptr);
-            return ERR_NO_EXEC_OR_DYN;
-        }
-        curr_type.machine = header.h64.e_machine;
-        if (!compat.any && compat.machine != curr_type.machine) {
-            fclose(fptr);
-            return ERR_INCOMPATIBLE_ISA;
-        }
-        if (fseek(fptr, header.h64.e_phoff, SEEK_SET) != 0) {
-            fclose(fptr);
-            return ERR_INVALID_PHOFF;
-        }
-    } else {
-        if (fread(&header.h32, sizeof(struct header_32_t), 1, fptr) != 1) {
-            fclose(fptr);
-            return ERR_INVALID_HEADER;
-        }
-        if (header.h32.e_type != ET_EXEC && header.h32.e_type != ET_DYN) {
-            fclose(fptr);
-            return ERR_NO_EXEC_OR_DYN;
-        }
-        curr_type.machine = header.h32.e_machine;
-        if (!compat.any && compat.machine != curr_type.machine) {
-            fclose(fptr);
-            return ERR_INCOMPATIBLE_ISA;
-        }
-        if (fseek(fptr, header.h32.e_phoff, SEEK_SET) != 0) {
-            fclose(fptr);
-            return ERR_INVALID_PHOFF;
-        }
-    }
+    struct libtree_state_t const *s;
+};
 
-    // Make sure it's an executable or library
-    union {
-        struct prog_64_t p64;
-        struct prog_32_t p32;
-    } prog;
+// Queue the dependencies of `node` at `depth` to be located, if the tree will
+// show them. A node is only queued once, so when it is reached higher up later
+// on, printing locates what is left.
+static void warm_up_push(struct warm_up_t *w, struct dag_node_t *node,
+                         size_t depth) {
+    struct libtree_state_t const *s = w->s;
+    struct elf_record_t const *r = node->record;
+    if (!r->has_dynamic || r->dynamic_error != 0 || r->needed_error != 0 ||
+        depth >= s->max_depth)
+        return;
 
-    // map vaddr to file offset (we don't mmap the file, but directly seek in
-    // the file which means that we have to translate vaddr to file offset)
-    struct small_vec_u64_t pt_load_offset;
-    struct small_vec_u64_t pt_load_vaddr;
+    char const *own_soname =
+        r->soname == MAX_OFFSET_T ? NULL : r->strtab + r->soname;
+    if (s->verbosity < 2 && own_soname != NULL &&
+        is_in_exclude_list(own_soname))
+        return;
 
-    small_vec_u64_init(&pt_load_offset);
-    small_vec_u64_init(&pt_load_vaddr);
+    pthread_mutex_lock(&w->pool);
+    if (!node->queued &&
+        (s->verbosity >= 3 ||
+         !visited_files_contains(&w->expanded, r->st_dev, r->st_ino))) {
+        node->queued = 1;
+        if (s->verbosity < 3)
+            visited_files_append(&w->expanded, r->st_dev, r->st_ino);
+        if (w->num_tasks == w->capacity) {
+            w->capacity *= 2;
+            w->tasks = realloc(w->tasks,
+                               w->capacity * sizeof(struct warm_up_task_t));
+            if (w->tasks == NULL)
+                exit(1);
+        }
+        w->tasks[w->num_tasks].node = node;
+        w->tasks[w->num_tasks++].depth = depth;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->pool);
+}
 
-    // Read the program header.
-    uint64_t p_offset = MAX_OFFSET_T;
-    if (curr_type.class == BITS64) {
-        for (uint64_t i = 0; i < header.h64.e_phnum; ++i) {
-            if (fread(&prog.p64, sizeof(struct prog_64_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                return ERR_INVALID_PROG_HEADER;
-            }
+static void *warm_up_worker(void *arg) {
+    struct warm_up_t *w = arg;
+
+    // Share the caches, graph and configuration, but keep our own scratch
+    // space and allocations.
+    struct libtree_state_t s = *w->s;
+    struct arena_t arena = {NULL};
+    s.arena = &arena;
+    s.ring = NULL;
+    s.ring_tried = 0;
+    memset(&s.stats, 0, sizeof(s.stats));
+    s.scratch.n = 0;
+    s.scratch.capacity = 1024;
+    s.scratch.arr = malloc(s.scratch.capacity * sizeof(char));
+    if (s.scratch.arr == NULL)
+        exit(1);
 
-            if (prog.p64.p_type == PT_LOAD) {
-                small_vec_u64_append(&pt_load_offset, prog.p64.p_offset);
-                small_vec_u64_append(&pt_load_vaddr, prog.p64.p_vaddr);
-            } else if (prog.p64.p_type == PT_DYNAMIC) {
-                p_offset = prog.p64.p_offset;
-            }
+    while (1) {
+        pthread_mutex_lock(&w->pool);
+        while (w->num_tasks == 0 && w->next == w->pathc && w->busy > 0)
+            pthread_cond_wait(&w->cond, &w->pool);
+        if (w->num_tasks == 0 && w->next == w->pathc) {
+            pthread_mutex_unlock(&w->pool);
+            break;
         }
-    } else {
-        for (uint32_t i = 0; i < header.h32.e_phnum; ++i) {
-            if (fread(&prog.p32, sizeof(struct prog_32_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                return ERR_INVALID_PROG_HEADER;
-            }
 
-            if (prog.p32.p_type == PT_LOAD) {
-                small_vec_u64_append(&pt_load_offset, prog.p32.p_offset);
-                small_vec_u64_append(&pt_load_vaddr, prog.p32.p_vaddr);
-            } else if (prog.p32.p_type == PT_DYNAMIC) {
-                p_offset = prog.p32.p_offset;
-            }
+        // Finish the inputs that were started before starting new ones.
+        struct dag_node_t *node = NULL;
+        size_t depth = 0;
+        char const *path = NULL;
+        if (w->num_tasks > 0) {
+            --w->num_tasks;
+            node = w->tasks[w->num_tasks].node;
+            depth = w->tasks[w->num_tasks].depth;
+        } else {
+            path = w->pathv[w->next++];
+        }
+        ++w->busy;
+        pthread_mutex_unlock(&w->pool);
+
+        if (node != NULL) {
+            dag_resolve(node, &s);
+            for (size_t i = 0; i < node->num_edges; ++i)
+                if (node->edges[i].node != NULL)
+                    warm_up_push(w, node->edges[i].node, depth + 1);
+        } else if (dag_root(path, &s, &node) == 0) {
+            warm_up_push(w, node, 0);
         }
-    }
 
-    // At this point we're going to store the file as "success"
-    struct stat finfo;
-    if (stat(current_file, &finfo) != 0) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return ERR_CANT_STAT;
+        pthread_mutex_lock(&w->pool);
+        if (--w->busy == 0 && w->num_tasks == 0)
+            pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->pool);
     }
 
-    int seen_before = visited_files_contains(&s->visited, &finfo);
-
-    if (!seen_before)
-        visited_files_append(&s->visited, &finfo);
+    free(s.scratch.arr);
+    probe_ring_free(s.ring);
 
-    // No dynamic section?
-    if (p_offset == MAX_OFFSET_T) {
-        print_line(depth, current_file, BOLD_CYAN, REGULAR_CYAN, 1, reason, s);
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return 0;
-    }
+    // Records, listings and nodes in the shared caches point into our arena.
+    pthread_mutex_lock(&w->lock);
+    arena_merge(&s.cache->arena, &arena);
+    stats_add(w->stats, &s.stats);
+    pthread_mutex_unlock(&w->lock);
 
-    // I guess you always have to load at least a string
-    // table, so if there are not PT_LOAD sections, then
-    // it is an error.
-    if (pt_load_offset.n == 0) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return ERR_NO_PT_LOAD;
-    }
+    return NULL;
+}
 
-    // Go to the dynamic section
-    if (fseek(fptr, p_offset, SEEK_SET) != 0) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return ERR_INVALID_DYNAMIC_SECTION;
-    }
+// Locate the dependencies of the inputs on `s->jobs` threads, where every
+// thread takes the next node of the graph whose dependencies are needed, so
+// that also the subtrees of a single input are resolved in parallel. Each
+// file is parsed and each directory is listed only once. Which libraries are
+// shown as seen before depends on the inputs printed earlier, so printing
+// itself stays in argument order on one thread, which then hardly touches the
+// file system.
+static void warm_up_caches(int pathc, char **pathv, struct libtree_state_t *s) {
+    struct warm_up_t w;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.parsed, NULL);
+    pthread_mutex_init(&w.pool, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    w.num_tasks = 0;
+    w.capacity = 64;
+    w.tasks = malloc(w.capacity * sizeof(struct warm_up_task_t));
+    w.next = 0;
+    w.pathc = pathc;
+    w.pathv = pathv;
+    w.busy = 0;
+    visited_files_init(&w.expanded);
+    w.stats = &s->stats;
+    w.s = s;
+
+    pthread_t *threads = malloc(s->jobs * sizeof(pthread_t));
+    if (w.tasks == NULL || threads == NULL)
+        exit(1);
 
-    // Shared libraries can disable searching in
-    // "default" search paths, aka ld.so.conf and
-    // /usr/lib etc. At least glibc respects this.
-    int no_def_lib = 0;
+    s->cache->lock = &w.lock;
+    s->cache->parsed = &w.parsed;
+    s->dirs->lock = &w.lock;
+    s->dag->lock = &w.lock;
+
+    // If we can't create a thread, the serial pass does its work.
+    long started = 0;
+    while (started < s->jobs &&
+           pthread_create(&threads[started], NULL, warm_up_worker, &w) == 0)
+        ++started;
+
+    for (long i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    s->cache->lock = NULL;
+    s->cache->parsed = NULL;
+    s->dirs->lock = NULL;
+    s->dag->lock = NULL;
+
+    free(threads);
+    free(w.tasks);
+    visited_files_free(&w.expanded);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.parsed);
+    pthread_mutex_destroy(&w.pool);
+    pthread_cond_destroy(&w.cond);
+}
 
-    uint64_t strtab = MAX_OFFSET_T;
-    uint64_t rpath = MAX_OFFSET_T;
-    uint64_t runpath = MAX_OFFSET_T;
-    uint64_t soname = MAX_OFFSET_T;
+// A directory to list or a file to analyze in --scan mode.
+struct scan_item_t {
+    char *path;
+    int is_dir;
+};
 
-    // Offsets in strtab
-    struct small_vec_u64_t needed;
-    small_vec_u64_init(&needed);
+// Work-stealing deque: its worker pushes and pops at the back, depth first,
+// other workers steal from the front, which tends to be higher up the tree.
+struct scan_deque_t {
+    pthread_mutex_t lock;
+    struct scan_item_t *arr;
+    size_t begin;
+    size_t end;
+    size_t capacity;
+};
 
-    for (int cont = 1; cont;) {
-        uint64_t d_tag;
-        uint64_t d_val;
+struct scan_t {
+    struct scan_deque_t *deques;
+    long num_workers;
+
+    // Items pushed but not yet done. When it drops to zero, the scan is over.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending;
+    size_t generation;
+    size_t num_inputs;
+    int exit_code;
+
+    // Serializes writing results to stdout and stderr.
+    pthread_mutex_t output;
+    size_t num_written;
+
+    struct libtree_state_t const *s;
+    // Where the threads add their counts when they are done.
+    struct stats_t *stats;
+};
 
-        if (curr_type.class == BITS64) {
-            struct dyn_64_t dyn;
-            if (fread(&dyn, sizeof(struct dyn_64_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                small_vec_u64_free(&needed);
-                return ERR_INVALID_DYNAMIC_ARRAY_ENTRY;
-            }
-            d_tag = dyn.d_tag;
-            d_val = dyn.d_val;
+struct scan_worker_t {
+    struct scan_t *scan;
+    long id;
+};
 
+static void scan_push(struct scan_t *scan, long id, char *path, int is_dir) {
+    struct scan_deque_t *d = &scan->deques[id];
+    pthread_mutex_lock(&d->lock);
+    if (d->end == d->capacity) {
+        // Reuse the space of stolen items before growing.
+        if (d->begin > d->capacity / 2) {
+            memmove(d->arr, d->arr + d->begin,
+                    (d->end - d->begin) * sizeof(struct scan_item_t));
+            d->end -= d->begin;
+            d->begin = 0;
         } else {
-            struct dyn_32_t dyn;
-            if (fread(&dyn, sizeof(struct dyn_32_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                small_vec_u64_free(&needed);
-                return ERR_INVALID_DYNAMIC_ARRAY_ENTRY;
-            }
-            d_tag = dyn.d_tag;
-            d_val = dyn.d_val;
+            d->capacity *= 2;
+            d->arr = realloc(d->arr, d->capacity * sizeof(struct scan_item_t));
+            if (d->arr == NULL)
+                exit(1);
         }
+    }
+    d->arr[d->end].path = path;
+    d->arr[d->end].is_dir = is_dir;
+    ++d->end;
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&scan->lock);
+    ++scan->pending;
+    ++scan->generation;
+    pthread_cond_signal(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
 
-        // Store strtab / rpath / runpath / needed / soname info.
-        switch (d_tag) {
-        case DT_NULL:
-            cont = 0;
-            break;
-        case DT_STRTAB:
-            strtab = d_val;
-            break;
-        case DT_RPATH:
-            rpath = d_val;
-            break;
-        case DT_RUNPATH:
-            runpath = d_val;
-            break;
-        case DT_NEEDED:
-            small_vec_u64_append(&needed, d_val);
-            break;
-        case DT_SONAME:
-            soname = d_val;
-            break;
-        case DT_FLAGS_1:
-            no_def_lib |= (DT_1_NODEFLIB & d_val) == DT_1_NODEFLIB;
-            break;
+static void scan_done(struct scan_t *scan) {
+    pthread_mutex_lock(&scan->lock);
+    if (--scan->pending == 0)
+        pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+// Take the next item of worker `id`, or steal one. Returns 0 when all work is
+// done.
+static int scan_next(struct scan_t *scan, long id, struct scan_item_t *item) {
+    while (1) {
+        pthread_mutex_lock(&scan->lock);
+        size_t generation = scan->generation;
+        pthread_mutex_unlock(&scan->lock);
+
+        struct scan_deque_t *d = &scan->deques[id];
+        pthread_mutex_lock(&d->lock);
+        int found = d->end != d->begin;
+        if (found)
+            *item = d->arr[--d->end];
+        pthread_mutex_unlock(&d->lock);
+        if (found)
+            return 1;
+
+        for (long k = 1; k < scan->num_workers; ++k) {
+            d = &scan->deques[(id + k) % scan->num_workers];
+            pthread_mutex_lock(&d->lock);
+            found = d->end != d->begin;
+            if (found)
+                *item = d->arr[d->begin++];
+            pthread_mutex_unlock(&d->lock);
+            if (found)
+                return 1;
         }
-    }
 
-    if (strtab == MAX_OFFSET_T) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        small_vec_u64_free(&needed);
-        return ERR_NO_STRTAB;
+        // Nothing to do: wait for new items, unless nothing was pushed since
+        // we looked.
+        pthread_mutex_lock(&scan->lock);
+        if (scan->pending == 0) {
+            pthread_mutex_unlock(&scan->lock);
+            return 0;
+        }
+        if (scan->generation == generation)
+            pthread_cond_wait(&scan->cond, &scan->lock);
+        pthread_mutex_unlock(&scan->lock);
     }
+}
 
-    // Let's verify just to be sure that the offsets are
-    // ordered.
-    if (!is_ascending_order(pt_load_vaddr.p, pt_load_vaddr.n)) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_vaddr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&needed);
-        return ERR_VADDRS_NOT_ORDERED;
-    }
+static char *scan_join_path(char const *dir, char const *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = malloc(dir_len + slash + name_len + 1);
+    if (path == NULL)
+        exit(1);
+    memcpy(path, dir, dir_len);
+    if (slash)
+        path[dir_len] = '/';
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return path;
+}
 
-    // Find the file offset corresponding to the strtab virtual address
-    size_t vaddr_idx = 0;
-    while (vaddr_idx + 1 != pt_load_vaddr.n &&
-           strtab >= pt_load_vaddr.p[vaddr_idx + 1]) {
-        ++vaddr_idx;
-    }
+// Queue the subdirectories and regular files of a directory entry. Symlinks
+// are not followed, so that every file is analyzed once and loops are
+// impossible.
+static void scan_entry(struct scan_t *scan, long id, int dirfd,
+                       char const *dir, char const *name, unsigned char type) {
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return;
 
-    uint64_t strtab_offset =
-        pt_load_offset.p[vaddr_idx] + strtab - pt_load_vaddr.p[vaddr_idx];
+    // Not all file systems fill in the type.
+    if (type == DT_UNKNOWN) {
+        struct stat finfo;
+        if (fstatat(dirfd, name, &finfo, AT_SYMLINK_NOFOLLOW) != 0)
+            return;
+        type = S_ISDIR(finfo.st_mode) ? DT_DIR
+               : S_ISREG(finfo.st_mode) ? DT_REG
+                                        : DT_UNKNOWN;
+    }
 
-    small_vec_u64_free(&pt_load_vaddr);
-    small_vec_u64_free(&pt_load_offset);
+    if (type == DT_DIR || type == DT_REG)
+        scan_push(scan, id, scan_join_path(dir, name), type == DT_DIR);
+}
 
-    // From this point on we actually copy strings from the ELF file into our
-    // own string buffer.
+#ifdef __linux__
+struct linux_dirent64_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static void scan_directory(struct scan_t *scan, long id, char const *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        pthread_mutex_lock(&scan->output);
+        fputs("Warning [", stderr);
+        fputs(path, stderr);
+        fputs("]: Could not open directory\n", stderr);
+        pthread_mutex_unlock(&scan->output);
+        return;
+    }
 
-    // Copy the current soname
-    size_t soname_buf_offset = s->string_table.n;
-    if (soname != MAX_OFFSET_T) {
-        if (fseek(fptr, strtab_offset + soname, SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_SONAME;
+#ifdef __linux__
+    // Read the entries in large batches, without the overhead of readdir.
+    uint64_t buf[4096];
+    while (1) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (long off = 0; off < n;) {
+            struct linux_dirent64_t *entry =
+                (struct linux_dirent64_t *)((char *)buf + off);
+            scan_entry(scan, id, fd, path, entry->d_name, entry->d_type);
+            off += entry->d_reclen;
         }
-        string_table_copy_from_file(&s->string_table, fptr);
     }
+    close(fd);
+#else
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+        scan_entry(scan, id, fd, path, entry->d_name, entry->d_type);
+    closedir(dir);
+#endif
+}
 
-    int in_exclude_list =
-        soname != MAX_OFFSET_T &&
-        is_in_exclude_list(s->string_table.arr + soname_buf_offset);
-
-    // No need to recurse deeper when we aren't in very verbose mode.
-    int should_recurse =
-        depth < s->max_depth &&
-        ((!seen_before && !in_exclude_list) ||
-         (!seen_before && in_exclude_list && s->verbosity >= 2) ||
-         s->verbosity >= 3);
-
-    // Just print the library and return
-    if (!should_recurse) {
-        char *print_name = soname == MAX_OFFSET_T || s->path
-                               ? current_file
-                               : (s->string_table.arr + soname_buf_offset);
-
-        char *bold_color = in_exclude_list
-                               ? REGULAR_MAGENTA
-                               : seen_before ? REGULAR_BLUE : BOLD_CYAN;
-        char *regular_color = in_exclude_list
-                                  ? REGULAR_MAGENTA
-                                  : seen_before ? REGULAR_BLUE : REGULAR_CYAN;
-
-        int highlight = !seen_before && !in_exclude_list;
-        print_line(depth, print_name, bold_color, regular_color, highlight,
-                   reason, s);
-
-        s->string_table.n = old_buf_size;
-        fclose(fptr);
-        small_vec_u64_free(&needed);
+// Whether the file starts like an ELF executable or shared library, which is
+// the same check dag_root() starts with.
+static int scan_is_candidate(char const *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    unsigned char e_ident[18];
+    ssize_t n = pread(fd, e_ident, sizeof(e_ident), 0);
+    close(fd);
+    if (n != sizeof(e_ident) || e_ident[0] != 0x7f || e_ident[1] != 'E' ||
+        e_ident[2] != 'L' || e_ident[3] != 'F')
         return 0;
-    }
 
-    // Store the ORIGIN string.
-    char origin[MAX_PATH_LENGTH];
-    char *last_slash = strrchr(current_file, '/');
-    if (last_slash != NULL) {
-        // Exclude the last slash
-        size_t bytes = last_slash - current_file;
-        memcpy(origin, current_file, bytes);
-        origin[bytes] = '\0';
-    } else {
-        // this only happens when the input is relative (e.g. in current dir)
-        memcpy(origin, "./", 3);
-    }
+    // e_type follows e_ident, in the byte order of the file.
+    unsigned e_type = e_ident[5] == '\x02' ? e_ident[16] << 8 | e_ident[17]
+                                           : e_ident[17] << 8 | e_ident[16];
+    return e_type == ET_EXEC || e_type == ET_DYN;
+}
 
-    // Copy DT_PRATH
-    if (rpath == MAX_OFFSET_T) {
-        s->rpath_offsets[depth] = SIZE_MAX;
-    } else {
-        s->rpath_offsets[depth] = s->string_table.n;
-        if (fseek(fptr, strtab_offset + rpath, SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_RPATH;
-        }
+static void scan_file(struct scan_t *scan, struct libtree_state_t *s,
+                      char const *path) {
+    if (!scan_is_candidate(path))
+        return;
 
-        string_table_copy_from_file(&s->string_table, fptr);
+    pthread_mutex_lock(&scan->lock);
+    s->input = ++scan->num_inputs;
+    pthread_mutex_unlock(&scan->lock);
+
+    // Every file gets a tree of its own, which does not depend on the order
+    // in which the files are analyzed.
+    char *buf = NULL;
+    size_t len = 0;
+    char *err_buf = NULL;
+    size_t err_len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    FILE *err = open_memstream(&err_buf, &err_len);
+    if (out == NULL || err == NULL)
+        exit(1);
+    visited_files_clear(&s->visited);
+    ++s->tree;
+    s->num_refs = 0;
+    uint64_t start = now_us();
+    int code = print_root(path, s, out, err);
+    if (s->print_stats)
+        stats_add_input(&s->stats, path, now_us() - start);
+    fclose(out);
+    fclose(err);
+
+    pthread_mutex_lock(&scan->output);
+    output_separator(scan->num_written++, s, stdout);
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    fwrite(err_buf, 1, err_len, stderr);
+    report_error(path, code);
+    pthread_mutex_unlock(&scan->output);
+    free(buf);
+    free(err_buf);
+
+    if (code != 0) {
+        pthread_mutex_lock(&scan->lock);
+        scan->exit_code = code;
+        pthread_mutex_unlock(&scan->lock);
+    }
+}
 
-        // We store the interpolated string right after the literal copy.
-        size_t curr_buf_size = s->string_table.n;
-        if (interpolate_variables(s, s->rpath_offsets[depth], origin))
-            s->rpath_offsets[depth] = curr_buf_size;
+static void *scan_worker(void *arg) {
+    struct scan_worker_t *w = arg;
+    struct scan_t *scan = w->scan;
+
+    // Share the caches and configuration, but keep our own visited set,
+    // graph, scratch space and allocations.
+    struct libtree_state_t s = *scan->s;
+    struct arena_t arena = {NULL};
+    s.arena = &arena;
+    struct dag_t dag;
+    dag_init(&dag);
+    s.dag = &dag;
+    s.ring = NULL;
+    s.ring_tried = 0;
+    memset(&s.stats, 0, sizeof(s.stats));
+    s.scratch.n = 0;
+    s.scratch.capacity = 1024;
+    s.scratch.arr = malloc(s.scratch.capacity * sizeof(char));
+    if (s.scratch.arr == NULL)
+        exit(1);
+    visited_files_init(&s.visited);
+
+    struct scan_item_t item;
+    while (scan_next(scan, w->id, &item)) {
+        if (item.is_dir)
+            scan_directory(scan, w->id, item.path);
+        else
+            scan_file(scan, &s, item.path);
+        free(item.path);
+        scan_done(scan);
     }
 
-    // Copy DT_RUNPATH
-    size_t runpath_buf_offset = s->string_table.n;
-    if (runpath != MAX_OFFSET_T) {
-        if (fseek(fptr, strtab_offset + runpath, SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_RUNPATH;
-        }
+    free(s.scratch.arr);
+    visited_files_free(&s.visited);
+    dag_free(&dag);
+    probe_ring_free(s.ring);
 
-        string_table_copy_from_file(&s->string_table, fptr);
+    // Records and listings in the shared caches point into our arena.
+    pthread_mutex_lock(s.cache->lock);
+    arena_merge(&s.cache->arena, &arena);
+    stats_add(scan->stats, &s.stats);
+    pthread_mutex_unlock(s.cache->lock);
 
-        // We store the interpolated string right after the literal copy.
-        size_t curr_buf_size = s->string_table.n;
-        if (interpolate_variables(s, runpath_buf_offset, origin))
-            runpath_buf_offset = curr_buf_size;
-    }
+    return NULL;
+}
 
-    // Copy needed libraries.
-    struct small_vec_u64_t needed_buf_offsets;
-    small_vec_u64_init(&needed_buf_offsets);
+// Analyze all ELF executables and libraries under the given paths on
+// `s->jobs` threads, printing every tree as soon as it is done, and finally a
+// summary of the libraries that could not be located.
+static int scan_paths(int pathc, char **pathv, struct libtree_state_t *s) {
+    struct scan_t scan;
+    scan.num_workers = s->jobs;
+    scan.pending = 0;
+    scan.generation = 0;
+    scan.num_inputs = 0;
+    scan.num_written = 0;
+    scan.exit_code = 0;
+    scan.s = s;
+    scan.stats = &s->stats;
+    pthread_mutex_init(&scan.lock, NULL);
+    pthread_mutex_init(&scan.output, NULL);
+    pthread_cond_init(&scan.cond, NULL);
+
+    scan.deques = malloc(scan.num_workers * sizeof(struct scan_deque_t));
+    struct scan_worker_t *workers =
+        malloc(scan.num_workers * sizeof(struct scan_worker_t));
+    pthread_t *threads = malloc(scan.num_workers * sizeof(pthread_t));
+    if (scan.deques == NULL || workers == NULL || threads == NULL)
+        exit(1);
+    for (long i = 0; i < scan.num_workers; ++i) {
+        struct scan_deque_t *d = &scan.deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->begin = 0;
+        d->end = 0;
+        d->capacity = 64;
+        d->arr = malloc(d->capacity * sizeof(struct scan_item_t));
+        if (d->arr == NULL)
+            exit(1);
+        workers[i].scan = &scan;
+        workers[i].id = i;
+    }
 
-    for (size_t i = 0; i < needed.n; ++i) {
-        small_vec_u64_append(&needed_buf_offsets, s->string_table.n);
-        if (fseek(fptr, strtab_offset + needed.p[i], SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed_buf_offsets);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_NEEDED;
+    struct missing_set_t missing;
+    missing_set_init(&missing);
+    pthread_mutex_t cache_lock;
+    pthread_mutex_init(&cache_lock, NULL);
+    pthread_cond_t parsed;
+    pthread_cond_init(&parsed, NULL);
+    missing.lock = &scan.lock;
+    s->cache->lock = &cache_lock;
+    s->cache->parsed = &parsed;
+    s->dirs->lock = &cache_lock;
+    s->missing = &missing;
+
+    // The given paths themselves are followed when they are symlinks.
+    for (int i = 0; i < pathc; ++i) {
+        struct stat finfo;
+        if (stat(pathv[i], &finfo) != 0) {
+            report_error(pathv[i], ERR_COULD_NOT_OPEN_FILE);
+            scan.exit_code = ERR_COULD_NOT_OPEN_FILE;
+            continue;
         }
-        string_table_copy_from_file(&s->string_table, fptr);
+        size_t len = strlen(pathv[i]);
+        char *path = malloc(len + 1);
+        if (path == NULL)
+            exit(1);
+        memcpy(path, pathv[i], len + 1);
+        scan_push(&scan, i % scan.num_workers, path, S_ISDIR(finfo.st_mode));
     }
 
-    fclose(fptr);
-
-    char *print_name = soname == MAX_OFFSET_T || s->path
-                           ? current_file
-                           : (s->string_table.arr + soname_buf_offset);
+    // The first worker is this thread.
+    long started = 1;
+    while (started < scan.num_workers &&
+           pthread_create(&threads[started], NULL, scan_worker,
+                          &workers[started]) == 0)
+        ++started;
+
+    // Workers that failed to start may have items; they get stolen.
+    scan_worker(&workers[0]);
+
+    for (long i = 1; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    // Structured output lists missing libraries per file already.
+    if (s->format == FORMAT_TREE)
+        missing_set_print(&missing, s->color);
+
+    s->cache->lock = NULL;
+    s->cache->parsed = NULL;
+    s->dirs->lock = NULL;
+    s->missing = NULL;
+    missing_set_free(&missing);
+    pthread_mutex_destroy(&cache_lock);
+    pthread_cond_destroy(&parsed);
+
+    for (long i = 0; i < scan.num_workers; ++i) {
+        free(scan.deques[i].arr);
+        pthread_mutex_destroy(&scan.deques[i].lock);
+    }
+    free(scan.deques);
+    free(workers);
+    free(threads);
+    pthread_cond_destroy(&scan.cond);
+    pthread_mutex_destroy(&scan.output);
+    pthread_mutex_destroy(&scan.lock);
+
+    return scan.exit_code;
+}
 
-    char *bold_color = in_exclude_list ? REGULAR_MAGENTA
-                                       : seen_before ? REGULAR_BLUE : BOLD_CYAN;
-    char *regular_color = in_exclude_list
-                              ? REGULAR_MAGENTA
-                              : seen_before ? REGULAR_BLUE : REGULAR_CYAN;
+static int print_input(char const *path, size_t index,
+                       struct libtree_state_t *s) {
+    output_separator(index, s, stdout);
+    uint64_t start = now_us();
+    int code = print_root(path, s, stdout, stderr);
+    if (s->print_stats)
+        stats_add_input(&s->stats, path, now_us() - start);
+    fflush(stdout);
+    report_error(path, code);
+    return code;
+}
 
-    int highlight = !seen_before && !in_exclude_list;
-    print_line(depth, print_name, bold_color, regular_color, highlight, reason,
-               s);
+// Copies of the `pathc` paths in `pathv` followed by those read from stdin.
+static char **read_stdin_paths(int *pathc, char **pathv, char delimiter) {
+    size_t n = 0;
+    size_t capacity = *pathc + 16;
+    char **paths = malloc(capacity * sizeof(char *));
+    if (paths == NULL)
+        exit(1);
+    for (; n < (size_t)*pathc; ++n) {
+        size_t len = strlen(pathv[n]);
+        paths[n] = malloc(len + 1);
+        if (paths[n] == NULL)
+            exit(1);
+        memcpy(paths[n], pathv[n], len + 1);
+    }
 
-    // Finally start searching.
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &line_capacity, delimiter, stdin)) != -1) {
+        if (len > 0 && line[len - 1] == delimiter)
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (n == capacity) {
+            capacity *= 2;
+            paths = realloc(paths, capacity * sizeof(char *));
+            if (paths == NULL)
+                exit(1);
+        }
+        paths[n] = malloc(len + 1);
+        if (paths[n] == NULL)
+            exit(1);
+        memcpy(paths[n++], line, len + 1);
+    }
+    free(line);
 
-    int exit_code = 0;
+    *pathc = n;
+    return paths;
+}
+#endif
+
+// The configuration without options, with the rpath substitution values of
+// the machine described by `uname_val`.
+static void libtree_state_defaults(struct libtree_state_t *s,
+                                   struct utsname *uname_val) {
+    s->color = 0;
+    s->verbosity = 0;
+    s->path = 0;
+    s->jobs = 1;
+    s->scan = 0;
+    s->compress = 0;
+    s->format = FORMAT_TREE;
+    s->read_stdin = 0;
+    s->delimiter = '\n';
+    s->max_depth = DEFAULT_MAX_DEPTH;
+    s->low_metadata = 0;
+    s->symbols = 0;
+    s->unused = 0;
+    s->cost = 0;
+    s->probes = 0;
+    s->print_stats = STATS_NONE;
 
-    size_t needed_not_found = needed_buf_offsets.n;
+    // Technically this should be AT_PLATFORM, but
+    // (a) the feature is rarely used
+    // (b) it's almost always the same
+    s->PLATFORM = uname_val->machine;
+    s->OSNAME = uname_val->sysname;
+    s->OSREL = uname_val->release;
+    s->ld_conf_file = "/etc/ld.so.conf";
+    s->ld_cache_file = NULL;
+    s->cache_file = NULL;
+    s->ld_library_path_env = getenv("LD_LIBRARY_PATH");
 
-    // Skip common libraries if not verbose
-    if (needed_not_found && s->verbosity == 0)
-        apply_exclude_list(&needed_not_found, &needed_buf_offsets, s);
+    if (strcmp(uname_val->sysname, "FreeBSD") == 0)
+        s->ld_conf_file = "/etc/ld-elf.so.conf";
 
-    if (needed_not_found)
-        exit_code |= check_absolute_paths(
-            &needed_not_found, &needed_buf_offsets, depth, s, curr_type);
+    // TODO: how to find this value at runtime?
+    s->LIB = "lib";
+}
 
-    // Consider rpaths only when runpath is empty
-    if (runpath == MAX_OFFSET_T) {
-        // We have a stack of rpaths, try them all, starting with one set at
-        // this lib, then the parents.
-        for (int j = depth; j >= 0 && needed_not_found; --j) {
-            if (s->rpath_offsets[j] == SIZE_MAX)
-                continue;
+// Set up the caches and search paths for the configuration.
+static void libtree_state_load(struct libtree_state_t *s) {
+    // First collect standard paths
+    libtree_state_init(s);
+    s->cache->low_metadata = s->low_metadata;
+    s->dirs->low_metadata = s->low_metadata;
+
+    uint64_t t0 = now_us();
+    struct ld_conf_newest_t newest;
+    parse_ld_so_conf(s, &newest);
+    uint64_t t1 = now_us();
+    if (s->ld_cache_file != NULL)
+        load_ld_cache(s, &newest);
+    uint64_t t2 = now_us();
+    parse_ld_library_path(s);
+    set_default_paths(s);
+    split_search_paths(s);
+    uint64_t t3 = now_us();
 
-            exit_code |= check_search_paths(
-                (struct found_t){.how = RPATH, .depth = j}, s->rpath_offsets[j],
-                &needed_not_found, &needed_buf_offsets, depth, s, curr_type);
-        }
+    // A cache file that does not exist yet or can't be used is no error.
+    if (s->cache_file != NULL && disk_cache_open(&s->disk, s->cache_file) == 0) {
+        s->cache->disk = &s->disk;
+        s->dirs->disk = &s->disk;
     }
 
-    // Then try LD_LIBRARY_PATH, if we have it.
-    if (needed_not_found && s->ld_library_path_offset != SIZE_MAX) {
-        exit_code |= check_search_paths(
-            (struct found_t){.how = LD_LIBRARY_PATH}, s->ld_library_path_offset,
-            &needed_not_found, &needed_buf_offsets, depth, s, curr_type);
+    s->phase_us[PHASE_LD_SO_CONF] = t1 - t0;
+    s->phase_us[PHASE_LD_SO_CACHE] = t2 - t1;
+    s->phase_us[PHASE_LD_LIBRARY_PATH] = t3 - t2;
+    s->phase_us[PHASE_CACHE_FILE] = now_us() - t3;
+}
+
+#ifndef LIBTREE_LIBRARY
+static char const *phase_name(phase_t phase) {
+    switch (phase) {
+    case PHASE_LD_SO_CONF:
+        return "ld.so.conf";
+    case PHASE_LD_SO_CACHE:
+        return "ld.so.cache";
+    case PHASE_LD_LIBRARY_PATH:
+        return "LD_LIBRARY_PATH";
+    case PHASE_CACHE_FILE:
+        return "cache file";
+    case PHASE_RESOLVE:
+        return "resolve";
+    case NUM_PHASES:
+        break;
     }
+    return NULL;
+}
 
-    // Then consider runpaths
-    if (needed_not_found && runpath != MAX_OFFSET_T) {
-        exit_code |= check_search_paths(
-            (struct found_t){.how = RUNPATH}, runpath_buf_offset,
-            &needed_not_found, &needed_buf_offsets, depth, s, curr_type);
+static void stats_line(size_t n, char const *what, FILE *out) {
+    char num[24];
+    utoa(num, n);
+    fputs(JUST_INDENT, out);
+    fputs(num, out);
+    fputs(what, out);
+}
+
+static void stats_print_text(struct libtree_state_t const *s, FILE *out) {
+    struct stats_t const *st = &s->stats;
+    char num[24];
+
+    fputs("Wall time:\n", out);
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        stats_line(s->phase_us[i], " us ", out);
+        fputs(phase_name(i), out);
+        fputc('\n', out);
     }
 
-    // Check ld.so.conf paths
-    if (needed_not_found && !no_def_lib) {
-        exit_code |= check_search_paths(
-            (struct found_t){.how = LD_SO_CONF}, s->ld_so_conf_offset,
-            &needed_not_found, &needed_buf_offsets, depth, s, curr_type);
+    fputs("File system:\n", out);
+    stats_line(st->opens, " files and directories opened\n", out);
+    stats_line(st->stat_calls, " stat calls\n", out);
+    stats_line(st->reads, " reads of ", out);
+    utoa(num, st->bytes_read);
+    fputs(num, out);
+    fputs(" bytes\n", out);
+    stats_line(st->maps, " files of ", out);
+    utoa(num, st->bytes_mapped);
+    fputs(num, out);
+    fputs(" bytes mapped\n", out);
+    stats_line(st->listings, " directories listed\n", out);
+
+    fputs("ELF files:\n", out);
+    stats_line(st->parsed, " parsed\n", out);
+    stats_line(st->from_cache_file, " taken from the cache file\n", out);
+    stats_line(st->seen_before, " shown before in the same tree\n", out);
+
+    // Candidates per search path: ruled out by a listing, tried, found.
+    fputs("Candidates:\n", out);
+    for (how_t how = DIRECT; how <= DEFAULT; ++how) {
+        fputs(JUST_INDENT, out);
+        fputs(how_name(how), out);
+        fputs(": ", out);
+        utoa(num, st->ruled_out[how]);
+        fputs(num, out);
+        fputs(" ruled out, ", out);
+        utoa(num, st->tried[how]);
+        fputs(num, out);
+        fputs(" tried, ", out);
+        utoa(num, st->tried[how] - st->found[how]);
+        fputs(num, out);
+        fputs(" failed, ", out);
+        utoa(num, st->found[how]);
+        fputs(num, out);
+        fputs(" found\n", out);
     }
 
-    // Then consider standard paths
-    if (needed_not_found && !no_def_lib) {
-        exit_code |= check_search_paths(
-            (struct found_t){.how = DEFAULT}, s->default_paths_offset,
-            &needed_not_found, &needed_buf_offsets, depth, s, curr_type);
+    fputs("Memory:\n", out);
+    // Only search paths are kept in the string table, which is filled once.
+    stats_line(s->string_table.n, " bytes of search path strings\n", out);
+
+    if (st->num_slowest > 0)
+        fputs("Slowest inputs:\n", out);
+    for (size_t i = 0; i < st->num_slowest; ++i) {
+        stats_line(st->slowest[i].us, " us ", out);
+        fputs(st->slowest[i].path, out);
+        fputc('\n', out);
     }
+}
 
-    // Finally summarize those that could not be found.
-    if (needed_not_found) {
-        print_error(depth, needed_not_found, &needed_buf_offsets,
-                    runpath == MAX_OFFSET_T
-                        ? NULL
-                        : s->string_table.arr + runpath_buf_offset,
-                    s, no_def_lib);
-        s->string_table.n = old_buf_size;
-        small_vec_u64_free(&needed_buf_offsets);
-        small_vec_u64_free(&needed);
-        return ERR_DEPENDENCY_NOT_FOUND;
+// The same as the text, in a single JSON object.
+static void stats_print_json(struct libtree_state_t const *s, FILE *out) {
+    struct stats_t const *st = &s->stats;
+    char num[24];
+
+    fputs("{\"wall_time_us\":{", out);
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        if (i > 0)
+            fputc(',', out);
+        json_string(phase_name(i), out);
+        fputc(':', out);
+        utoa(num, s->phase_us[i]);
+        fputs(num, out);
+    }
+    fputs("},\"file_system\":{\"opens\":", out);
+    utoa(num, st->opens);
+    fputs(num, out);
+    json_number("stat_calls", st->stat_calls, out);
+    json_number("reads", st->reads, out);
+    json_number("bytes_read", st->bytes_read, out);
+    json_number("maps", st->maps, out);
+    json_number("bytes_mapped", st->bytes_mapped, out);
+    json_number("listings", st->listings, out);
+    fputs("},\"elf_files\":{\"parsed\":", out);
+    utoa(num, st->parsed);
+    fputs(num, out);
+    json_number("from_cache_file", st->from_cache_file, out);
+    json_number("seen_before", st->seen_before, out);
+    fputs("},\"candidates\":{", out);
+    for (how_t how = DIRECT; how <= DEFAULT; ++how) {
+        if (how > DIRECT)
+            fputc(',', out);
+        json_string(how_name(how), out);
+        fputs(":{\"ruled_out\":", out);
+        utoa(num, st->ruled_out[how]);
+        fputs(num, out);
+        json_number("tried", st->tried[how], out);
+        json_number("failed", st->tried[how] - st->found[how], out);
+        json_number("found", st->found[how], out);
+        fputc('}', out);
+    }
+    fputs("}", out);
+    json_number("search_path_bytes", s->string_table.n, out);
+    fputs(",\"slowest\":[", out);
+    for (size_t i = 0; i < st->num_slowest; ++i) {
+        if (i > 0)
+            fputc(',', out);
+        fputs("{\"path\":", out);
+        json_string(st->slowest[i].path, out);
+        json_number("us", st->slowest[i].us, out);
+        fputc('}', out);
     }
+    fputs("]}\n", out);
+}
 
-    // Free memory in our string table
-    s->string_table.n = old_buf_size;
-    small_vec_u64_free(&needed_buf_offsets);
-    small_vec_u64_free(&needed);
-    return exit_code;
+static void stats_print(struct libtree_state_t const *s, FILE *out) {
+    if (s->print_stats == STATS_TEXT)
+        stats_print_text(s, out);
+    else if (s->print_stats == STATS_JSON)
+        stats_print_json(s, out);
 }
 
-static int parse_ld_config_file(struct string_table_t *st, char *path);
+static int print_tree(int pathc, char **pathv, struct libtree_state_t *s) {
+    libtree_state_load(s);
+    uint64_t start = now_us();
+
+    output_document_begin(s);
+
+    if (s->scan) {
+        int exit_code;
+        if (s->read_stdin) {
+            // The directories to scan are needed up front.
+            char **paths = read_stdin_paths(&pathc, pathv, s->delimiter);
+            exit_code = scan_paths(pathc, paths, s);
+            for (int i = 0; i < pathc; ++i)
+                free(paths[i]);
+            free(paths);
+        } else {
+            exit_code = scan_paths(pathc, pathv, s);
+        }
+        output_document_end(s);
+        s->phase_us[PHASE_RESOLVE] = now_us() - start;
+        stats_print(s, stderr);
+        libtree_state_save(s);
+        libtree_state_free(s);
+        return exit_code;
+    }
 
-static int ld_conf_globbing(struct string_table_t *st, char *pattern) {
-    glob_t result;
-    memset(&result, 0, sizeof(result));
-    int status = glob(pattern, 0, NULL, &result);
+    if (s->jobs > 1 && pathc > 0)
+        warm_up_caches(pathc, pathv, s);
 
-    // Handle errors (no result is not an error...)
-    switch (status) {
-    case GLOB_NOSPACE:
-    case GLOB_ABORTED:
-        globfree(&result);
-        return 1;
-    case GLOB_NOMATCH:
-        globfree(&result);
-        return 0;
+    int exit_code = 0;
+    size_t index = 0;
+
+    for (int i = 0; i < pathc; ++i) {
+        int code = print_input(pathv[i], index++, s);
+        if (code != 0)
+            exit_code = code;
     }
 
-    // Otherwise parse the files we've found!
-    int code = 0;
-    for (size_t i = 0; i < result.gl_pathc; ++i)
-        code |= parse_ld_config_file(st, result.gl_pathv[i]);
+    // Handle file names from stdin as they come in, so that we can be in the
+    // middle of a pipeline.
+    if (s->read_stdin) {
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t len;
+        while ((len = getdelim(&line, &capacity, s->delimiter, stdin)) != -1) {
+            if (len > 0 && line[len - 1] == s->delimiter)
+                line[--len] = '\0';
+            if (len == 0)
+                continue;
+            int code = print_input(line, index++, s);
+            if (code != 0)
+                exit_code = code;
+        }
+        free(line);
+    }
 
-    globfree(&result);
-    return code;
+    output_document_end(s);
+    s->phase_us[PHASE_RESOLVE] = now_us() - start;
+    stats_print(s, stderr);
+    libtree_state_save(s);
+    libtree_state_free(s);
+    return exit_code;
 }
 
-static int parse_ld_config_file(struct string_table_t *st, char *path) {
-    FILE *fptr = fopen(path, "r");
-
-    if (fptr == NULL)
+// Number of threads, where 0 means one per online processor.
+static int parse_jobs(char const *val, long *jobs) {
+    char *end;
+    *jobs = strtol(val, &end, 10);
+    if (*val == '\0' || *end != '\0' || *jobs < 0) {
+        fputs("Invalid number of jobs `", stderr);
+        fputs(val, stderr);
+        fputs("`\n", stderr);
         return 1;
+    }
+    if (*jobs == 0)
+        *jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (*jobs < 1)
+        *jobs = 1;
+    return 0;
+}
+#endif
+
+#ifdef LIBTREE_LIBRARY
+// Locate the dependencies of everything reachable from `root` up to the
+// maximum depth, without printing anything.
+static void dag_resolve_all(struct dag_node_t *root,
+                            struct libtree_state_t *s) {
+    size_t n = 0;
+    size_t capacity = 64;
+    struct dag_node_t **stack = malloc(capacity * sizeof(struct dag_node_t *));
+    if (stack == NULL)
+        exit(1);
+    stack[n++] = root;
 
-    int c = 0;
-    char line[MAX_PATH_LENGTH];
-    char tmp[MAX_PATH_LENGTH];
+    while (n > 0) {
+        struct dag_node_t *node = stack[--n];
+        struct elf_record_t const *r = node->record;
+        if (node->resolved || !r->has_dynamic || r->dynamic_error != 0 ||
+            r->needed_error != 0 || node->depth >= s->max_depth)
+            continue;
 
-    while (c != EOF) {
-        size_t line_len = 0;
-        while ((c = getc(fptr)) != '\n' && c != EOF) {
-            if (line_len < MAX_PATH_LENGTH - 1) {
-                line[line_len++] = c;
+        dag_resolve(node, s);
+
+        for (size_t i = 0; i < node->num_edges; ++i) {
+            if (node->edges[i].node == NULL)
+                continue;
+            if (n == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(struct dag_node_t *));
+                if (stack == NULL)
+                    exit(1);
             }
+            stack[n++] = node->edges[i].node;
         }
+    }
 
-        line[line_len] = '\0';
-
-        char *begin = line;
-        char *end = line + line_len;
-        // Remove leading whitespace
-        for (; isspace(*begin); ++begin) {
-        }
+    free(stack);
+}
 
-        // Remove trailing comments
-        char *comment = strchr(begin, '#');
-        if (comment != NULL)
-            *comment = '\0';
+struct libtree_context {
+    struct libtree_state_t s;
+    struct utsname uname_val;
+    // Whether the caches and search paths were set up.
+    int loaded;
+    // Copies of the options that were set.
+    char *options[LIBTREE_OPT_CACHE_FILE + 1];
+};
 
-        // Remove trailing whitespace
-        while (end != begin)
-            if (!isspace(*--end))
-                break;
+struct libtree_context *libtree_context_new(void) {
+    struct libtree_context *ctx = malloc(sizeof(struct libtree_context));
+    if (ctx == NULL)
+        exit(1);
+    memset(ctx, 0, sizeof(*ctx));
 
-        // Skip empty lines
-        if (begin == end)
-            continue;
+    if (uname(&ctx->uname_val) != 0) {
+        free(ctx);
+        return NULL;
+    }
 
-        // Put back the end of the string
-        end[1] = '\0';
+    libtree_state_defaults(&ctx->s, &ctx->uname_val);
 
-        // 'include ': glob whatever follows.
-        if (strncmp(begin, "include", 7) == 0 && isspace(begin[7])) {
-            begin += 8;
-            // Remove more whitespace.
-            while (isspace(*begin))
-                ++begin;
+    // Callers get all dependencies, including the common libraries that the
+    // tree hides by default.
+    ctx->s.verbosity = 1;
 
-            // Prepend current dir when include dir is relative.
-            if (*begin != '/') {
-                char *wd = strrchr(path, '/');
-                wd = wd == NULL ? strrchr(path, '\0') : wd;
+    // The environment may change before the first query.
+    libtree_context_set(ctx, LIBTREE_OPT_LD_LIBRARY_PATH,
+                        ctx->s.ld_library_path_env);
+    return ctx;
+}
 
-                // bytes until /
-                size_t wd_len = wd - path;
-                size_t include_len = end - begin + 1;
+void libtree_context_free(struct libtree_context *ctx) {
+    if (ctx == NULL)
+        return;
 
-                // just skip then.
-                if (wd_len + 1 + include_len >= MAX_PATH_LENGTH)
-                    continue;
+    if (ctx->loaded) {
+        libtree_state_save(&ctx->s);
+        libtree_state_free(&ctx->s);
+    }
 
-                memcpy(tmp, path, wd_len);
-                tmp[wd_len] = '/';
-                memcpy(tmp + wd_len + 1, begin, include_len);
-                tmp[wd_len + 1 + include_len] = '\0';
-                begin = tmp;
-            }
+    for (size_t i = 0; i < sizeof(ctx->options) / sizeof(char *); ++i)
+        free(ctx->options[i]);
+    free(ctx);
+}
 
-            ld_conf_globbing(st, begin);
-        } else {
-            // Copy over and replace trailing \0 with :.
-            string_table_store(st, begin);
-            st->arr[st->n - 1] = ':';
-        }
+int libtree_context_set(struct libtree_context *ctx, enum libtree_option opt,
+                        char const *value) {
+    if (ctx->loaded || (unsigned)opt > LIBTREE_OPT_CACHE_FILE)
+        return -1;
+
+    // Only these can be unset.
+    if (value == NULL && opt != LIBTREE_OPT_LDCACHE &&
+        opt != LIBTREE_OPT_LD_LIBRARY_PATH && opt != LIBTREE_OPT_CACHE_FILE)
+        return -1;
+
+    if (opt == LIBTREE_OPT_MAX_DEPTH) {
+        char *end;
+        unsigned long max_depth = strtoul(value, &end, 10);
+        if (*value == '\0' || *end != '\0')
+            return -1;
+        ctx->s.max_depth = max_depth;
+        return 0;
     }
 
-    fclose(fptr);
+    char *copy = NULL;
+    if (value != NULL) {
+        size_t len = strlen(value);
+        copy = malloc(len + 1);
+        if (copy == NULL)
+            exit(1);
+        memcpy(copy, value, len + 1);
+    }
+    free(ctx->options[opt]);
+    ctx->options[opt] = copy;
 
+    switch (opt) {
+    case LIBTREE_OPT_LDCONF:
+        ctx->s.ld_conf_file = copy;
+        break;
+    case LIBTREE_OPT_LDCACHE:
+        ctx->s.ld_cache_file = copy;
+        break;
+    case LIBTREE_OPT_LD_LIBRARY_PATH:
+        ctx->s.ld_library_path_env = copy;
+        break;
+    case LIBTREE_OPT_PLATFORM:
+        ctx->s.PLATFORM = copy;
+        break;
+    case LIBTREE_OPT_LIB:
+        ctx->s.LIB = copy;
+        break;
+    case LIBTREE_OPT_OSNAME:
+        ctx->s.OSNAME = copy;
+        break;
+    case LIBTREE_OPT_OSREL:
+        ctx->s.OSREL = copy;
+        break;
+    case LIBTREE_OPT_CACHE_FILE:
+        ctx->s.cache_file = copy;
+        break;
+    case LIBTREE_OPT_MAX_DEPTH:
+        break;
+    }
     return 0;
 }
 
-static void parse_ld_so_conf(struct libtree_state_t *s) {
-    struct string_table_t *st = &s->string_table;
-    s->ld_so_conf_offset = st->n;
-
-    // Linux / glibc
-    parse_ld_config_file(st, s->ld_conf_file);
-
-    // Replace the last semicolon with a '\0'
-    // if we have a nonzero number of paths.
-    if (st->n > s->ld_so_conf_offset) {
-        st->arr[st->n - 1] = '\0';
-    } else {
-        string_table_store(st, "");
+int libtree_resolve(struct libtree_context *ctx, char const *path,
+                    struct libtree_node const **root) {
+    struct libtree_state_t *s = &ctx->s;
+    if (!ctx->loaded) {
+        libtree_state_load(s);
+        s->dag->by_depth = 1;
+        ctx->loaded = 1;
     }
-}
 
-static void parse_ld_library_path(struct libtree_state_t *s) {
-    s->ld_library_path_offset = SIZE_MAX;
-    char *val = getenv("LD_LIBRARY_PATH");
+    struct dag_node_t *node;
+    int code = dag_root(path, s, &node);
+    if (code != 0)
+        return code;
 
-    // not set, so nothing to do.
-    if (val == NULL)
-        return;
+    // The same errors as when the tree is printed.
+    struct elf_record_t const *r = node->record;
+    if (r->has_dynamic && r->dynamic_error != 0)
+        return r->dynamic_error;
+    if (r->has_dynamic && r->needed_error != 0)
+        return r->needed_error;
 
-    s->ld_library_path_offset = s->string_table.n;
+    dag_resolve_all(node, s);
+    *root = (struct libtree_node const *)node;
+    return 0;
+}
 
-    // otherwise, we just copy it over and replace ; with :
-    string_table_store(&s->string_table, val);
+char const *libtree_strerror(int code) { return error_message(code); }
 
-    // replace ; with :
-    char *search = s->string_table.arr + s->ld_library_path_offset;
-    while ((search = strchr(search, ';')) != NULL)
-        *search++ = ':';
+char const *libtree_node_path(struct libtree_node const *node) {
+    return ((struct dag_node_t const *)node)->path;
 }
 
-static void set_default_paths(struct libtree_state_t *s) {
-    s->default_paths_offset = s->string_table.n;
-    // TODO: how to retrieve this list properly at runtime?
-    string_table_store(&s->string_table, "/lib:/lib64:/usr/lib:/usr/lib64");
+char const *libtree_node_soname(struct libtree_node const *node) {
+    struct elf_record_t const *r = ((struct dag_node_t const *)node)->record;
+    return r->soname == MAX_OFFSET_T ? NULL : r->strtab + r->soname;
 }
 
-static void libtree_state_init(struct libtree_state_t *s) {
-    s->string_table.n = 0;
-    s->string_table.capacity = 1024;
-    s->string_table.arr = malloc(s->string_table.capacity * sizeof(char));
-    s->visited.n = 0;
-    s->visited.capacity = 256;
-    s->visited.arr =
-        malloc(s->visited.capacity * sizeof(struct visited_file_t));
+size_t libtree_node_depth(struct libtree_node const *node) {
+    return ((struct dag_node_t const *)node)->depth;
 }
 
-static void libtree_state_free(struct libtree_state_t *s) {
-    free(s->string_table.arr);
-    free(s->visited.arr);
+void libtree_edges_begin(struct libtree_edge_iter *it,
+                         struct libtree_node const *node) {
+    it->node = node;
+    it->next = 0;
 }
 
-static int print_tree(int pathc, char **pathv, struct libtree_state_t *s) {
-    // First collect standard paths
-    libtree_state_init(s);
-
-    parse_ld_so_conf(s);
-    parse_ld_library_path(s);
-    set_default_paths(s);
-
-    int exit_code = 0;
-
-    for (int i = 0; i < pathc; ++i) {
-        int code = recurse(pathv[i], 0, s, (struct compat_t){.any = 1},
-                           (struct found_t){.how = INPUT});
-        fflush(stdout);
-        if (code != 0) {
-            exit_code = code;
-            fputs("Error [", stderr);
-            fputs(pathv[i], stderr);
-            fputs("]: ", stderr);
-        }
-        char *msg = NULL;
-        switch (code) {
-        case ERR_INVALID_MAGIC:
-            msg = "Invalid ELF magic bytes\n";
-            break;
-        case ERR_INVALID_CLASS:
-            msg = "Invalid ELF class\n";
-            break;
-        case ERR_INVALID_DATA:
-            msg = "Invalid ELF data\n";
-            break;
-        case ERR_INVALID_HEADER:
-            msg = "Invalid ELF header\n";
-            break;
-        case ERR_INVALID_BITS:
-            msg = "Invalid bits\n";
-            break;
-        case ERR_INVALID_ENDIANNESS:
-            msg = "Invalid endianness\n";
-            break;
-        case ERR_NO_EXEC_OR_DYN:
-            msg = "Not an ET_EXEC or ET_DYN ELF file\n";
-            break;
-        case ERR_INVALID_PHOFF:
-            msg = "Invalid ELF program header offset\n";
-            break;
-        case ERR_INVALID_PROG_HEADER:
-            msg = "Invalid ELF program header\n";
-            break;
-        case ERR_CANT_STAT:
-            msg = "Can't stat file\n";
-            break;
-        case ERR_INVALID_DYNAMIC_SECTION:
-            msg = "Invalid ELF dynamic section\n";
-            break;
-        case ERR_INVALID_DYNAMIC_ARRAY_ENTRY:
-            msg = "Invalid ELF dynamic array entry\n";
-            break;
-        case ERR_NO_STRTAB:
-            msg = "No ELF string table found\n";
-            break;
-        case ERR_INVALID_SONAME:
-            msg = "Can't read DT_SONAME\n";
-            break;
-        case ERR_INVALID_RPATH:
-            msg = "Can't read DT_RPATH\n";
-            break;
-        case ERR_INVALID_RUNPATH:
-            msg = "Can't read DT_RUNPATH\n";
-            break;
-        case ERR_INVALID_NEEDED:
-            msg = "Can't read DT_NEEDED\n";
-            break;
-        case ERR_DEPENDENCY_NOT_FOUND:
-            msg = "Not all dependencies were found\n";
-            break;
-        case ERR_NO_PT_LOAD:
-            msg = "No PT_LOAD found in ELF file\n";
-            break;
-        case ERR_VADDRS_NOT_ORDERED:
-            msg = "Virtual addresses are not ordered\n";
-            break;
-        case ERR_COULD_NOT_OPEN_FILE:
-            msg = "Could not open file\n";
-            break;
-        case ERR_INCOMPATIBLE_ISA:
-            msg = "Incompatible ISA\n";
-            break;
-        }
-
-        if (msg != NULL)
-            fputs(msg, stderr);
-
-        fflush(stderr);
+int libtree_edges_next(struct libtree_edge_iter *it,
+                       struct libtree_edge *edge) {
+    struct dag_node_t const *node = (struct dag_node_t const *)it->node;
+    size_t i = it->next;
+
+    if (i < node->num_edges) {
+        struct dag_edge_t const *e = &node->edges[i];
+        edge->needed = e->soname;
+        edge->node = (struct libtree_node const *)e->node;
+        edge->how = e->node == NULL ? NULL : how_name(e->reason.how);
+        edge->rpath_depth =
+            e->reason.how == RPATH ? node->depth - e->reason.up : 0;
+        edge->error = e->error;
+    } else if (i < node->num_edges + node->num_missing) {
+        edge->needed = node->missing[i - node->num_edges]->name;
+        edge->node = NULL;
+        edge->how = NULL;
+        edge->rpath_depth = 0;
+        edge->error = ERR_DEPENDENCY_NOT_FOUND;
+    } else {
+        return 0;
     }
 
-    libtree_state_free(s);
-    return exit_code;
+    ++it->next;
+    return 1;
 }
 
+#else
 int main(int argc, char **argv) {
-    // Enable or disable colors (no-color.com)
     struct libtree_state_t s;
-    s.color = getenv("NO_COLOR") == NULL && isatty(STDOUT_FILENO);
-    s.verbosity = 0;
-    s.path = 0;
-    s.max_depth = MAX_RECURSION_DEPTH;
 
     // We want to end up with an array of file names
     // in argv[1] up to argv[positional-1].
@@ -1666,19 +8050,10 @@ int main(int argc, char **argv) {
     if (uname(&uname_val) != 0)
         return 1;
 
-    // Technically this should be AT_PLATFORM, but
-    // (a) the feature is rarely used
-    // (b) it's almost always the same
-    s.PLATFORM = uname_val.machine;
-    s.OSNAME = uname_val.sysname;
-    s.OSREL = uname_val.release;
-    s.ld_conf_file = "/etc/ld.so.conf";
-
-    if (strcmp(uname_val.sysname, "FreeBSD") == 0)
-        s.ld_conf_file = "/etc/ld-elf.so.conf";
+    libtree_state_defaults(&s, &uname_val);
 
-    // TODO: how to find this value at runtime?
-    s.LIB = "lib";
+    // Enable or disable colors (no-color.com)
+    s.color = getenv("NO_COLOR") == NULL && isatty(STDOUT_FILENO);
 
     int opt_help = 0;
     int opt_version = 0;
@@ -1723,17 +8098,77 @@ int main(int argc, char **argv) {
                     return 1;
                 }
                 s.ld_conf_file = argv[++i];
+            } else if (strcmp(arg, "ldcache") == 0) {
+                // Require a value
+                if (i + 1 == argc) {
+                    fputs("Expected value after `--ldcache`\n", stderr);
+                    return 1;
+                }
+                s.ld_cache_file = argv[++i];
+            } else if (strcmp(arg, "format") == 0) {
+                // Require a value
+                if (i + 1 == argc) {
+                    fputs("Expected value after `--format`\n", stderr);
+                    return 1;
+                }
+                char const *format = argv[++i];
+                if (strcmp(format, "tree") == 0) {
+                    s.format = FORMAT_TREE;
+                } else if (strcmp(format, "ndjson") == 0) {
+                    s.format = FORMAT_NDJSON;
+                } else if (strcmp(format, "json") == 0) {
+                    s.format = FORMAT_JSON;
+                } else if (strcmp(format, "dot") == 0) {
+                    s.format = FORMAT_DOT;
+                } else {
+                    fputs("Unknown format `", stderr);
+                    fputs(format, stderr);
+                    fputs("`, expected tree, ndjson, json or dot\n", stderr);
+                    return 1;
+                }
+            } else if (strcmp(arg, "compress") == 0) {
+                s.compress = 1;
+            } else if (strcmp(arg, "low-metadata") == 0) {
+                s.low_metadata = 1;
+            } else if (strcmp(arg, "symbols") == 0) {
+                s.symbols = 1;
+            } else if (strcmp(arg, "unused") == 0) {
+                s.unused = 1;
+            } else if (strcmp(arg, "cost") == 0) {
+                s.cost = 1;
+            } else if (strcmp(arg, "probes") == 0) {
+                s.probes = 1;
+            } else if (strcmp(arg, "stats") == 0) {
+                s.print_stats = STATS_TEXT;
+            } else if (strcmp(arg, "stats-json") == 0) {
+                s.print_stats = STATS_JSON;
+            } else if (strcmp(arg, "cache") == 0) {
+                // Require a value
+                if (i + 1 == argc) {
+                    fputs("Expected value after `--cache`\n", stderr);
+                    return 1;
+                }
+                s.cache_file = argv[++i];
+            } else if (strcmp(arg, "stdin") == 0) {
+                s.read_stdin = 1;
+            } else if (strcmp(arg, "scan") == 0) {
+                s.scan = 1;
+            } else if (strcmp(arg, "jobs") == 0) {
+                // Require a value
+                if (i + 1 == argc) {
+                    fputs("Expected value after `--jobs`\n", stderr);
+                    return 1;
+                }
+                if (parse_jobs(argv[++i], &s.jobs) != 0)
+                    return 1;
             } else if (strcmp(arg, "max-depth") == 0) {
                 // Require a value
                 if (i + 1 == argc) {
                     fputs("Expected value after `--max-depth`\n", stderr);
                     return 1;
                 }
-                // Limit it by MAX_RECURSION_DEPTH.
                 char *ptr;
                 s.max_depth = strtoul(argv[++i], &ptr, 10);
-                if (s.max_depth > MAX_RECURSION_DEPTH)
-                    s.max_depth = MAX_RECURSION_DEPTH;
             } else {
                 fputs("Unrecognized flag `--", stderr);
                 fputs(arg, stderr);
@@ -1756,6 +8191,23 @@ int main(int argc, char **argv) {
             case 'v':
                 ++s.verbosity;
                 break;
+            case '0':
+                s.read_stdin = 1;
+                s.delimiter = '\0';
+                break;
+            case 'j':
+                // The value follows directly, or is the next argument.
+                if (arg[1] != '\0') {
+                    if (parse_jobs(arg + 1, &s.jobs) != 0)
+                        return 1;
+                } else if (i + 1 == argc) {
+                    fputs("Expected value after `-j`\n", stderr);
+                    return 1;
+                } else if (parse_jobs(argv[++i], &s.jobs) != 0) {
+                    return 1;
+                }
+                arg = strchr(arg, '\0') - 1;
+                break;
             default:
                 fputs("Unrecognized flag `-", stderr);
                 fputs(arg, stderr);
@@ -1769,7 +8221,7 @@ int main(int argc, char **argv) {
     --positional;
 
     // Print a help message on -h, --help or no positional args.
-    if (opt_help || (!opt_version && positional == 0)) {
+    if (opt_help || (!opt_version && !s.read_stdin && positional == 0)) {
         // clang-format off
         fputs("Show the dynamic dependency tree of ELF files\n"
               "Usage: libtree [OPTION]... [--] FILE [FILES]...\n"
@@ -1785,10 +8237,36 @@ int main(int argc, char **argv) {
               "  -v               Show libraries skipped by default*\n"
               "  -vv              Show dependencies of libraries skipped by default*\n"
               "  -vvv             Show dependencies of already encountered libraries\n"
+              "  --compress       Show dependencies of a library once, and refer back to\n"
+              "                   them by line number #n afterwards\n"
+              "  --format <fmt>   Print a tree (default), or ndjson records, a json\n"
+              "                   document or a dot graph\n"
+              "  -j, --jobs <n>   Locate libraries on n threads,\n"
+              "                   or one per processor when n is 0\n"
+              "  --stdin          Read more file names from stdin, one per line\n"
+              "  -0               Like --stdin, but file names are separated by NUL\n"
+              "  --scan           Analyze all ELF executables and libraries in the given\n"
+              "                   directories, recursively\n"
               "  --ldconf <path>  Config file for extra search paths [", stdout);
         fputs(s.ld_conf_file, stdout);
         fputs("]\n"
+              "  --ldcache <path> Look up libraries in a binary ld.so.cache instead of\n"
+              "                   the directories from ld config files\n"
               "  --max-depth <n>  Limit library traversal to at most n levels of depth\n"
+              "  --cache <path>   Remember parsed files and directory listings in this\n"
+              "                   file, and reuse them in later runs if unchanged\n"
+              "  --low-metadata   Open files relative to their directory and read only\n"
+              "                   what is parsed, for network file systems\n"
+              "  --symbols        Check that the undefined symbols and symbol versions\n"
+              "                   are defined, like the dynamic loader does\n"
+              "  --unused         Report libraries needed by files that use none of\n"
+              "                   their symbols, and what leaving them out saves\n"
+              "  --cost           Estimate the startup cost of every library from its\n"
+              "                   relocations, symbols and segments, heaviest first\n"
+              "  --probes         Count the files the dynamic loader tries before it\n"
+              "                   finds a library, and suggest shorter RPATHs and RUNPATHs\n"
+              "  --stats          Print what it took to locate the libraries to stderr\n"
+              "  --stats-json     The same as --stats, as a JSON object\n"
               "\n"
               "* For brevity, the following libraries are not shown by default:\n"
               "  ",
@@ -1833,5 +8311,15 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    // Structured output is for tools, not terminals.
+    if (s.format != FORMAT_TREE)
+        s.color = 0;
+
+    // libc and the like define most symbols and take long to load, so they
+    // are located too.
+    if ((s.symbols || s.unused || s.cost || s.probes) && s.verbosity == 0)
+        s.verbosity = 1;
+
     return print_tree(positional, argv, &s);
 }
+#endif
@@ -0,0 +1,108 @@
+// libtree as a library: locate the dependencies of ELF files in-process,
+// with a context that keeps parsed files, directory listings and resolved
+// dependencies around between calls.
+//
+// A context is not thread-safe, use one per thread. Everything a context
+// returns stays valid until it is freed. Like the libtree binary, the library
+// exits the process when it runs out of memory.
+
+#ifndef LIBTREE_H
+#define LIBTREE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct libtree_context;
+struct libtree_node;
+
+enum libtree_option {
+    // Config file for extra search paths, default /etc/ld.so.conf.
+    LIBTREE_OPT_LDCONF,
+    // Look up libraries in this binary ld.so.cache instead of the
+    // directories from the ld config files, default NULL.
+    LIBTREE_OPT_LDCACHE,
+    // Use this instead of the LD_LIBRARY_PATH environment variable, NULL
+    // when it should be considered unset.
+    LIBTREE_OPT_LD_LIBRARY_PATH,
+    // Substitutions for $PLATFORM, $LIB, $OSNAME and $OSREL in rpaths and
+    // runpaths, by default those of the machine.
+    LIBTREE_OPT_PLATFORM,
+    LIBTREE_OPT_LIB,
+    LIBTREE_OPT_OSNAME,
+    LIBTREE_OPT_OSREL,
+    // Resolve dependencies up to this depth, default 32.
+    LIBTREE_OPT_MAX_DEPTH,
+    // Remember parsed files and directory listings in this file when the
+    // context is freed, and reuse them if unchanged, default NULL.
+    LIBTREE_OPT_CACHE_FILE
+};
+
+// A dependency of a node, in the order in which the tree shows them:
+// located libraries, DT_NEEDED paths that could not be used, and then the
+// libraries that could not be found.
+struct libtree_edge {
+    // The DT_NEEDED entry.
+    char const *needed;
+    // NULL when the library could not be used.
+    struct libtree_node const *node;
+    // Where the library was found, one of "direct", "rpath",
+    // "LD_LIBRARY_PATH", "runpath", "ld.so.conf", "ld.so.cache" or
+    // "default path", and NULL when it was not found.
+    char const *how;
+    // For "rpath", the depth of the node whose rpath it was found in.
+    size_t rpath_depth;
+    // 0, or an error code as for libtree_resolve().
+    int error;
+};
+
+struct libtree_edge_iter {
+    struct libtree_node const *node;
+    size_t next;
+};
+
+// Returns NULL when the machine type can't be determined.
+struct libtree_context *libtree_context_new(void);
+
+// Frees the context and everything it returned, and writes the cache file
+// if one was set.
+void libtree_context_free(struct libtree_context *ctx);
+
+// Options are copied, and can only be set before the first call to
+// libtree_resolve(). Returns 0 on success, and -1 otherwise.
+int libtree_context_set(struct libtree_context *ctx, enum libtree_option opt,
+                        char const *value);
+
+// Locate the dependencies of the file at `path`, and of theirs, up to the
+// maximum depth. Common libraries such as libc are included. Returns 0 and
+// sets `*root`, or an error code, which is the exit code the libtree binary
+// would have for the file. Files that were resolved before are not touched
+// again, so repeated queries are cheap.
+int libtree_resolve(struct libtree_context *ctx, char const *path,
+                    struct libtree_node const **root);
+
+// The description of an error code, or NULL if it is none.
+char const *libtree_strerror(int code);
+
+char const *libtree_node_path(struct libtree_node const *node);
+
+// DT_SONAME, or NULL if the file has none.
+char const *libtree_node_soname(struct libtree_node const *node);
+
+// 0 for the file that was resolved, 1 for its dependencies, and so on.
+size_t libtree_node_depth(struct libtree_node const *node);
+
+// Iterate over the dependencies of a node, which has none beyond the maximum
+// depth. libtree_edges_next() returns 0 when there are no more.
+void libtree_edges_begin(struct libtree_edge_iter *it,
+                         struct libtree_node const *node);
+int libtree_edges_next(struct libtree_edge_iter *it,
+                       struct libtree_edge *edge);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,54 @@
+// Print the dependencies of the given files through the library, with one
+// context for all of them.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "libtree.h"
+
+static void print(struct libtree_node const *node) {
+    struct libtree_edge_iter it;
+    struct libtree_edge e;
+    libtree_edges_begin(&it, node);
+    while (libtree_edges_next(&it, &e)) {
+        for (size_t i = 0; i < libtree_node_depth(node) + 1; ++i)
+            fputs("  ", stdout);
+        if (e.node != NULL) {
+            printf("%s [%s] %s\n", e.needed, e.how, libtree_node_path(e.node));
+            print(e.node);
+        } else {
+            printf("%s: %s\n", e.needed,
+                   e.error ? libtree_strerror(e.error) : "not usable");
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    struct libtree_context *ctx = libtree_context_new();
+    if (ctx == NULL)
+        return 1;
+
+    int exit_code = 0;
+    for (int i = 1; i < argc; ++i) {
+        struct libtree_node const *root, *again;
+        int code = libtree_resolve(ctx, argv[i], &root);
+        if (code != 0) {
+            printf("%s: %s\n", argv[i], libtree_strerror(code));
+            exit_code = code;
+            continue;
+        }
+        printf("%s\n", libtree_node_path(root));
+        print(root);
+
+        // The second query is answered from the context.
+        if (libtree_resolve(ctx, argv[i], &again) != 0 || again != root)
+            return 1;
+    }
+
+    // Options can't change once the context is in use.
+    if (libtree_context_set(ctx, LIBTREE_OPT_MAX_DEPTH, "1") != -1)
+        return 1;
+
+    libtree_context_free(ctx);
+    return exit_code;
+}